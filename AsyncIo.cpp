@@ -0,0 +1,211 @@
+#include "AsyncIo.h"
+#include "BoundedQueue.h"
+#include "IOException.h"
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#include <cstring>
+#endif
+
+// Logger
+static std::shared_ptr<spdlog::logger> LOG = spdlog::stdout_color_mt("AsyncIo");
+
+
+/// <summary>
+/// Runs requests on a pool of threads issuing blocking positional reads and writes. Portable, and with enough
+/// threads it still keeps a deep queue at the device.
+/// </summary>
+class ThreadAsyncIo : public AsyncIo
+{
+
+private:
+	BoundedQueue<Request*> submitted;
+	BoundedQueue<Request*> completed;
+	std::vector<std::thread> workers;
+
+	void workerLoop()
+	{
+		Request *request;
+		while (submitted.pop(request))
+		{
+			try
+			{
+				if (request->write) request->file->writeAt(request->offset, request->buffer, request->length);
+				else request->file->readAt(request->offset, request->buffer, request->length);
+				request->done = request->length;
+			}
+			catch (const IOException &e) { request->error = e.what(); }
+			completed.push(request);
+		}
+	}
+
+public:
+	explicit ThreadAsyncIo(const unsigned int queueDepth)
+		:submitted(queueDepth), completed(queueDepth)
+	{
+		const unsigned int threadCount = std::min(queueDepth, 16u);
+		for (unsigned int i = 0; i < threadCount; ++i) workers.emplace_back(&ThreadAsyncIo::workerLoop, this);
+	}
+
+	~ThreadAsyncIo()
+	{
+		submitted.close();
+		for (auto &worker : workers) worker.join();
+	}
+
+	void submit(Request *request) override
+	{
+		request->done = 0;
+		submitted.push(request);
+	}
+
+	Request * wait() override
+	{
+		Request *request = nullptr;
+		completed.pop(request);
+		return request;
+	}
+
+	Request * poll() override
+	{
+		Request *request = nullptr;
+		completed.tryPop(request);
+		return request;
+	}
+
+	const char * name() const override { return "threads"; }
+
+};
+
+
+#ifdef HAVE_LIBURING
+
+/// <summary>
+/// Submits requests to an io_uring submission queue and reaps them from its completion queue, so a single
+/// thread keeps the whole queue depth in flight without a system call per request.
+/// </summary>
+class UringAsyncIo : public AsyncIo
+{
+
+private:
+	io_uring ring;
+
+	void prepare(Request *request)
+	{
+		io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+		if (!sqe) {
+			// the submission queue is full of prepared requests, hand them to the kernel first
+			io_uring_submit(&ring);
+			sqe = io_uring_get_sqe(&ring);
+		}
+
+		const int fd = request->file->descriptor();
+		if (request->write) io_uring_prep_write(sqe, fd, request->buffer + request->done, static_cast<unsigned int>(request->length - request->done), request->offset + request->done);
+		else io_uring_prep_read(sqe, fd, request->buffer + request->done, static_cast<unsigned int>(request->length - request->done), request->offset + request->done);
+		io_uring_sqe_set_data(sqe, request);
+	}
+
+	/// <summary>
+	/// Consumes a completion. Short transfers and interrupted requests are submitted again.
+	/// </summary>
+	/// <returns>The request if it is complete or failed, <c>nullptr</c> if it was submitted again</returns>
+	Request * reap(io_uring_cqe *cqe)
+	{
+		Request *request = static_cast<Request*>(io_uring_cqe_get_data(cqe));
+		const int transferred = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+
+		if (transferred == -EINTR || transferred == -EAGAIN) {
+			prepare(request);
+			io_uring_submit(&ring);
+			return nullptr;
+		}
+		if (transferred < 0) {
+			request->error = "Could not " + std::string(request->write ? "write " : "read ") + request->file->getFilename() + " at offset "
+				+ std::to_string(request->offset + request->done) + " : " + std::strerror(-transferred);
+			return request;
+		}
+		if (transferred == 0 && !request->write) {
+			request->error = "Could not read " + request->file->getFilename() + " at offset " + std::to_string(request->offset + request->done) + " : end of file";
+			return request;
+		}
+
+		// short transfers are continued until the whole request is done
+		request->done += static_cast<size_t>(transferred);
+		if (request->done == request->length) return request;
+		prepare(request);
+		io_uring_submit(&ring);
+		return nullptr;
+	}
+
+public:
+	explicit UringAsyncIo(const unsigned int queueDepth)
+	{
+		const int result = io_uring_queue_init(queueDepth, &ring, 0);
+		if (result < 0) {
+			throw IOException(std::string("io_uring is not available : ") + std::strerror(-result));
+		}
+	}
+
+	~UringAsyncIo()
+	{
+		io_uring_queue_exit(&ring);
+	}
+
+	void submit(Request *request) override
+	{
+		request->done = 0;
+		prepare(request);
+		io_uring_submit(&ring);
+	}
+
+	Request * wait() override
+	{
+		for (;;)
+		{
+			io_uring_cqe *cqe;
+			const int result = io_uring_wait_cqe(&ring, &cqe);
+			if (result == -EINTR) continue;
+			if (result < 0) throw IOException(std::string("io_uring wait failed : ") + std::strerror(-result));
+
+			Request *request = reap(cqe);
+			if (request) return request;
+		}
+	}
+
+	Request * poll() override
+	{
+		io_uring_cqe *cqe;
+		while (io_uring_peek_cqe(&ring, &cqe) == 0)
+		{
+			Request *request = reap(cqe);
+			if (request) return request;
+		}
+		return nullptr;
+	}
+
+	const char * name() const override { return "io_uring"; }
+
+};
+
+#endif
+
+
+std::unique_ptr<AsyncIo> AsyncIo::create(const unsigned int queueDepth)
+{
+#ifdef HAVE_LIBURING
+	try
+	{
+		return std::unique_ptr<AsyncIo>(new UringAsyncIo(queueDepth));
+	}
+	catch (const IOException &e)
+	{
+		// e.g. an old kernel, or io_uring disabled by a sandbox
+		LOG->warn("{}, falling back to threads", e.what());
+	}
+#endif
+	return std::unique_ptr<AsyncIo>(new ThreadAsyncIo(queueDepth));
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <cstdint>
+#include "Utils.h"
+
+/// <summary>
+/// Asynchronous positional reads and writes. Requests are submitted without waiting, many can be in flight at
+/// once, across any number of files, and completions are collected one at a time in whatever order the device
+/// finishes them. <see cref="create"/> picks io_uring when the program was built with HAVE_LIBURING (and linked
+/// against liburing) and the running kernel allows it, and a pool of threads issuing blocking pread/pwrite otherwise.
+/// An instance is driven by a single thread.
+/// </summary>
+class AsyncIo
+{
+
+public:
+	/// <summary>
+	/// One read or write. The request, the file and the buffer must stay valid until the request completes.
+	/// </summary>
+	struct Request {
+		fileUtils::RandomAccessFile *file;
+		uint64_t offset;
+		unsigned char *buffer;
+		size_t length;
+		bool write;
+		/// <summary>Free for the caller, e.g. to find its own state from a completion.</summary>
+		void *context;
+		/// <summary>Bytes transferred so far, maintained by the backend.</summary>
+		size_t done;
+		/// <summary>Empty unless the request failed.</summary>
+		std::string error;
+	};
+
+	virtual ~AsyncIo() {}
+
+	/// <summary>
+	/// Starts a request. At most the queue depth given to <see cref="create"/> may be in flight.
+	/// </summary>
+	/// <param name="request">The request.</param>
+	virtual void submit(Request *request) = 0;
+
+	/// <summary>
+	/// Waits for the next request to complete. A request only completes once all of its bytes were
+	/// transferred, or with <see cref="Request::error"/> set.
+	/// </summary>
+	/// <returns>The completed request</returns>
+	virtual Request * wait() = 0;
+
+	/// <summary>
+	/// Collects the next completed request without waiting, see <see cref="wait"/>.
+	/// </summary>
+	/// <returns>The completed request, or <c>nullptr</c> if none has completed yet</returns>
+	virtual Request * poll() = 0;
+
+	/// <summary>
+	/// Gets the name of the backend, for logging.
+	/// </summary>
+	/// <returns></returns>
+	virtual const char * name() const = 0;
+
+	/// <summary>
+	/// Creates the best available backend.
+	/// </summary>
+	/// <param name="queueDepth">Maximum number of requests in flight.</param>
+	/// <returns>The backend</returns>
+	static std::unique_ptr<AsyncIo> create(const unsigned int queueDepth);
+
+};
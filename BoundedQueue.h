@@ -0,0 +1,99 @@
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+/// <summary>
+/// A blocking first-in first-out queue with a fixed capacity. Producers wait while it is full, consumers while
+/// it is empty. Closing the queue wakes everyone: pushes fail from then on, pops drain what is left and then fail.
+/// </summary>
+template<typename T>
+class BoundedQueue
+{
+
+private:
+	std::deque<T> items;
+	const size_t capacity;
+	bool closed;
+	std::mutex mutex;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+
+public:
+
+	/// <summary>
+	/// Initializes a new instance of the <see cref="BoundedQueue"/> class.
+	/// </summary>
+	/// <param name="capacity">Maximum number of queued items, at least 1.</param>
+	explicit BoundedQueue(const size_t capacity) :capacity(capacity), closed(false) {}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	/// <summary>
+	/// Adds an item, waiting for room.
+	/// </summary>
+	/// <param name="item">The item.</param>
+	/// <returns><c>false</c> if the queue was closed; the item was not added.</returns>
+	bool push(T item)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+			if (closed) return false;
+			items.push_back(std::move(item));
+		}
+		notEmpty.notify_one();
+		return true;
+	}
+
+	/// <summary>
+	/// Removes the oldest item, waiting for one.
+	/// </summary>
+	/// <param name="item">Receives the item.</param>
+	/// <returns><c>false</c> if the queue is closed and empty.</returns>
+	bool pop(T &item)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+			if (items.empty()) return false;
+			item = std::move(items.front());
+			items.pop_front();
+		}
+		notFull.notify_one();
+		return true;
+	}
+
+	/// <summary>
+	/// Removes the oldest item if there is one, without waiting.
+	/// </summary>
+	/// <param name="item">Receives the item.</param>
+	/// <returns><c>false</c> if the queue is empty.</returns>
+	bool tryPop(T &item)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (items.empty()) return false;
+			item = std::move(items.front());
+			items.pop_front();
+		}
+		notFull.notify_one();
+		return true;
+	}
+
+	/// <summary>
+	/// Closes the queue and wakes all waiting threads.
+	/// </summary>
+	void close()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			closed = true;
+		}
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+
+};
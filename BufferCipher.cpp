@@ -0,0 +1,65 @@
+#include "BufferCipher.h"
+#include "GeneralSecurityException.h"
+#include "RandomSource.h"
+#include "misc.h"
+#include <stdexcept>
+#include <cstring>
+
+
+BufferCipher::BufferCipher(const CryptoPP::SecByteBlock &key)
+	:counter(0)
+{
+	RandomSource::generate(noncePrefix, sizeof(noncePrefix));
+	// the key schedule is expanded once, each message only resynchronizes the nonce
+	encryptor.SetKey(key, key.size());
+	decryptor.SetKey(key, key.size());
+}
+
+BufferCipher::~BufferCipher()
+{
+	CryptoPP::SecureWipeBuffer(noncePrefix, sizeof(noncePrefix));
+}
+
+size_t BufferCipher::seal(const byte plaintext[], const size_t length, byte output[], const size_t outputCapacity)
+{
+	if (outputCapacity < length || outputCapacity - length < BufferCipher::OVERHEAD) {
+		throw std::length_error("Output buffer is smaller than the sealed length");
+	}
+	if (counter >= BufferCipher::MAX_MESSAGES) {
+		throw GeneralSecurityException("Message counter exhausted");
+	}
+
+	// prefix || big-endian counter, written first so the plaintext can sit right behind it
+	byte * const nonce = output;
+	const uint64_t message = counter++;
+	std::memcpy(nonce, noncePrefix, sizeof(noncePrefix));
+	nonce[8] = static_cast<byte>(message >> 24);
+	nonce[9] = static_cast<byte>(message >> 16);
+	nonce[10] = static_cast<byte>(message >> 8);
+	nonce[11] = static_cast<byte>(message);
+
+	byte * const ciphertext = output + BufferCipher::NONCE_LENGTH;
+	encryptor.EncryptAndAuthenticate(ciphertext, ciphertext + length, BufferCipher::TAG_LENGTH, nonce, BufferCipher::NONCE_LENGTH,
+		nullptr, 0, plaintext, length);
+
+	return length + BufferCipher::OVERHEAD;
+}
+
+size_t BufferCipher::open(const byte sealed[], const size_t sealedLength, byte output[], const size_t outputCapacity)
+{
+	if (sealedLength < BufferCipher::OVERHEAD) {
+		throw GeneralSecurityException("Sealed buffer is shorter than the nonce and tag");
+	}
+	const size_t length = sealedLength - BufferCipher::OVERHEAD;
+	if (outputCapacity < length) {
+		throw std::length_error("Output buffer is smaller than the plaintext length");
+	}
+
+	const byte * const ciphertext = sealed + BufferCipher::NONCE_LENGTH;
+	if (!decryptor.DecryptAndVerify(output, ciphertext + length, BufferCipher::TAG_LENGTH, sealed, BufferCipher::NONCE_LENGTH,
+		nullptr, 0, ciphertext, length)) {
+		throw GeneralSecurityException("Buffer failed authentication");
+	}
+
+	return length;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include "secblock.h"
+#include "aes.h"
+#include "gcm.h"
+
+typedef unsigned char byte;
+
+/// <summary>
+/// Encrypts and decrypts single buffers with AES-GCM into caller-provided memory, for embedding the encrypter
+/// into a long-running process. The key schedule is expanded once in the constructor, after that
+/// <see cref="seal"/> and <see cref="open"/> do not allocate. A sealed buffer is laid out as
+///
+///   nonce (12) | ciphertext (length) | tag (16)
+///
+/// so it is exactly <see cref="OVERHEAD"/> bytes longer than the plaintext, see <see cref="sealedLength"/>.
+/// The nonce is a random per-instance prefix followed by a big-endian message counter, so one instance never
+/// repeats a nonce. An instance holds cipher state and must not be used by two threads at once; create one per thread.
+/// </summary>
+class BufferCipher
+{
+
+private:
+	CryptoPP::GCM<CryptoPP::AES>::Encryption encryptor;
+	CryptoPP::GCM<CryptoPP::AES>::Decryption decryptor;
+	byte noncePrefix[8];
+	uint64_t counter;
+
+public:
+	const static unsigned int NONCE_LENGTH = 12; //bytes
+	const static unsigned int TAG_LENGTH = 16; //bytes
+	const static unsigned int OVERHEAD = NONCE_LENGTH + TAG_LENGTH; //bytes
+	const static uint64_t MAX_MESSAGES = 0xFFFFFFFFull;
+
+	/// <summary>
+	/// Size of the sealed form of a plaintext.
+	/// </summary>
+	/// <param name="plaintextLength">The plaintext length.</param>
+	/// <returns><paramref name="plaintextLength"/> + <see cref="OVERHEAD"/></returns>
+	static size_t sealedLength(const size_t plaintextLength) { return plaintextLength + OVERHEAD; }
+
+	/// <summary>
+	/// Size of the plaintext of a sealed buffer.
+	/// </summary>
+	/// <param name="sealedLength">The sealed length, at least <see cref="OVERHEAD"/>.</param>
+	/// <returns><paramref name="sealedLength"/> - <see cref="OVERHEAD"/></returns>
+	static size_t plaintextLength(const size_t sealedLength) { return sealedLength - OVERHEAD; }
+
+	/// <summary>
+	/// Initializes a new instance of the <see cref="BufferCipher"/> class.
+	/// </summary>
+	/// <param name="key">The key, 16, 24 or 32 bytes.</param>
+	explicit BufferCipher(const CryptoPP::SecByteBlock &key);
+
+	/// <summary>
+	/// Finalizes an instance of the <see cref="BufferCipher"/> class.
+	/// </summary>
+	~BufferCipher();
+
+	BufferCipher(const BufferCipher&) = delete;
+	BufferCipher& operator=(const BufferCipher&) = delete;
+
+	/// <summary>
+	/// Encrypts a buffer. Works in place when <paramref name="plaintext"/> is <paramref name="output"/> + <see cref="NONCE_LENGTH"/>.
+	/// Throws a <see cref="std::length_error"/> if the output is too small, and a <see cref="GeneralSecurityException"/>
+	/// once the instance has sealed <see cref="MAX_MESSAGES"/> buffers.
+	/// </summary>
+	/// <param name="plaintext">The plaintext.</param>
+	/// <param name="length">The plaintext length.</param>
+	/// <param name="output">The output buffer.</param>
+	/// <param name="outputCapacity">Size of the output buffer, at least <see cref="sealedLength"/>(<paramref name="length"/>).</param>
+	/// <returns>The number of bytes written</returns>
+	size_t seal(const byte plaintext[], const size_t length, byte output[], const size_t outputCapacity);
+
+	/// <summary>
+	/// Decrypts and verifies a buffer. Works in place when <paramref name="output"/> is <paramref name="sealed"/> + <see cref="NONCE_LENGTH"/>.
+	/// Throws a <see cref="std::length_error"/> if the output is too small, and a <see cref="GeneralSecurityException"/>
+	/// if the buffer is not authentic. The output is unspecified after a failure.
+	/// </summary>
+	/// <param name="sealed">The sealed buffer.</param>
+	/// <param name="sealedLength">Length of the sealed buffer.</param>
+	/// <param name="output">The output buffer.</param>
+	/// <param name="outputCapacity">Size of the output buffer, at least <see cref="plaintextLength"/>(<paramref name="sealedLength"/>).</param>
+	/// <returns>The number of bytes written</returns>
+	size_t open(const byte sealed[], const size_t sealedLength, byte output[], const size_t outputCapacity);
+
+};
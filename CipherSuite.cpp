@@ -0,0 +1,188 @@
+#include "CipherSuite.h"
+#include "EncryptedFile.h"
+#include "IOException.h"
+#include "GeneralSecurityException.h"
+#include "cpu.h"
+#include "misc.h"
+#include "spdlog/spdlog.h"
+
+#include <chrono>
+#include <vector>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+
+// Logger
+static std::shared_ptr<spdlog::logger> LOG = spdlog::stdout_color_mt("CipherSuite");
+
+std::atomic<CipherSuite::GcmTables> CipherSuite::gcmTables(CipherSuite::GcmTables::AUTO);
+
+
+bool CipherSuite::isSupported(const byte suite)
+{
+	return suite == EncryptedFileHeader::SUITE_AES_256_GCM || suite == EncryptedFileHeader::SUITE_CHACHA20_POLY1305;
+}
+
+const char * CipherSuite::name(const byte suite)
+{
+	switch (suite)
+	{
+	case EncryptedFileHeader::SUITE_AES_256_GCM: return "aes-256-gcm";
+	case EncryptedFileHeader::SUITE_CHACHA20_POLY1305: return "chacha20-poly1305";
+	default: return "unknown";
+	}
+}
+
+byte CipherSuite::fromName(const std::string &name)
+{
+	if (name == "auto") return CipherSuite::fastest();
+	if (name == CipherSuite::name(EncryptedFileHeader::SUITE_AES_256_GCM)) return EncryptedFileHeader::SUITE_AES_256_GCM;
+	if (name == CipherSuite::name(EncryptedFileHeader::SUITE_CHACHA20_POLY1305)) return EncryptedFileHeader::SUITE_CHACHA20_POLY1305;
+	throw IOException("Unknown cipher suite " + name);
+}
+
+std::unique_ptr<CipherSuite::Aead> CipherSuite::createEngine(const byte suite, const CryptoPP::SecByteBlock &key, const bool largeTables)
+{
+	switch (suite)
+	{
+	case EncryptedFileHeader::SUITE_AES_256_GCM:
+		if (largeTables) return std::unique_ptr<Aead>(new Engine<AesGcmLargeTables>(key));
+		return std::unique_ptr<Aead>(new Engine<AesGcm>(key));
+	case EncryptedFileHeader::SUITE_CHACHA20_POLY1305: return std::unique_ptr<Aead>(new Engine<ChaCha20Poly1305>(key));
+	default: throw GeneralSecurityException("Unsupported cipher suite " + std::to_string(suite));
+	}
+}
+
+std::unique_ptr<CipherSuite::Aead> CipherSuite::create(const byte suite, const CryptoPP::SecByteBlock &key, const uint64_t workload)
+{
+	return CipherSuite::createEngine(suite, key, CipherSuite::useLargeTables(workload));
+}
+
+std::shared_ptr<CipherSuite::Aead> CipherSuite::threadEngine(const byte suite, const CryptoPP::SecByteBlock &key, const uint64_t workload)
+{
+	struct Cached {
+		byte suite;
+		bool largeTables;
+		CryptoPP::SecByteBlock key;
+		std::shared_ptr<Aead> aead;
+	};
+	// most recently used first
+	static thread_local std::vector<Cached> engines;
+
+	const bool largeTables = suite == EncryptedFileHeader::SUITE_AES_256_GCM && CipherSuite::useLargeTables(workload);
+	for (auto it = engines.begin(); it != engines.end(); ++it)
+	{
+		if (it->suite == suite && it->largeTables == largeTables && it->key.size() == key.size() && CryptoPP::VerifyBufsEqual(it->key, key, key.size())) {
+			std::rotate(engines.begin(), it, it + 1);
+			return engines.front().aead;
+		}
+	}
+
+	if (engines.size() == CipherSuite::THREAD_ENGINES) engines.pop_back();
+	engines.insert(engines.begin(), Cached{ suite, largeTables, key, std::shared_ptr<Aead>(CipherSuite::createEngine(suite, key, largeTables)) });
+	return engines.front().aead;
+}
+
+bool CipherSuite::useLargeTables(const uint64_t workload)
+{
+	switch (CipherSuite::gcmTables.load(std::memory_order_relaxed))
+	{
+	case GcmTables::SMALL: return false;
+	case GcmTables::LARGE: return true;
+	default:
+		// carry-less multiply hashes without tables, and small workloads do not pay back the setup
+		return !CipherSuite::hasCarrylessMultiply() && workload >= CipherSuite::LARGE_TABLES_MIN_WORKLOAD;
+	}
+}
+
+bool CipherSuite::hasCarrylessMultiply()
+{
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64
+	return CryptoPP::HasCLMUL();
+#elif CRYPTOPP_BOOL_ARM32 || CRYPTOPP_BOOL_ARMV8
+	return CryptoPP::HasPMULL();
+#else
+	return false;
+#endif
+}
+
+bool CipherSuite::hasAesHardware()
+{
+#if CRYPTOPP_BOOL_X86 || CRYPTOPP_BOOL_X32 || CRYPTOPP_BOOL_X64
+	return CryptoPP::HasAESNI() && CryptoPP::HasCLMUL();
+#elif CRYPTOPP_BOOL_ARM32 || CRYPTOPP_BOOL_ARMV8
+	return CryptoPP::HasAES() && CryptoPP::HasPMULL();
+#else
+	return false;
+#endif
+}
+
+/// <summary>
+/// Best time of a few seals of the calibration buffer, in nanoseconds.
+/// </summary>
+static int64_t calibrate(CipherSuite::Aead &aead)
+{
+	const byte nonce[12] = {};
+	std::vector<byte> plaintext(CipherSuite::CALIBRATION_SIZE);
+	std::vector<byte> sealed(CipherSuite::CALIBRATION_SIZE + 16);
+
+	int64_t best = INT64_MAX;
+	for (unsigned int i = 0; i < CipherSuite::CALIBRATION_ROUNDS; ++i)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		aead.seal(nonce, nullptr, 0, plaintext.data(), plaintext.size(), sealed.data());
+		best = std::min<int64_t>(best, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count());
+	}
+	return best;
+}
+
+static int64_t calibrate(const byte suite)
+{
+	const CryptoPP::SecByteBlock key(32);
+	return calibrate(*CipherSuite::create(suite, key, CipherSuite::CALIBRATION_SIZE));
+}
+
+byte CipherSuite::fastest()
+{
+	static const byte suite = []() {
+		// software AES is several times slower than ChaCha20, no need to measure
+		if (!CipherSuite::hasAesHardware()) {
+			LOG->info("No AES instructions, using {}", CipherSuite::name(EncryptedFileHeader::SUITE_CHACHA20_POLY1305));
+			return EncryptedFileHeader::SUITE_CHACHA20_POLY1305;
+		}
+
+		const int64_t aesGcm = calibrate(EncryptedFileHeader::SUITE_AES_256_GCM);
+		const int64_t chaCha = calibrate(EncryptedFileHeader::SUITE_CHACHA20_POLY1305);
+		const byte fastest = chaCha < aesGcm ? EncryptedFileHeader::SUITE_CHACHA20_POLY1305 : EncryptedFileHeader::SUITE_AES_256_GCM;
+		LOG->info("Calibrated {} at {} us and {} at {} us per MiB, using {}", CipherSuite::name(EncryptedFileHeader::SUITE_AES_256_GCM), aesGcm / 1000,
+			CipherSuite::name(EncryptedFileHeader::SUITE_CHACHA20_POLY1305), chaCha / 1000, CipherSuite::name(fastest));
+		return fastest;
+	}();
+	return suite;
+}
+
+std::vector<std::string> CipherSuite::report()
+{
+	std::vector<std::string> lines;
+	const char * const tables[] = { "auto", "2K", "64K" };
+	lines.push_back(std::string("AES instructions: ") + (CipherSuite::hasAesHardware() ? "yes" : "no")
+		+ ", carry-less multiply: " + (CipherSuite::hasCarrylessMultiply() ? "yes" : "no")
+		+ ", GCM tables: " + tables[static_cast<int>(CipherSuite::gcmTables.load(std::memory_order_relaxed))]);
+
+	// every engine measured with the same key and buffer
+	const CryptoPP::SecByteBlock key(32);
+	const std::pair<std::string, std::unique_ptr<Aead>> engines[] = {
+		{ std::string(CipherSuite::name(EncryptedFileHeader::SUITE_AES_256_GCM)) + " (2K tables)", std::unique_ptr<Aead>(new Engine<AesGcm>(key)) },
+		{ std::string(CipherSuite::name(EncryptedFileHeader::SUITE_AES_256_GCM)) + " (64K tables)", std::unique_ptr<Aead>(new Engine<AesGcmLargeTables>(key)) },
+		{ CipherSuite::name(EncryptedFileHeader::SUITE_CHACHA20_POLY1305), std::unique_ptr<Aead>(new Engine<ChaCha20Poly1305>(key)) },
+	};
+	for (const auto &engine : engines)
+	{
+		const int64_t nanoseconds = std::max<int64_t>(calibrate(*engine.second), 1);
+		std::ostringstream line;
+		line << engine.first << ": " << engine.second->provider() << ", " << std::fixed << std::setprecision(0)
+			<< CipherSuite::CALIBRATION_SIZE * 1e9 / (nanoseconds * 1048576.0) << " MiB/s";
+		lines.push_back(line.str());
+	}
+	return lines;
+}
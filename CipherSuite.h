@@ -0,0 +1,210 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "secblock.h"
+#include "aes.h"
+#include "gcm.h"
+#include "chachapoly.h"
+
+typedef unsigned char byte;
+
+/// <summary>
+/// The AEAD algorithms segments can be sealed with, see <see cref="EncryptedFileHeader::getSuite"/>. Every suite
+/// takes a 256 bit key and a 96 bit nonce and produces a 128 bit tag, so the file layout does not depend on it.
+/// AES-GCM is fastest on CPUs with AES and carry-less multiply instructions, ChaCha20-Poly1305 everywhere else.
+/// Without carry-less multiply, GHASH runs on precomputed tables: 2 KiB ones are cheap to set up per key, 64 KiB
+/// ones hash bulk data much faster, see <see cref="GcmTables"/>.
+/// </summary>
+class CipherSuite
+{
+
+public:
+	const static unsigned int CALIBRATION_SIZE = 1 << 20; //bytes
+	const static unsigned int CALIBRATION_ROUNDS = 4;
+	/// <summary>Below this many bytes per key setup, the 64K tables take longer to build than they save.</summary>
+	const static uint64_t LARGE_TABLES_MIN_WORKLOAD = 1 << 22; //bytes
+	/// <summary>Engines kept per thread by <see cref="threadEngine"/>.</summary>
+	const static unsigned int THREAD_ENGINES = 4;
+
+	/// <summary>
+	/// The GHASH table size of AES-GCM engines. It does not change the ciphertext.
+	/// </summary>
+	enum class GcmTables {
+		/// <summary>64K tables for workloads of at least <see cref="LARGE_TABLES_MIN_WORKLOAD"/> without carry-less multiply, 2K tables otherwise.</summary>
+		AUTO,
+		SMALL,
+		LARGE
+	};
+
+	/// <summary>
+	/// Seals and opens single blocks with one key. Implemented by <see cref="Engine"/> for every suite.
+	/// </summary>
+	class Aead
+	{
+	public:
+		virtual ~Aead() {}
+
+		/// <summary>
+		/// Encrypts a block. The output receives the ciphertext followed by the 16 byte tag.
+		/// </summary>
+		virtual void seal(const byte nonce[], const byte aad[], const size_t aadLength, const byte plaintext[], const size_t length, byte output[]) = 0;
+
+		/// <summary>
+		/// Decrypts and verifies a block of <paramref name="length"/> bytes of ciphertext followed by its tag.
+		/// </summary>
+		virtual bool open(const byte nonce[], const byte aad[], const size_t aadLength, const byte sealed[], const size_t length, byte output[]) = 0;
+
+		/// <summary>
+		/// Gets the implementation Crypto++ runs, e.g. "AESNI", "ARMv8" or "C++".
+		/// </summary>
+		virtual std::string provider() const = 0;
+	};
+
+	/// <summary>AES-256 in Galois/Counter Mode.</summary>
+	struct AesGcm {
+		typedef CryptoPP::GCM<CryptoPP::AES> Mode;
+	};
+
+	/// <summary>AES-256 in Galois/Counter Mode, hashing with 64 KiB tables.</summary>
+	struct AesGcmLargeTables {
+		typedef CryptoPP::GCM<CryptoPP::AES, CryptoPP::GCM_64K_Tables> Mode;
+	};
+
+	/// <summary>ChaCha20-Poly1305 as in RFC 8439.</summary>
+	struct ChaCha20Poly1305 {
+		typedef CryptoPP::ChaCha20Poly1305 Mode;
+	};
+
+	/// <summary>
+	/// The engine of one suite. The mode is a template parameter, so each suite calls straight into its own
+	/// implementation and only the per-block call goes through <see cref="Aead"/>.
+	/// </summary>
+	template <class Suite>
+	class Engine final : public Aead
+	{
+	private:
+		typename Suite::Mode::Encryption encryptor;
+		typename Suite::Mode::Decryption decryptor;
+
+	public:
+		const static unsigned int NONCE_LENGTH = 12; //bytes
+		const static unsigned int TAG_LENGTH = 16; //bytes
+
+		explicit Engine(const CryptoPP::SecByteBlock &key)
+		{
+			// the key schedule is expanded once, each block only resynchronizes the nonce
+			encryptor.SetKey(key, key.size());
+			decryptor.SetKey(key, key.size());
+		}
+
+		void seal(const byte nonce[], const byte aad[], const size_t aadLength, const byte plaintext[], const size_t length, byte output[]) override
+		{
+			encryptor.EncryptAndAuthenticate(output, output + length, TAG_LENGTH, nonce, NONCE_LENGTH, aad, aadLength, plaintext, length);
+		}
+
+		bool open(const byte nonce[], const byte aad[], const size_t aadLength, const byte sealed[], const size_t length, byte output[]) override
+		{
+			return decryptor.DecryptAndVerify(output, sealed + length, TAG_LENGTH, nonce, NONCE_LENGTH, aad, aadLength, sealed, length);
+		}
+
+		std::string provider() const override { return encryptor.AlgorithmProvider(); }
+	};
+
+private:
+	static std::atomic<GcmTables> gcmTables;
+
+	/// <summary>
+	/// Creates the engine of a suite with the given GHASH table size, ignored by other suites than AES-GCM.
+	/// </summary>
+	static std::unique_ptr<Aead> createEngine(const byte suite, const CryptoPP::SecByteBlock &key, const bool largeTables);
+
+public:
+
+	/// <summary>
+	/// Checks whether a suite id is known.
+	/// </summary>
+	/// <param name="suite">The suite id.</param>
+	/// <returns><c>true</c> if files of the suite can be read and written</returns>
+	static bool isSupported(const byte suite);
+
+	/// <summary>
+	/// Gets the name of a suite, as accepted by <see cref="fromName"/>.
+	/// </summary>
+	/// <param name="suite">The suite id.</param>
+	/// <returns>The name, or "unknown"</returns>
+	static const char * name(const byte suite);
+
+	/// <summary>
+	/// Looks a suite up by name. "auto" stands for <see cref="fastest"/>. Throws an <see cref="IOException"/>
+	/// for an unknown name.
+	/// </summary>
+	/// <param name="name">The name.</param>
+	/// <returns>The suite id</returns>
+	static byte fromName(const std::string &name);
+
+	/// <summary>
+	/// Creates the engine of a suite. Throws a <see cref="GeneralSecurityException"/> for an unknown suite.
+	/// </summary>
+	/// <param name="suite">The suite id.</param>
+	/// <param name="key">The key.</param>
+	/// <param name="workload">Bytes the engine is expected to seal or open, see <see cref="useLargeTables"/>.</param>
+	/// <returns>The engine</returns>
+	static std::unique_ptr<Aead> create(const byte suite, const CryptoPP::SecByteBlock &key, const uint64_t workload = 0);
+
+	/// <summary>
+	/// Gets an engine for a long-lived key, such as the key-encryption key of a run, for the calling thread. Every
+	/// thread keeps the engines of the last <see cref="THREAD_ENGINES"/> keys it used, and a copy of those keys,
+	/// until it exits, so the key is set up once per thread rather than once per use. Short-lived keys, such as the
+	/// data key of one file, get their own engine from <see cref="create"/>. The engine must only be used on the calling
+	/// thread; it stays valid when the thread drops it for another key.
+	/// </summary>
+	/// <param name="suite">The suite id.</param>
+	/// <param name="key">The key.</param>
+	/// <param name="workload">Bytes the engine is expected to seal or open, see <see cref="useLargeTables"/>.</param>
+	/// <returns>The engine</returns>
+	static std::shared_ptr<Aead> threadEngine(const byte suite, const CryptoPP::SecByteBlock &key, const uint64_t workload = 0);
+
+	/// <summary>
+	/// Sets the GHASH table size of AES-GCM engines created from now on, for the whole process.
+	/// </summary>
+	/// <param name="tables">The table size.</param>
+	static void setGcmTables(const GcmTables tables) { CipherSuite::gcmTables.store(tables, std::memory_order_relaxed); }
+
+	/// <summary>
+	/// Decides the GHASH table size of an AES-GCM engine.
+	/// </summary>
+	/// <param name="workload">Bytes the engine is expected to seal or open.</param>
+	/// <returns><c>true</c> for 64K tables</returns>
+	static bool useLargeTables(const uint64_t workload);
+
+	/// <summary>
+	/// Checks whether the CPU has carry-less multiply instructions, with which GHASH needs no tables.
+	/// </summary>
+	/// <returns><c>true</c> if GHASH is hardware accelerated</returns>
+	static bool hasCarrylessMultiply();
+
+	/// <summary>
+	/// Checks whether the CPU has AES and carry-less multiply instructions, which AES-GCM needs to be fast.
+	/// </summary>
+	/// <returns><c>true</c> if AES-GCM is hardware accelerated</returns>
+	static bool hasAesHardware();
+
+	/// <summary>
+	/// Picks the fastest suite for this CPU. Without AES instructions that is ChaCha20-Poly1305; with them both suites
+	/// seal <see cref="CALIBRATION_SIZE"/> bytes a few times and the faster one wins. Decided once per process.
+	/// </summary>
+	/// <returns>The suite id</returns>
+	static byte fastest();
+
+	/// <summary>
+	/// Describes the crypto instructions of the CPU, the implementation every engine runs on it and the throughput
+	/// it measures, one line each.
+	/// </summary>
+	/// <returns>The report</returns>
+	static std::vector<std::string> report();
+
+};
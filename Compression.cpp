@@ -0,0 +1,59 @@
+#include "Compression.h"
+#include "GeneralSecurityException.h"
+#include "Metrics.h"
+#include "zdeflate.h"
+#include "zinflate.h"
+#include "filters.h"
+#include <cmath>
+
+
+bool Compression::isCompressible(const byte sample[], const size_t length)
+{
+	if (length == 0) return false;
+
+	size_t counts[256] = { 0 };
+	for (size_t i = 0; i < length; ++i) ++counts[sample[i]];
+
+	double entropy = 0;
+	for (const size_t count : counts)
+	{
+		if (count == 0) continue;
+		const double p = static_cast<double>(count) / length;
+		entropy -= p * std::log2(p);
+	}
+	return entropy * 1000 < Compression::MAX_ENTROPY;
+}
+
+size_t Compression::deflate(const byte input[], const size_t length, byte output[])
+{
+	Metrics::Timer timer(Metrics::COMPRESS, length);
+
+	// the sink takes at most length bytes but counts everything, so an expanding segment is detected
+	CryptoPP::ArraySink *sink = new CryptoPP::ArraySink(output, length);
+	CryptoPP::Deflator deflator(sink, Compression::LEVEL);
+	deflator.Put(input, length);
+	deflator.MessageEnd();
+
+	const uint64_t compressedLength = sink->TotalPutLength();
+	return compressedLength < length ? static_cast<size_t>(compressedLength) : 0;
+}
+
+void Compression::inflate(const byte input[], const size_t compressedLength, byte output[], const size_t length)
+{
+	Metrics::Timer timer(Metrics::COMPRESS, length);
+
+	CryptoPP::ArraySink *sink = new CryptoPP::ArraySink(output, length);
+	try
+	{
+		CryptoPP::Inflator inflator(sink);
+		inflator.Put(input, compressedLength);
+		inflator.MessageEnd();
+		if (sink->TotalPutLength() != length) {
+			throw GeneralSecurityException("Segment decompressed to " + std::to_string(sink->TotalPutLength()) + " bytes instead of " + std::to_string(length));
+		}
+	}
+	catch (const CryptoPP::Exception &e)
+	{
+		throw GeneralSecurityException(std::string("Segment can not be decompressed : ") + e.what());
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+typedef unsigned char byte;
+
+/// <summary>
+/// Raw deflate of single segments, for files flagged with <see cref="EncryptedFileHeader::FLAG_COMPRESSED"/>. Every
+/// segment is compressed on its own, so segments can still be decrypted independently and in any order. A segment
+/// that does not shrink is stored as is; the segment index tells the two apart, a stored segment being exactly
+/// its plaintext plus the tag.
+/// </summary>
+class Compression
+{
+
+public:
+	const static int LEVEL = 6;
+	const static unsigned int SAMPLE_SIZE = 1 << 16; //bytes
+	/// <summary>Above this entropy, in thousandths of a bit per byte, data is taken to be compressed already.</summary>
+	const static unsigned int MAX_ENTROPY = 7500;
+
+	/// <summary>
+	/// Estimates whether data compresses from the Shannon entropy of its byte histogram. JPEG, MP4, ZIP and
+	/// encrypted data come out close to 8 bits per byte, text and most uncompressed formats well below.
+	/// </summary>
+	/// <param name="sample">A sample of the data, e.g. its first <see cref="SAMPLE_SIZE"/> bytes.</param>
+	/// <param name="length">Length of the sample.</param>
+	/// <returns><c>true</c> if compressing is worth trying</returns>
+	static bool isCompressible(const byte sample[], const size_t length);
+
+	/// <summary>
+	/// Compresses a segment.
+	/// </summary>
+	/// <param name="input">The segment.</param>
+	/// <param name="length">Length of the segment.</param>
+	/// <param name="output">The output buffer, at least <paramref name="length"/> bytes.</param>
+	/// <returns>The compressed length, or 0 if the segment does not shrink</returns>
+	static size_t deflate(const byte input[], const size_t length, byte output[]);
+
+	/// <summary>
+	/// Decompresses a segment. Throws a <see cref="GeneralSecurityException"/> if it is malformed or does not
+	/// decompress to exactly <paramref name="length"/> bytes.
+	/// </summary>
+	/// <param name="input">The compressed segment.</param>
+	/// <param name="compressedLength">Length of the compressed segment.</param>
+	/// <param name="output">The output buffer.</param>
+	/// <param name="length">The segment length.</param>
+	static void inflate(const byte input[], const size_t compressedLength, byte output[], const size_t length);
+
+};
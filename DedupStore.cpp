@@ -0,0 +1,425 @@
+#include "DedupStore.h"
+#include "BufferCipher.h"
+#include "IOException.h"
+#include "GeneralSecurityException.h"
+#include "Endian.h"
+#include "Metrics.h"
+#include "hmac.h"
+#include "hkdf.h"
+#include "sha.h"
+#include "misc.h"
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+
+namespace filesystem = std::experimental::filesystem::v1;
+
+static const byte CATALOG_MAGIC[8] = { 'G', 'C', 'M', 'D', 'E', 'D', 'U', 'P' };
+static const char ID_KEY_INFO[] = "gcm dedup chunk id";
+static const char DATA_KEY_INFO[] = "gcm dedup chunk data";
+static const char CATALOG_KEY_INFO[] = "gcm dedup catalog";
+static const char GEAR_INFO[] = "gcm dedup gear";
+
+// the top bits of the rolling hash depend on the last 64 bytes; 16 of them are zero once per 64 KiB on average
+static const uint64_t BOUNDARY_MASK = ~(~0ull >> 16);
+static_assert(DedupStore::AVERAGE_CHUNK_SIZE == 1u << 16, "BOUNDARY_MASK must match the average chunk size");
+
+/// <summary>
+/// Derives a key for one purpose from the key of the store.
+/// </summary>
+static CryptoPP::SecByteBlock deriveKey(const CryptoPP::SecByteBlock &key, const char info[], const size_t length)
+{
+	CryptoPP::SecByteBlock derived(length);
+	CryptoPP::HKDF<CryptoPP::SHA256> hkdf;
+	hkdf.DeriveKey(derived, derived.size(), key, key.size(), nullptr, 0, reinterpret_cast<const byte*>(info), std::strlen(info));
+	return derived;
+}
+
+/// <summary>
+/// Encodes a chunk id in lower case hex.
+/// </summary>
+static std::string toHex(const byte id[])
+{
+	static const char DIGITS[] = "0123456789abcdef";
+	std::string hex(DedupStore::ID_LENGTH * 2, '0');
+	for (size_t i = 0; i < DedupStore::ID_LENGTH; ++i)
+	{
+		hex[2 * i] = DIGITS[id[i] >> 4];
+		hex[2 * i + 1] = DIGITS[id[i] & 0x0F];
+	}
+	return hex;
+}
+
+DedupStore::DedupStore(const filesystem::path &directory)
+	:directory(directory), dirty(false), storedChunks(0), storedBytes(0), reusedChunks(0), reusedBytes(0)
+{
+	std::memset(gear, 0, sizeof(gear));
+}
+
+filesystem::path DedupStore::catalogPath(const filesystem::path &directory)
+{
+	return directory / "catalog";
+}
+
+filesystem::path DedupStore::chunkPath(const std::string &id) const
+{
+	return directory / "chunks" / id.substr(0, 2) / id;
+}
+
+void DedupStore::readParameters(const filesystem::path &directory, byte salt[], uint32_t &iterations)
+{
+	const filesystem::path catalog = DedupStore::catalogPath(directory);
+	std::ifstream ifs(catalog.string(), std::ios::binary);
+	byte header[DedupStore::HEADER_LENGTH];
+	if (!ifs.read(reinterpret_cast<char*>(header), sizeof(header)) || std::memcmp(header, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0) {
+		throw IOException(directory.string() + " is not a dedup store");
+	}
+	if (endian::loadLE32(header + 8) != DedupStore::VERSION) throw IOException(directory.string() + " has an unsupported store version");
+
+	iterations = endian::loadLE32(header + 12);
+	std::memcpy(salt, header + 16, DedupStore::SALT_LENGTH);
+}
+
+void DedupStore::open(const CryptoPP::SecByteBlock &key)
+{
+	idKey = deriveKey(key, ID_KEY_INFO, 32);
+	dataKey = deriveKey(key, DATA_KEY_INFO, 32);
+	catalogKey = deriveKey(key, CATALOG_KEY_INFO, 32);
+	const CryptoPP::SecByteBlock gearBytes = deriveKey(key, GEAR_INFO, sizeof(gear));
+	for (size_t i = 0; i < 256; ++i) gear[i] = endian::loadLE64(gearBytes.data() + 8 * i);
+
+	const filesystem::path catalog = DedupStore::catalogPath(directory);
+	if (!filesystem::exists(catalog)) return;
+
+	std::vector<byte> sealed;
+	try
+	{
+		std::ifstream ifs(catalog.string(), std::ios::binary | std::ios::ate);
+		ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		const uint64_t fileSize = static_cast<uint64_t>(ifs.tellg());
+		if (fileSize < DedupStore::HEADER_LENGTH + BufferCipher::OVERHEAD) throw IOException(catalog.string() + " is truncated");
+		Metrics::Timer timer(Metrics::READ, fileSize);
+		sealed.resize(static_cast<size_t>(fileSize - DedupStore::HEADER_LENGTH));
+		ifs.seekg(DedupStore::HEADER_LENGTH);
+		ifs.read(reinterpret_cast<char*>(sealed.data()), sealed.size());
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		throw IOException(catalog.string() + " : " + e.what());
+	}
+
+	// decrypted in place, behind the nonce
+	BufferCipher cipher(catalogKey);
+	const size_t length = cipher.open(sealed.data(), sealed.size(), sealed.data() + BufferCipher::NONCE_LENGTH, BufferCipher::plaintextLength(sealed.size()));
+	const byte * const body = sealed.data() + BufferCipher::NONCE_LENGTH;
+
+	if (length < 8) throw GeneralSecurityException("Dedup catalog is truncated");
+	const uint64_t count = endian::loadLE64(body);
+	size_t position = 8;
+
+	std::map<std::string, File> loaded;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		File file;
+		if (length - position < 4) throw GeneralSecurityException("Dedup catalog is truncated");
+		const uint32_t nameLength = endian::loadLE32(body + position);
+		position += 4;
+		if (nameLength > DedupStore::MAX_NAME_LENGTH || length - position < nameLength + 16ull) throw GeneralSecurityException("Dedup catalog is malformed");
+		file.name.assign(reinterpret_cast<const char*>(body + position), nameLength);
+		position += nameLength;
+
+		file.length = endian::loadLE64(body + position);
+		const uint64_t chunkCount = endian::loadLE64(body + position + 8);
+		position += 16;
+		if ((length - position) / DedupStore::ID_LENGTH < chunkCount) throw GeneralSecurityException("Dedup catalog is truncated");
+		const size_t idsLength = static_cast<size_t>(chunkCount) * DedupStore::ID_LENGTH;
+		file.chunks.assign(body + position, body + position + idsLength);
+		position += idsLength;
+
+		loaded[file.name] = file;
+	}
+	if (position != length) throw GeneralSecurityException("Dedup catalog is malformed");
+
+	std::lock_guard<std::mutex> lock(mutex);
+	files.swap(loaded);
+	dirty = false;
+}
+
+size_t DedupStore::chunkLength(const byte data[], const size_t length) const
+{
+	if (length <= DedupStore::MIN_CHUNK_SIZE) return length;
+
+	// Gear rolling hash: one shift and one table lookup per byte. Bytes before the minimum size are
+	// skipped, a chunk can not end there anyway
+	const size_t limit = std::min<size_t>(length, DedupStore::MAX_CHUNK_SIZE);
+	uint64_t hash = 0;
+	for (size_t i = DedupStore::MIN_CHUNK_SIZE; i < limit; ++i)
+	{
+		hash = (hash << 1) + gear[data[i]];
+		if ((hash & BOUNDARY_MASK) == 0) return i + 1;
+	}
+	return limit;
+}
+
+bool DedupStore::claimChunk(const std::string &id)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (chunks.count(id) != 0) return false;
+	}
+
+	// stored by an earlier run; the stat runs outside the lock, the insert below settles races between threads
+	std::error_code ec;
+	const bool stored = filesystem::exists(chunkPath(id), ec);
+
+	std::lock_guard<std::mutex> lock(mutex);
+	return chunks.insert(id).second && !stored;
+}
+
+void DedupStore::add(const filesystem::path &file, const std::string &name)
+{
+	File stored = { name, 0, std::vector<byte>() };
+	CryptoPP::HMAC<CryptoPP::SHA256> mac(idKey, idKey.size());
+	BufferCipher cipher(dataKey);
+	std::vector<byte> buffer(DedupStore::READ_SIZE);
+	std::vector<byte> sealed(BufferCipher::sealedLength(DedupStore::MAX_CHUNK_SIZE));
+	std::string id;
+
+	try
+	{
+		std::ifstream ifs(file.string(), std::ios::binary);
+		ifs.exceptions(std::ifstream::badbit);
+		if (!ifs) throw IOException("Could not open " + file.string());
+
+		size_t start = 0;
+		size_t end = 0;
+		bool eof = false;
+		for (;;)
+		{
+			// a whole maximum chunk stays buffered, so the end of the buffer never cuts a chunk short
+			if (!eof && end - start < DedupStore::MAX_CHUNK_SIZE) {
+				std::memmove(buffer.data(), buffer.data() + start, end - start);
+				end -= start;
+				start = 0;
+				Metrics::Timer timer(Metrics::READ);
+				ifs.read(reinterpret_cast<char*>(buffer.data() + end), buffer.size() - end);
+				const size_t read = static_cast<size_t>(ifs.gcount());
+				timer.addBytes(read);
+				end += read;
+				eof = ifs.eof();
+				continue;
+			}
+			if (start == end) break;
+
+			const byte * const chunk = buffer.data() + start;
+			const size_t length = chunkLength(chunk, end - start);
+			byte digest[DedupStore::ID_LENGTH];
+			{
+				Metrics::Timer timer(Metrics::INDEX, length);
+				mac.CalculateDigest(digest, chunk, length);
+			}
+			id = toHex(digest);
+
+			if (claimChunk(id)) {
+				size_t sealedLength;
+				{
+					Metrics::Timer timer(Metrics::CIPHER, length);
+					sealedLength = cipher.seal(chunk, length, sealed.data(), sealed.size());
+				}
+
+				// written next to its place and renamed, so an interrupted run never leaves a partial chunk
+				const filesystem::path target = chunkPath(id);
+				const filesystem::path temporary = target.string() + ".tmp";
+				try
+				{
+					filesystem::create_directories(target.parent_path());
+					Metrics::Timer timer(Metrics::WRITE, sealedLength);
+					std::ofstream ofs(temporary.string(), std::ios::binary);
+					ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+					ofs.write(reinterpret_cast<const char*>(sealed.data()), sealedLength);
+					ofs.close();
+					filesystem::rename(temporary, target);
+				}
+				catch (...)
+				{
+					std::error_code ec;
+					filesystem::remove(temporary, ec);
+					// files that already refer to the chunk are dropped from the catalog on save
+					std::lock_guard<std::mutex> lock(mutex);
+					failedChunks.insert(id);
+					throw;
+				}
+				++storedChunks;
+				storedBytes += length;
+			}
+			else {
+				++reusedChunks;
+				reusedBytes += length;
+			}
+
+			stored.chunks.insert(stored.chunks.end(), digest, digest + DedupStore::ID_LENGTH);
+			stored.length += length;
+			start += length;
+		}
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		throw IOException(file.string() + " : " + e.what());
+	}
+	catch (const filesystem::filesystem_error &e)
+	{
+		throw IOException(e.what());
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	files[name] = stored;
+	dirty = true;
+}
+
+void DedupStore::restore(const File &file, const filesystem::path &destination)
+{
+	CryptoPP::HMAC<CryptoPP::SHA256> mac(idKey, idKey.size());
+	BufferCipher cipher(dataKey);
+	std::vector<byte> sealed(BufferCipher::sealedLength(DedupStore::MAX_CHUNK_SIZE));
+	const size_t chunkCount = file.chunks.size() / DedupStore::ID_LENGTH;
+
+	try
+	{
+		std::ofstream ofs(destination.string(), std::ios::binary);
+		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+
+		uint64_t written = 0;
+		for (size_t i = 0; i < chunkCount; ++i)
+		{
+			const byte * const expected = file.chunks.data() + i * DedupStore::ID_LENGTH;
+			const filesystem::path path = chunkPath(toHex(expected));
+			std::error_code ec;
+			const uint64_t sealedLength = filesystem::file_size(path, ec);
+			if (ec || sealedLength < BufferCipher::OVERHEAD || sealedLength > sealed.size()) {
+				throw GeneralSecurityException("Chunk " + path.string() + " of " + file.name + " is missing or malformed");
+			}
+
+			{
+				Metrics::Timer timer(Metrics::READ, sealedLength);
+				std::ifstream ifs(path.string(), std::ios::binary);
+				ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+				ifs.read(reinterpret_cast<char*>(sealed.data()), static_cast<std::streamsize>(sealedLength));
+			}
+
+			// decrypted in place, behind the nonce, then checked against the id the catalog names
+			size_t length;
+			{
+				Metrics::Timer timer(Metrics::CIPHER, sealedLength);
+				length = cipher.open(sealed.data(), static_cast<size_t>(sealedLength), sealed.data() + BufferCipher::NONCE_LENGTH, sealed.size() - BufferCipher::NONCE_LENGTH);
+			}
+			byte digest[DedupStore::ID_LENGTH];
+			{
+				Metrics::Timer timer(Metrics::INDEX, length);
+				mac.CalculateDigest(digest, sealed.data() + BufferCipher::NONCE_LENGTH, length);
+			}
+			if (!CryptoPP::VerifyBufsEqual(digest, expected, DedupStore::ID_LENGTH)) {
+				throw GeneralSecurityException("Chunk " + path.string() + " of " + file.name + " does not match its id");
+			}
+
+			Metrics::Timer timer(Metrics::WRITE, length);
+			ofs.write(reinterpret_cast<const char*>(sealed.data() + BufferCipher::NONCE_LENGTH), length);
+			written += length;
+		}
+
+		if (written != file.length) {
+			throw GeneralSecurityException(file.name + " has " + std::to_string(written) + " bytes instead of " + std::to_string(file.length));
+		}
+		ofs.close();
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		std::error_code ec;
+		filesystem::remove(destination, ec);
+		throw IOException(destination.string() + " : " + e.what());
+	}
+	catch (...)
+	{
+		std::error_code ec;
+		filesystem::remove(destination, ec);
+		throw;
+	}
+}
+
+std::vector<DedupStore::File> DedupStore::list()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	std::vector<File> listed;
+	listed.reserve(files.size());
+	for (const auto &item : files) listed.push_back(item.second);
+	return listed;
+}
+
+void DedupStore::save(const byte salt[], const uint32_t iterations)
+{
+	std::vector<byte> body(8);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!dirty) return;
+
+		// a file whose chunk could not be written can not be restored, so it is not recorded
+		for (auto item = files.begin(); item != files.end();)
+		{
+			bool complete = true;
+			for (size_t i = 0; complete && i < item->second.chunks.size(); i += DedupStore::ID_LENGTH)
+			{
+				complete = failedChunks.count(toHex(item->second.chunks.data() + i)) == 0;
+			}
+			item = complete ? std::next(item) : files.erase(item);
+		}
+
+		endian::storeLE64(body.data(), files.size());
+		for (const auto &item : files)
+		{
+			const File &file = item.second;
+			const size_t at = body.size();
+			body.resize(at + 4 + file.name.size() + 16);
+			endian::storeLE32(body.data() + at, static_cast<uint32_t>(file.name.size()));
+			std::memcpy(body.data() + at + 4, file.name.data(), file.name.size());
+			endian::storeLE64(body.data() + at + 4 + file.name.size(), file.length);
+			endian::storeLE64(body.data() + at + 12 + file.name.size(), file.chunks.size() / DedupStore::ID_LENGTH);
+			body.insert(body.end(), file.chunks.begin(), file.chunks.end());
+		}
+	}
+
+	std::vector<byte> catalog(DedupStore::HEADER_LENGTH + BufferCipher::sealedLength(body.size()));
+	std::memcpy(catalog.data(), CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+	endian::storeLE32(catalog.data() + 8, DedupStore::VERSION);
+	endian::storeLE32(catalog.data() + 12, iterations);
+	std::memcpy(catalog.data() + 16, salt, DedupStore::SALT_LENGTH);
+	BufferCipher cipher(catalogKey);
+	cipher.seal(body.data(), body.size(), catalog.data() + DedupStore::HEADER_LENGTH, catalog.size() - DedupStore::HEADER_LENGTH);
+
+	const filesystem::path target = DedupStore::catalogPath(directory);
+	const filesystem::path temporary = target.string() + ".tmp";
+	try
+	{
+		filesystem::create_directories(directory);
+		Metrics::Timer timer(Metrics::WRITE, catalog.size());
+		std::ofstream ofs(temporary.string(), std::ios::binary);
+		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+		ofs.write(reinterpret_cast<const char*>(catalog.data()), catalog.size());
+		ofs.close();
+		filesystem::rename(temporary, target);
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		std::error_code ec;
+		filesystem::remove(temporary, ec);
+		throw IOException(target.string() + " : " + e.what());
+	}
+	catch (const filesystem::filesystem_error &e)
+	{
+		std::error_code ec;
+		filesystem::remove(temporary, ec);
+		throw IOException(e.what());
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	dirty = false;
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <experimental/filesystem>
+#include "secblock.h"
+
+typedef unsigned char byte;
+
+/// <summary>
+/// A deduplicating store of encrypted files. Files are cut into chunks at content-defined boundaries found by a
+/// rolling hash, so an insertion or deletion only changes the chunks around it, and every distinct chunk is encrypted
+/// and stored once, however many files or versions of a file contain it. A store is a directory:
+///
+///   catalog           magic (8) | version (4) | KDF iterations (4) | salt (16) | sealed catalog, see <see cref="BufferCipher"/>
+///   chunks/xx/id      one sealed chunk, named after its id in hex, xx being the first id byte
+///
+///   catalog: file count (8), then per file: name length (4) | name | length (8) | chunk count (8) | chunk ids (32 each)
+///
+/// All keys come from the key derived from the password and the catalog salt. A chunk id is an HMAC-SHA256 of the
+/// chunk under its own key, so equal chunks get equal ids without the ids revealing anything about the plaintext,
+/// and the rolling hash uses a keyed table, so the chunk boundaries do not either. Opening a chunk checks it against
+/// its id, so chunks can not be swapped. The salt stays with the store, as the ids depend on it.
+///
+/// Safe to share between threads once opened.
+/// </summary>
+class DedupStore
+{
+
+public:
+	const static unsigned int VERSION = 1;
+	const static unsigned int HEADER_LENGTH = 32; //bytes
+	const static unsigned int SALT_LENGTH = 16; //bytes
+	const static unsigned int ID_LENGTH = 32; //bytes
+	const static unsigned int MIN_CHUNK_SIZE = 1 << 14; //bytes
+	const static unsigned int AVERAGE_CHUNK_SIZE = 1 << 16; //bytes, a power of two
+	const static unsigned int MAX_CHUNK_SIZE = 1 << 18; //bytes
+	const static unsigned int READ_SIZE = 1 << 22; //bytes
+	const static unsigned int MAX_NAME_LENGTH = 4096; //bytes
+
+	/// <summary>
+	/// A stored file.
+	/// </summary>
+	struct File {
+		/// <summary>The name, see <see cref="PackArchive::memberName"/>.</summary>
+		std::string name;
+		uint64_t length;
+		/// <summary>The ids of its chunks in order, <see cref="ID_LENGTH"/> bytes each.</summary>
+		std::vector<byte> chunks;
+	};
+
+private:
+	const std::experimental::filesystem::v1::path directory;
+	CryptoPP::SecByteBlock idKey;
+	CryptoPP::SecByteBlock dataKey;
+	CryptoPP::SecByteBlock catalogKey;
+	uint64_t gear[256];
+	std::map<std::string, File> files;
+	/// <summary>Chunks known to be stored, or being stored by some thread.</summary>
+	std::set<std::string> chunks;
+	/// <summary>Chunks that were claimed but could not be written.</summary>
+	std::set<std::string> failedChunks;
+	std::mutex mutex;
+	bool dirty;
+	std::atomic<uint64_t> storedChunks;
+	std::atomic<uint64_t> storedBytes;
+	std::atomic<uint64_t> reusedChunks;
+	std::atomic<uint64_t> reusedBytes;
+
+	/// <summary>
+	/// Gets the file a chunk is stored in.
+	/// </summary>
+	std::experimental::filesystem::v1::path chunkPath(const std::string &id) const;
+
+	/// <summary>
+	/// Length of the next chunk: the first boundary of the rolling hash past <see cref="MIN_CHUNK_SIZE"/>, at most
+	/// <see cref="MAX_CHUNK_SIZE"/>, or all of the data if it is shorter.
+	/// </summary>
+	size_t chunkLength(const byte data[], const size_t length) const;
+
+	/// <summary>
+	/// Reserves a chunk for the calling thread.
+	/// </summary>
+	/// <returns><c>true</c> if the chunk is not stored yet and the caller must store it</returns>
+	bool claimChunk(const std::string &id);
+
+public:
+
+	/// <summary>
+	/// Initializes a new instance of the <see cref="DedupStore"/> class. Nothing is read before <see cref="open"/>.
+	/// </summary>
+	/// <param name="directory">The store directory.</param>
+	explicit DedupStore(const std::experimental::filesystem::v1::path &directory);
+
+	DedupStore(const DedupStore&) = delete;
+	DedupStore& operator=(const DedupStore&) = delete;
+
+	/// <summary>
+	/// Gets the catalog file of a store.
+	/// </summary>
+	/// <param name="directory">The store directory.</param>
+	/// <returns>The catalog file</returns>
+	static std::experimental::filesystem::v1::path catalogPath(const std::experimental::filesystem::v1::path &directory);
+
+	/// <summary>
+	/// Reads the key derivation parameters of a store. Throws an <see cref="IOException"/> if the directory is not a store.
+	/// </summary>
+	/// <param name="directory">The store directory.</param>
+	/// <param name="salt">Receives the salt, <see cref="SALT_LENGTH"/> bytes.</param>
+	/// <param name="iterations">Receives the KDF iteration count.</param>
+	static void readParameters(const std::experimental::filesystem::v1::path &directory, byte salt[], uint32_t &iterations);
+
+	/// <summary>
+	/// Derives the keys of the store and loads its catalog, if there is one. Throws an <see cref="IOException"/> if it
+	/// can not be read, and a <see cref="GeneralSecurityException"/> if it is not authentic under the key.
+	/// </summary>
+	/// <param name="key">The key derived from the password and the salt of the store.</param>
+	void open(const CryptoPP::SecByteBlock &key);
+
+	/// <summary>
+	/// Stores a file under a name, replacing a file stored under the same name. Only chunks the store does not hold
+	/// yet are encrypted and written. Throws an <see cref="IOException"/> on failure.
+	/// </summary>
+	/// <param name="file">The plaintext file.</param>
+	/// <param name="name">The name.</param>
+	void add(const std::experimental::filesystem::v1::path &file, const std::string &name);
+
+	/// <summary>
+	/// Writes a stored file. Throws an <see cref="IOException"/> on failure, and a <see cref="GeneralSecurityException"/>
+	/// if a chunk is missing, not authentic or not the one the catalog names. A partial file is removed.
+	/// </summary>
+	/// <param name="file">The stored file.</param>
+	/// <param name="destination">The plaintext file.</param>
+	void restore(const File &file, const std::experimental::filesystem::v1::path &destination);
+
+	/// <summary>
+	/// Lists the stored files, by name.
+	/// </summary>
+	/// <returns>The files</returns>
+	std::vector<File> list();
+
+	/// <summary>
+	/// Stores the catalog, if files were added, under the given key derivation parameters. It is written next to
+	/// the target and renamed over it. Throws an <see cref="IOException"/> on failure.
+	/// </summary>
+	/// <param name="salt">The salt the key passed to <see cref="open"/> was derived with.</param>
+	/// <param name="iterations">The KDF iteration count it was derived with.</param>
+	void save(const byte salt[], const uint32_t iterations);
+
+	/// <summary>Number of chunks encrypted and written since the store was opened.</summary>
+	uint64_t getStoredChunks() const { return storedChunks; }
+	/// <summary>Plaintext bytes of those chunks.</summary>
+	uint64_t getStoredBytes() const { return storedBytes; }
+	/// <summary>Number of chunks found already stored since the store was opened.</summary>
+	uint64_t getReusedChunks() const { return reusedChunks; }
+	/// <summary>Plaintext bytes of those chunks.</summary>
+	uint64_t getReusedBytes() const { return reusedBytes; }
+
+};
@@ -0,0 +1,114 @@
+#include "DirectoryWalker.h"
+#include "Metrics.h"
+#include "spdlog/spdlog.h"
+#include <algorithm>
+
+
+// Logger
+static std::shared_ptr<spdlog::logger> LOG = spdlog::stdout_color_mt("DirectoryWalker");
+
+
+DirectoryWalker::DirectoryWalker(const std::vector<filesystem::path> &roots, const bool recursive, const unsigned int threadCount, const size_t queueCapacity)
+	:recursive(recursive), files(queueCapacity), busy(0), running(std::max(1u, threadCount)), stopping(false)
+{
+	for (const auto &root : roots)
+	{
+		std::error_code ec;
+		if (!filesystem::is_directory(root, ec)) {
+			LOG->warn("SKIPPING {}. Cause : does not exist, or is not a directory!", root.string());
+			continue;
+		}
+		directories.push_back(root);
+	}
+
+	const unsigned int count = running;
+	walkers.reserve(count);
+	for (unsigned int i = 0; i < count; ++i)
+	{
+		walkers.emplace_back(&DirectoryWalker::walkerLoop, this);
+	}
+}
+
+DirectoryWalker::~DirectoryWalker()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	workAvailable.notify_all();
+	// wakes walkers waiting for room in the queue
+	files.close();
+
+	for (auto &walker : walkers) walker.join();
+}
+
+void DirectoryWalker::walkerLoop()
+{
+	for (;;)
+	{
+		filesystem::path directory;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			// with nothing pending, wait as long as a busy walker may still find subdirectories
+			workAvailable.wait(lock, [this] { return stopping || !directories.empty() || busy == 0; });
+			if (stopping || directories.empty()) break;
+			directory = std::move(directories.back());
+			directories.pop_back();
+			++busy;
+		}
+
+		list(directory);
+
+		bool finished;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			--busy;
+			finished = busy == 0 && directories.empty();
+		}
+		if (finished) workAvailable.notify_all();
+	}
+
+	bool last;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		last = --running == 0;
+	}
+	if (last) files.close();
+}
+
+void DirectoryWalker::list(const filesystem::path &directory)
+{
+	Metrics::Timer timer(Metrics::LIST);
+
+	std::error_code ec;
+	filesystem::directory_iterator it(directory, ec);
+	const filesystem::directory_iterator end;
+	if (ec) {
+		LOG->warn("Skipping {}, Cause : {}", directory.string(), ec.message());
+		return;
+	}
+
+	for (; it != end; it.increment(ec))
+	{
+		if (ec) {
+			LOG->warn("Stopped listing {}, Cause : {}", directory.string(), ec.message());
+			return;
+		}
+
+		const filesystem::directory_entry &entry = *it;
+		std::error_code statusError;
+		if (recursive && filesystem::is_directory(entry.symlink_status(statusError))) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				directories.push_back(entry.path());
+			}
+			workAvailable.notify_one();
+			continue;
+		}
+
+		if (filesystem::is_regular_file(entry.status(statusError))) {
+			// blocks while the consumers are behind, fails once the walker is stopped
+			if (!files.push(entry.path())) return;
+		}
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <experimental/filesystem>
+#include "BoundedQueue.h"
+
+namespace filesystem = std::experimental::filesystem::v1;
+
+/// <summary>
+/// Lists the regular files below a set of directories on background threads, handing them out as they are found.
+/// The walker threads share a stack of directories still to be listed, so large trees fan out across the threads,
+/// and found files go through a bounded queue, so listing never runs further ahead of the consumers than the queue
+/// capacity. Memory then depends on the number of pending directories, not on the number of files. Files are handed
+/// out in no particular order. Directory symlinks are not followed.
+/// </summary>
+class DirectoryWalker
+{
+
+private:
+	const bool recursive;
+	BoundedQueue<filesystem::path> files;
+	std::mutex mutex;
+	std::condition_variable workAvailable;
+	std::vector<filesystem::path> directories;
+	/// <summary>Walkers listing a directory, which may still add subdirectories.</summary>
+	unsigned int busy;
+	/// <summary>Walkers that have not exited yet, the last one closes the file queue.</summary>
+	unsigned int running;
+	bool stopping;
+	std::vector<std::thread> walkers;
+
+	/// <summary>
+	/// Lists directories until there are none left.
+	/// </summary>
+	void walkerLoop();
+
+	/// <summary>
+	/// Lists one directory, queueing its files and, if recursive, its subdirectories.
+	/// </summary>
+	/// <param name="directory">The directory.</param>
+	void list(const filesystem::path &directory);
+
+public:
+	const static unsigned int THREAD_COUNT = 4;
+	const static unsigned int QUEUE_CAPACITY = 4096;
+
+	/// <summary>
+	/// Initializes a new instance of the <see cref="DirectoryWalker"/> class and starts listing.
+	/// Roots that are not directories are skipped with a warning.
+	/// </summary>
+	/// <param name="roots">The directories to list.</param>
+	/// <param name="recursive">Whether to descend into subdirectories.</param>
+	/// <param name="threadCount">Number of walker threads, at least 1.</param>
+	/// <param name="queueCapacity">Maximum number of found files waiting for a consumer.</param>
+	DirectoryWalker(const std::vector<filesystem::path> &roots, const bool recursive, const unsigned int threadCount = THREAD_COUNT, const size_t queueCapacity = QUEUE_CAPACITY);
+
+	/// <summary>
+	/// Finalizes an instance of the <see cref="DirectoryWalker"/> class. Listing is stopped if it is still running.
+	/// </summary>
+	~DirectoryWalker();
+
+	DirectoryWalker(const DirectoryWalker&) = delete;
+	DirectoryWalker& operator=(const DirectoryWalker&) = delete;
+
+	/// <summary>
+	/// Gets the next file, waiting for one. Can be called from many threads.
+	/// </summary>
+	/// <param name="file">Receives the file.</param>
+	/// <returns><c>false</c> once every file was handed out</returns>
+	bool next(filesystem::path &file) { return files.pop(file); }
+
+};
@@ -3,7 +3,10 @@
 #include "cereal/types/vector.hpp"
 #include "spdlog/spdlog.h"
 #include "IOException.h"
+#include "Endian.h"
+#include "Metrics.h"
 #include <fstream>
+#include <cstring>
 
 
 // Logger
@@ -13,18 +16,20 @@ static std::shared_ptr<spdlog::logger> LOG = spdlog::stdout_color_mt("EncryptedF
 EncryptedFile EncryptedFile::readEncryptedFileFromDisk(const std::string &filename)
 {
 
-	if (!EncryptedFile::isEncryptedFile(filename)) {
+	if (!EncryptedFile::isLegacyEncryptedFile(filename)) {
 		throw IOException("File is not an instance of EncryptedFile!");
 	}
 
 	try
 	{
+		Metrics::Timer timer(Metrics::SERIALIZE);
 		std::ifstream ifs(filename, std::ios::binary);
 		ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		cereal::BinaryInputArchive iArchive(ifs);
 		EncryptedFile enc;
 		iArchive(enc);
 		ifs.close();
+		timer.addBytes(enc.getData()->size());
 		return enc;
 	}
 	catch (const std::ios_base::failure& e)
@@ -43,6 +48,7 @@ void EncryptedFile::writeEncryptedFileToDisk(const std::string &filename, Encryp
 {
 	try
 	{
+		Metrics::Timer timer(Metrics::SERIALIZE, enc.getData()->size());
 		std::ofstream ofs(filename, std::ios::binary);
 		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
 		cereal::BinaryOutputArchive oArchive(ofs);
@@ -62,6 +68,163 @@ void EncryptedFile::writeEncryptedFileToDisk(const std::string &filename, Encryp
 
 bool EncryptedFile::isEncryptedFile(const std::string & filename)
 {
-	//TODO
-	return true;
+	std::ifstream ifs(filename, std::ios::binary);
+	byte magic[EncryptedFileHeader::MAGIC_LENGTH];
+	if (!ifs.read(reinterpret_cast<char*>(magic), sizeof(magic))) return false;
+
+	return std::memcmp(magic, EncryptedFileHeader::MAGIC, sizeof(magic)) == 0;
+}
+
+bool EncryptedFile::isLegacyEncryptedFile(const std::string & filename)
+{
+	std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+	if (!ifs) return false;
+	const uint64_t fileSize = static_cast<uint64_t>(ifs.tellg());
+	if (fileSize < 16) return false;
+
+	// cereal writes every vector as a 64 bit length followed by the elements: data, iv, salt, aad
+	byte length[8];
+	if (!ifs.seekg(0).read(reinterpret_cast<char*>(length), sizeof(length))) return false;
+	const uint64_t dataLength = endian::loadLE64(length);
+	if (dataLength == 0 || dataLength > fileSize - 8 || fileSize - 8 - dataLength < 32) return false;
+
+	if (!ifs.seekg(static_cast<std::streamoff>(8 + dataLength)).read(reinterpret_cast<char*>(length), sizeof(length))) return false;
+	const uint64_t ivLength = endian::loadLE64(length);
+	return ivLength > 0 && ivLength <= fileSize - 16 - dataLength;
+}
+
+void EncryptedFile::writeHeader(std::ostream &os, const EncryptedFileHeader &header)
+{
+	try
+	{
+		Metrics::Timer timer(Metrics::SERIALIZE, EncryptedFileHeader::LENGTH);
+		byte bytes[EncryptedFileHeader::LENGTH];
+		header.write(bytes);
+		os.write(reinterpret_cast<const char*>(bytes), sizeof(bytes));
+	}
+	catch (const std::ios_base::failure& e)
+	{
+		LOG->critical(e.what());
+		throw IOException(e.what());
+	}
+}
+
+EncryptedFileHeader EncryptedFile::readHeader(std::istream &is)
+{
+	try
+	{
+		Metrics::Timer timer(Metrics::SERIALIZE, EncryptedFileHeader::LENGTH);
+		byte bytes[EncryptedFileHeader::LENGTH];
+		is.read(reinterpret_cast<char*>(bytes), sizeof(bytes));
+		return EncryptedFileHeader::read(bytes);
+	}
+	catch (const std::ios_base::failure& e)
+	{
+		LOG->critical(e.what());
+		throw IOException(e.what());
+	}
+}
+
+EncryptedFileHeader EncryptedFile::readHeader(const std::string &filename)
+{
+	Metrics::Timer timer(Metrics::SERIALIZE, EncryptedFileHeader::LENGTH);
+	std::ifstream ifs(filename, std::ios::binary);
+	byte bytes[EncryptedFileHeader::LENGTH];
+	if (!ifs.read(reinterpret_cast<char*>(bytes), sizeof(bytes))) {
+		throw IOException("File " + filename + " is too short for a header");
+	}
+	return EncryptedFileHeader::read(bytes);
+}
+
+
+const byte EncryptedFileHeader::MAGIC[EncryptedFileHeader::MAGIC_LENGTH] = { 0x89, 'G', 'C', 'M', 'E', 'N', 'C', 0x0A };
+
+EncryptedFileHeader::EncryptedFileHeader(const byte salt[], const byte noncePrefix[], uint32_t kdfIterations, uint32_t segmentSize, uint64_t plaintextLength)
+	:suite(SUITE_AES_256_GCM), kdf(KDF_PBKDF2_HMAC_SHA256), flags(0), kdfIterations(kdfIterations), segmentSize(segmentSize), plaintextLength(plaintextLength)
+{
+	assert(kdfIterations > 0 && segmentSize > 0);
+	std::memcpy(this->salt, salt, SALT_LENGTH);
+	std::memcpy(this->noncePrefix, noncePrefix, NONCE_PREFIX_LENGTH);
+	std::memset(this->wrapNonce, 0, WRAP_NONCE_LENGTH);
+	std::memset(this->wrappedKey, 0, WRAPPED_KEY_LENGTH);
+}
+
+EncryptedFileHeader::EncryptedFileHeader()
+	:suite(SUITE_AES_256_GCM), kdf(KDF_PBKDF2_HMAC_SHA256), flags(0), kdfIterations(0), segmentSize(0), plaintextLength(0)
+{
+	std::memset(salt, 0, SALT_LENGTH);
+	std::memset(noncePrefix, 0, NONCE_PREFIX_LENGTH);
+	std::memset(wrapNonce, 0, WRAP_NONCE_LENGTH);
+	std::memset(wrappedKey, 0, WRAPPED_KEY_LENGTH);
+}
+
+void EncryptedFileHeader::setKeyDerivation(const byte salt[], const uint32_t kdfIterations)
+{
+	assert(kdfIterations > 0);
+	std::memcpy(this->salt, salt, SALT_LENGTH);
+	this->kdfIterations = kdfIterations;
+}
+
+void EncryptedFileHeader::setWrappedKey(const byte wrapNonce[], const byte wrappedKey[])
+{
+	std::memcpy(this->wrapNonce, wrapNonce, WRAP_NONCE_LENGTH);
+	std::memcpy(this->wrappedKey, wrappedKey, WRAPPED_KEY_LENGTH);
+}
+
+void EncryptedFileHeader::write(byte out[]) const
+{
+	std::memset(out, 0, LENGTH);
+	std::memcpy(out, MAGIC, MAGIC_LENGTH);
+	out[8] = static_cast<byte>(VERSION);
+	out[9] = static_cast<byte>(VERSION >> 8);
+	out[10] = static_cast<byte>(LENGTH);
+	out[11] = static_cast<byte>(LENGTH >> 8);
+	out[12] = suite;
+	out[13] = kdf;
+	out[14] = static_cast<byte>(flags);
+	out[15] = static_cast<byte>(flags >> 8);
+	endian::storeLE32(out + 16, kdfIterations);
+	endian::storeLE32(out + 20, segmentSize);
+	endian::storeLE64(out + 24, plaintextLength);
+	std::memcpy(out + 32, salt, SALT_LENGTH);
+	std::memcpy(out + 48, noncePrefix, NONCE_PREFIX_LENGTH);
+	std::memcpy(out + 56, wrapNonce, WRAP_NONCE_LENGTH);
+	std::memcpy(out + 68, wrappedKey, WRAPPED_KEY_LENGTH);
+}
+
+EncryptedFileHeader EncryptedFileHeader::read(const byte in[])
+{
+	if (std::memcmp(in, MAGIC, MAGIC_LENGTH) != 0) {
+		throw IOException("File is not an instance of EncryptedFile!");
+	}
+	const unsigned int version = in[8] | (in[9] << 8);
+	const unsigned int length = in[10] | (in[11] << 8);
+	if (version != VERSION || length != LENGTH) {
+		throw IOException("Unsupported EncryptedFile version " + std::to_string(version));
+	}
+
+	EncryptedFileHeader header;
+	header.suite = in[12];
+	header.kdf = in[13];
+	header.flags = static_cast<uint16_t>(in[14] | (in[15] << 8));
+	header.kdfIterations = endian::loadLE32(in + 16);
+	header.segmentSize = endian::loadLE32(in + 20);
+	header.plaintextLength = endian::loadLE64(in + 24);
+	std::memcpy(header.salt, in + 32, SALT_LENGTH);
+	std::memcpy(header.noncePrefix, in + 48, NONCE_PREFIX_LENGTH);
+	std::memcpy(header.wrapNonce, in + 56, WRAP_NONCE_LENGTH);
+	std::memcpy(header.wrappedKey, in + 68, WRAPPED_KEY_LENGTH);
+	return header;
+}
+
+std::vector<byte> EncryptedFileHeader::getAuthenticatedData() const
+{
+	byte bytes[LENGTH];
+	write(bytes);
+
+	std::vector<byte> aad(AUTHENTICATED_LENGTH);
+	std::memcpy(aad.data(), bytes, 16);
+	std::memcpy(aad.data() + 16, bytes + 20, 4);
+	std::memcpy(aad.data() + 20, bytes + 48, 8);
+	return aad;
 }
@@ -1,11 +1,196 @@
 #pragma once
 #include <vector>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <utility>
 #include <assert.h>
 #include "cereal\access.hpp"
 
 
 typedef unsigned char byte;
 
+/// <summary>
+/// The fixed-size header of an encrypted file. All integers are little-endian.
+///
+///   offset  size  field
+///   0       8     magic
+///   8       2     format version
+///   10      2     header length
+///   12      1     cipher suite
+///   13      1     key derivation function
+///   14      2     flags
+///   16      4     KDF iteration count
+///   20      4     segment size
+///   24      8     plaintext length
+///   32      16    salt
+///   48      8     nonce prefix (7 bytes, zero padded)
+///   56      12    key wrap nonce
+///   68      48    wrapped data key
+///   116     12    reserved, zero
+///
+/// With <see cref="FLAG_WRAPPED_KEY"/> the segments are sealed with a random per-file data key, stored sealed under
+/// the key derived from the password (see <see cref="KeyWrap"/>); otherwise the derived key seals them directly and
+/// the key wrap fields are zero.
+///
+/// The header is followed by the encrypted segments, each one <see cref="getSegmentSize"/> bytes of ciphertext
+/// (the last one possibly shorter) plus a tag, and by the segment index.
+/// </summary>
+class EncryptedFileHeader
+{
+
+public:
+	const static unsigned int LENGTH = 128; //bytes
+	const static unsigned int VERSION = 1;
+	const static unsigned int MAGIC_LENGTH = 8; //bytes
+	const static unsigned int SALT_LENGTH = 16; //bytes
+	const static unsigned int NONCE_PREFIX_LENGTH = 7; //bytes
+	const static unsigned int AUTHENTICATED_LENGTH = 28; //bytes
+	const static unsigned int WRAP_NONCE_LENGTH = 12; //bytes
+	const static unsigned int WRAPPED_KEY_LENGTH = 48; //bytes, a 32 byte key and its tag
+	const static byte SUITE_AES_256_GCM = 1;
+	const static byte SUITE_CHACHA20_POLY1305 = 2;
+	const static byte KDF_PBKDF2_HMAC_SHA256 = 1;
+	/// <summary>The plaintext is a packed archive of many files, see <see cref="PackArchive"/>.</summary>
+	const static uint16_t FLAG_PACKED = 0x0001;
+	/// <summary>Segments are deflated before they are sealed, see <see cref="Compression"/>.</summary>
+	const static uint16_t FLAG_COMPRESSED = 0x0002;
+	/// <summary>The data key is wrapped in the header, so the password can be changed by rewriting the header alone.</summary>
+	const static uint16_t FLAG_WRAPPED_KEY = 0x0004;
+	static const byte MAGIC[MAGIC_LENGTH];
+
+private:
+	byte suite;
+	byte kdf;
+	uint16_t flags;
+	uint32_t kdfIterations;
+	uint32_t segmentSize;
+	uint64_t plaintextLength;
+	byte salt[SALT_LENGTH];
+	byte noncePrefix[NONCE_PREFIX_LENGTH];
+	byte wrapNonce[WRAP_NONCE_LENGTH];
+	byte wrappedKey[WRAPPED_KEY_LENGTH];
+
+public:
+	/// <summary>
+	/// Initializes a new instance of the <see cref="EncryptedFileHeader"/> class.
+	/// </summary>
+	/// <param name="salt">The salt, <see cref="SALT_LENGTH"/> bytes.</param>
+	/// <param name="noncePrefix">The nonce prefix shared by all segments, <see cref="NONCE_PREFIX_LENGTH"/> bytes.</param>
+	/// <param name="kdfIterations">The KDF iteration count.</param>
+	/// <param name="segmentSize">Plaintext size of every segment but the last.</param>
+	/// <param name="plaintextLength">Total plaintext length.</param>
+	EncryptedFileHeader(const byte salt[], const byte noncePrefix[], uint32_t kdfIterations, uint32_t segmentSize, uint64_t plaintextLength);
+
+	/// <summary>
+	/// Initializes a new instance of the <see cref="EncryptedFileHeader"/> class.
+	/// </summary>
+	EncryptedFileHeader();
+
+	/// <summary>
+	/// Encodes the header.
+	/// </summary>
+	/// <param name="out">Output array of <see cref="LENGTH"/> bytes.</param>
+	void write(byte out[]) const;
+
+	/// <summary>
+	/// Decodes a header. Throws an <see cref="IOException"/> if the magic, version or length do not match.
+	/// </summary>
+	/// <param name="in"><see cref="LENGTH"/> bytes.</param>
+	/// <returns>The header</returns>
+	static EncryptedFileHeader read(const byte in[]);
+
+	/// <summary>
+	/// The header fields every segment and index page is bound to: magic, version, length, suite, KDF and flags,
+	/// followed by the segment size and the nonce prefix. The plaintext length and the key derivation
+	/// parameters are not included, so they can be rewritten without re-encrypting the file.
+	/// </summary>
+	/// <returns><see cref="AUTHENTICATED_LENGTH"/> bytes</returns>
+	std::vector<byte> getAuthenticatedData() const;
+
+	/// <summary>
+	/// Gets the cipher suite.
+	/// </summary>
+	/// <returns></returns>
+	byte getSuite() const { return this->suite; }
+	/// <summary>
+	/// Sets the cipher suite.
+	/// </summary>
+	/// <param name="suite">The suite, see <see cref="CipherSuite"/>.</param>
+	void setSuite(const byte suite) { this->suite = suite; }
+	/// <summary>
+	/// Gets the key derivation function.
+	/// </summary>
+	/// <returns></returns>
+	byte getKdf() const { return this->kdf; }
+	/// <summary>
+	/// Gets the flags.
+	/// </summary>
+	/// <returns></returns>
+	uint16_t getFlags() const { return this->flags; }
+	/// <summary>
+	/// Sets the flags.
+	/// </summary>
+	/// <param name="flags">The flags.</param>
+	void setFlags(const uint16_t flags) { this->flags = flags; }
+	/// <summary>
+	/// Gets the KDF iteration count.
+	/// </summary>
+	/// <returns></returns>
+	uint32_t getKdfIterations() const { return this->kdfIterations; }
+	/// <summary>
+	/// Gets the segment size.
+	/// </summary>
+	/// <returns></returns>
+	uint32_t getSegmentSize() const { return this->segmentSize; }
+	/// <summary>
+	/// Gets the plaintext length.
+	/// </summary>
+	/// <returns></returns>
+	uint64_t getPlaintextLength() const { return this->plaintextLength; }
+	/// <summary>
+	/// Gets the salt.
+	/// </summary>
+	/// <returns></returns>
+	const byte * getSalt() const { return this->salt; }
+	/// <summary>
+	/// Gets the nonce prefix.
+	/// </summary>
+	/// <returns></returns>
+	const byte * getNoncePrefix() const { return this->noncePrefix; }
+	/// <summary>
+	/// Gets the nonce the data key was wrapped with.
+	/// </summary>
+	/// <returns></returns>
+	const byte * getWrapNonce() const { return this->wrapNonce; }
+	/// <summary>
+	/// Gets the wrapped data key.
+	/// </summary>
+	/// <returns></returns>
+	const byte * getWrappedKey() const { return this->wrappedKey; }
+
+	/// <summary>
+	/// Sets the plaintext length, which is not bound to the segments.
+	/// </summary>
+	/// <param name="plaintextLength">Total plaintext length.</param>
+	void setPlaintextLength(const uint64_t plaintextLength) { this->plaintextLength = plaintextLength; }
+
+	/// <summary>
+	/// Sets the key derivation parameters, which are not bound to the segments.
+	/// </summary>
+	/// <param name="salt">The salt, <see cref="SALT_LENGTH"/> bytes.</param>
+	/// <param name="kdfIterations">The KDF iteration count.</param>
+	void setKeyDerivation(const byte salt[], const uint32_t kdfIterations);
+
+	/// <summary>
+	/// Sets the wrapped data key, which is not bound to the segments.
+	/// </summary>
+	/// <param name="wrapNonce">The nonce, <see cref="WRAP_NONCE_LENGTH"/> bytes.</param>
+	/// <param name="wrappedKey">The wrapped key, <see cref="WRAPPED_KEY_LENGTH"/> bytes.</param>
+	void setWrappedKey(const byte wrapNonce[], const byte wrappedKey[]);
+
+};
+
 class EncryptedFile
 {
 
@@ -29,10 +214,10 @@ public:
 	/// <param name="iv">The initialization vector.</param>
 	/// <param name="salt">The salt.</param>
 	/// <param name="aad">The additional authenticated data.</param>
-	EncryptedFile(std::vector<byte> &data, std::vector<byte> iv, std::vector<byte> salt, std::vector<byte> aad)
-		:data(data), iv(iv), salt(salt), aad(aad)
+	EncryptedFile(std::vector<byte> data, std::vector<byte> iv, std::vector<byte> salt, std::vector<byte> aad)
+		:data(std::move(data)), iv(std::move(iv)), salt(std::move(salt)), aad(std::move(aad))
 	{
-		assert(data.size() > 0 && iv.size() > 0 && salt.size() > 0);
+		assert(this->data.size() > 0 && this->iv.size() > 0 && this->salt.size() > 0);
 	}
 
 	/// <summary>
@@ -69,7 +254,7 @@ public:
 
 
 	/// <summary>
-	/// Read a encryptedFile from disk.
+	/// Read a legacy (cereal) encryptedFile from disk.
 	/// </summary>
 	/// <param name="filename">File location</param>
 	/// <returns>
@@ -77,19 +262,51 @@ public:
 	/// </returns>
 	static EncryptedFile readEncryptedFileFromDisk(const std::string &filename);
 	/// <summary>
-	/// Write a encryptedFile to disk.
+	/// Write a legacy (cereal) encryptedFile to disk.
 	/// </summary>
 	/// <param name="filename">File location</param>
 	/// <param name="enc">The EncryptedFile object</param>
 	static void writeEncryptedFileToDisk(const std::string &filename, EncryptedFile&  enc);
 	/// <summary>
-	/// Determines whether a file is a serialized EncryptedFile.
+	/// Determines whether a file starts with an <see cref="EncryptedFileHeader"/>. Reads only the magic.
 	/// </summary>
 	/// <param name="filename">File location</param>
 	/// <returns>
 	///   <c>true</c> if [is of type EncryptedFile]; otherwise, <c>false</c>.
 	/// </returns>
 	static bool isEncryptedFile(const std::string &filename);
+	/// <summary>
+	/// Determines whether a file looks like a legacy serialized EncryptedFile. Reads the length prefixes of
+	/// the data and iv fields, and checks they are consistent with the file size.
+	/// </summary>
+	/// <param name="filename">File location</param>
+	/// <returns>
+	///   <c>true</c> if [is a legacy EncryptedFile]; otherwise, <c>false</c>.
+	/// </returns>
+	static bool isLegacyEncryptedFile(const std::string &filename);
+
+	/// <summary>
+	/// Write the header of an encrypted file. The segments are written after it by the caller.
+	/// </summary>
+	/// <param name="os">The output stream.</param>
+	/// <param name="header">The header.</param>
+	static void writeHeader(std::ostream &os, const EncryptedFileHeader &header);
+	/// <summary>
+	/// Read the header of an encrypted file. The stream is left positioned at the first segment.
+	/// </summary>
+	/// <param name="is">The input stream.</param>
+	/// <returns>
+	/// A new instance of the <see cref="EncryptedFileHeader" /> class.
+	/// </returns>
+	static EncryptedFileHeader readHeader(std::istream &is);
+	/// <summary>
+	/// Read the header of an encrypted file, with a single read of <see cref="EncryptedFileHeader::LENGTH"/> bytes.
+	/// </summary>
+	/// <param name="filename">File location</param>
+	/// <returns>
+	/// A new instance of the <see cref="EncryptedFileHeader" /> class.
+	/// </returns>
+	static EncryptedFileHeader readHeader(const std::string &filename);
 
 };
 
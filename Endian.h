@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstdint>
+
+/// <summary>
+/// Little-endian encoding of the fixed-width integers in the on-disk formats.
+/// </summary>
+namespace endian {
+
+	inline void storeLE32(unsigned char *out, const uint32_t value)
+	{
+		for (int i = 0; i < 4; ++i) out[i] = static_cast<unsigned char>(value >> (8 * i));
+	}
+
+	inline void storeLE64(unsigned char *out, const uint64_t value)
+	{
+		for (int i = 0; i < 8; ++i) out[i] = static_cast<unsigned char>(value >> (8 * i));
+	}
+
+	inline uint32_t loadLE32(const unsigned char *in)
+	{
+		uint32_t value = 0;
+		for (int i = 3; i >= 0; --i) value = (value << 8) | in[i];
+		return value;
+	}
+
+	inline uint64_t loadLE64(const unsigned char *in)
+	{
+		uint64_t value = 0;
+		for (int i = 7; i >= 0; --i) value = (value << 8) | in[i];
+		return value;
+	}
+
+}
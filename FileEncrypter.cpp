@@ -2,7 +2,6 @@
 
 #include "pwdbased.h"
 #include "hkdf.h"
-#include "osrng.h"
 
 #include "spdlog/spdlog.h"
 #include "IOException.h"
@@ -10,17 +9,39 @@
 
 #include "aes.h"
 #include "gcm.h"
+#include "SegmentCipher.h"
+#include "SegmentIndex.h"
+#include "Pipeline.h"
+#include "Endian.h"
+#include "Metrics.h"
+#include "AsyncIo.h"
+#include "Compression.h"
+#include "CipherSuite.h"
+#include "RandomSource.h"
+#include "KeyWrap.h"
+
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <list>
 
 
 // Logger
 static std::shared_ptr<spdlog::logger> LOG = spdlog::stdout_color_mt("FileEncrypter");
 
+static_assert(FileEncrypter::SALT_LENGTH == EncryptedFileHeader::SALT_LENGTH, "salt does not fit the header");
+static_assert(SegmentCipher::NONCE_PREFIX_LENGTH == EncryptedFileHeader::NONCE_PREFIX_LENGTH, "nonce prefix does not fit the header");
+static_assert(FileEncrypter::SEGMENT_SIZE % fileUtils::AlignedBuffer::ALIGNMENT == 0, "segments must start at aligned plaintext offsets");
+static_assert(FileEncrypter::DIRECT_BUFFER_SIZE >= FileEncrypter::SEGMENT_SIZE + SegmentCipher::TAG_LENGTH + fileUtils::AlignedBuffer::ALIGNMENT, "direct buffers must hold a segment");
+
 
 CryptoPP::SecByteBlock FileEncrypter::getAesKeyAlt(const std::string &password, char salt[])
 {
 	// get password and salt length
 	const size_t saltLength = strlen(salt);
 
+	Metrics::Timer timer(Metrics::KDF);
 	// create a key with specified size
 	CryptoPP::SecByteBlock key(CryptoPP::SHA256::DIGESTSIZE);
 
@@ -34,9 +55,10 @@ CryptoPP::SecByteBlock FileEncrypter::getAesKeyAlt(const std::string &password,
 	return key;
 }
 
-CryptoPP::SecByteBlock FileEncrypter::getAesKey(const std::string &password, char salt[])
+CryptoPP::SecByteBlock FileEncrypter::getAesKey(const std::string &password, char salt[], const unsigned int iterations)
 {
 
+	Metrics::Timer timer(Metrics::KDF);
 	// create a key with specified size
 	CryptoPP::SecByteBlock key(CryptoPP::SHA256::DIGESTSIZE);
 
@@ -45,68 +67,53 @@ CryptoPP::SecByteBlock FileEncrypter::getAesKey(const std::string &password, cha
 	// "purpose byte" is ignored for PBKDF2, and if therefore set to 0
 	// "timeInSeconds" is ignored because iteration count is specified
 	const unsigned int achievedItCount = keyDerivationFunction.DeriveKey(key, key.size(), 0, reinterpret_cast<const byte*>(password.c_str()),
-		password.length(), reinterpret_cast<const byte*>(salt), FileEncrypter::SALT_LENGTH, FileEncrypter::KDF_ITERATION_COUNT, 0);
+		password.length(), reinterpret_cast<const byte*>(salt), FileEncrypter::SALT_LENGTH, iterations, 0);
 
-	if (achievedItCount < FileEncrypter::KDF_ITERATION_COUNT) LOG->error("achieved iteration count is lower than specified iteration count");
+	if (achievedItCount < iterations) LOG->error("achieved iteration count is lower than specified iteration count");
 
 	return key;
 }
 
-/*
-Replace AutoSeededRandomPool with something more secure/random.
-
-From the cryptoPP wiki pages : https://www.cryptopp.com/wiki/RandomNumberGenerator
-
-"Finally, the library does not currently offer the generators specified by NIST SP800-90A,
-Recommendation for Random Number Generation Using Deterministic Random Bit Generators.
-This is important because the ANSI X9.17 and X9.31 generators are in deprecated status,
-and must not be used after 2015. See SP800-131 for details. In the interim, use NonblockingRng
-or OS_GenerateRandomBlock on Windows. Both wrap the the Operating System's generator."
+const CryptoPP::SecByteBlock & FileEncrypter::getCachedAesKey(const std::string &password, const byte salt[], const unsigned int iterations, KeyCache &keyCache)
+{
+	// the same salt with another iteration count gives another key
+	byte cacheKey[FileEncrypter::SALT_LENGTH + 4];
+	std::memcpy(cacheKey, salt, FileEncrypter::SALT_LENGTH);
+	endian::storeLE32(cacheKey + FileEncrypter::SALT_LENGTH, iterations);
+
+	return keyCache.get(cacheKey, sizeof(cacheKey), [&]() {
+		return getAesKey(password, const_cast<char*>(reinterpret_cast<const char*>(salt)), iterations);
+	});
+}
 
-"If you are using an AutoSeeded* generator, then the library will attempt to seed the generator
-for you using the underlying OS's entropy pool by way of OS_GenerateRandomBlock."
+CryptoPP::SecByteBlock FileEncrypter::getFileKey(const std::string &password, const EncryptedFileHeader &header, KeyCache &keyCache)
+{
+	const CryptoPP::SecByteBlock &key = getCachedAesKey(password, header.getSalt(), header.getKdfIterations(), keyCache);
+	// files written before the key hierarchy are sealed with the derived key itself
+	if (!(header.getFlags() & EncryptedFileHeader::FLAG_WRAPPED_KEY)) return key;
+	return KeyWrap::unwrap(key, header);
+}
 
-*/
 void FileEncrypter::generateRandomIV(byte * const iv, const unsigned int ivSize)
 {
-	//initialize new random for each function call
-	CryptoPP::AutoSeededRandomPool random;
-	//fill array with random bytes
-	random.GenerateBlock(iv, ivSize);
+	RandomSource::generate(iv, ivSize);
 }
 
-/*
-Replace AutoSeededRandomPool with something more secure/random.
-
-From the cryptoPP wiki pages : https://www.cryptopp.com/wiki/RandomNumberGenerator
-
-"Finally, the library does not currently offer the generators specified by NIST SP800-90A,
-Recommendation for Random Number Generation Using Deterministic Random Bit Generators.
-This is important because the ANSI X9.17 and X9.31 generators are in deprecated status,
-and must not be used after 2015. See SP800-131 for details. In the interim, use NonblockingRng
-or OS_GenerateRandomBlock on Windows. Both wrap the the Operating System's generator."
-
-"If you are using an AutoSeeded* generator, then the library will attempt to seed the generator
-for you using the underlying OS's entropy pool by way of OS_GenerateRandomBlock."
-
-*/
 void FileEncrypter::generateRandomSalt(byte * const salt, const unsigned saltSize)
 {
-	//initialize new random for each function call
-	CryptoPP::AutoSeededRandomPool random;
-	//fill array with random bytes
-	random.GenerateBlock(salt, saltSize);
+	RandomSource::generate(salt, saltSize);
 }
 
 filesystem::path FileEncrypter::generateEncryptionName(filesystem::path originalFile)
 {
-	filesystem::path originalFileName = (originalFile.filename() += ".enc").string();
-	filesystem::path newPath = originalFile.remove_filename() /= originalFileName;
+	const filesystem::path originalFileName = (originalFile.filename() += ".enc").string();
+	const filesystem::path directory = originalFile.parent_path();
+	filesystem::path newPath = directory / originalFileName;
 
 	int count = 0;
 	while (filesystem::exists(newPath)) {
 		// prepend counting number
-		newPath = originalFile.remove_filename() /= originalFileName.string().insert(0, std::to_string(count++));
+		newPath = directory / originalFileName.string().insert(0, std::to_string(count++));
 	}
 
 	return newPath;
@@ -120,82 +127,554 @@ filesystem::path FileEncrypter::generateDecryptionName(filesystem::path encrypte
 		originalFileName.replace_extension("");
 	}
 
-	filesystem::path newPath = encryptedFile.remove_filename() /= originalFileName;
+	const filesystem::path directory = encryptedFile.parent_path();
+	filesystem::path newPath = directory / originalFileName;
 
 	int count = 0;
-	while (filesystem::exists(encryptedFile))
+	while (filesystem::exists(newPath))
 	{
-		newPath = encryptedFile.remove_filename() /= originalFileName.string().insert(0, std::to_string(count++));
+		newPath = directory / originalFileName.string().insert(0, std::to_string(count++));
 	}
 
 	return newPath;
 }
 
+filesystem::path FileEncrypter::reserveEncryptionName(const filesystem::path &originalFile)
+{
+	std::lock_guard<std::mutex> lock(nameMutex);
+	Metrics::Timer timer(Metrics::NAME);
+	filesystem::path newPath = FileEncrypter::generateEncryptionName(originalFile);
+	// create the file, so another worker cannot pick the same name before it is written
+	std::ofstream(newPath.string(), std::ios::binary);
+	reservedNames.insert(newPath.string());
+	return newPath;
+}
+
+filesystem::path FileEncrypter::reserveDecryptionName(const filesystem::path &encryptedFile)
+{
+	std::lock_guard<std::mutex> lock(nameMutex);
+	Metrics::Timer timer(Metrics::NAME);
+	filesystem::path newPath = FileEncrypter::generateDecryptionName(encryptedFile);
+	// create the file, so another worker cannot pick the same name before it is written
+	std::ofstream(newPath.string(), std::ios::binary);
+	reservedNames.insert(newPath.string());
+	return newPath;
+}
+
+void FileEncrypter::setThreadCount(const unsigned int threadCount)
+{
+	this->threadCount = threadCount == 0 ? std::max(1u, std::thread::hardware_concurrency()) : threadCount;
+	// the calling thread takes part in the work, so it counts as one of the workers
+	pool.reset(this->threadCount > 1 ? new ThreadPool(this->threadCount - 1) : nullptr);
+}
+
+void FileEncrypter::forEachSegmentBatch(const uint64_t segmentCount, const std::function<void(uint64_t, uint64_t)> &body)
+{
+	if (!pool) {
+		body(0, segmentCount);
+		return;
+	}
+
+	const uint64_t taskCount = (segmentCount + FileEncrypter::SEGMENTS_PER_TASK - 1) / FileEncrypter::SEGMENTS_PER_TASK;
+	pool->parallelFor(static_cast<size_t>(taskCount), [&](const size_t task) {
+		const uint64_t first = task * static_cast<uint64_t>(FileEncrypter::SEGMENTS_PER_TASK);
+		body(first, std::min<uint64_t>(first + FileEncrypter::SEGMENTS_PER_TASK, segmentCount));
+	});
+}
+
+void FileEncrypter::forEachFile(const size_t count, const std::function<void(size_t)> &body)
+{
+	if (pool) {
+		pool->parallelFor(count, body);
+		return;
+	}
+
+	for (size_t i = 0; i < count; ++i) body(i);
+}
+
+bool FileEncrypter::isEncryptable(const filesystem::path &file)
+{
+	// check if file exist
+	if (!filesystem::exists(file)) {
+		LOG->warn("Skipping {}, Cause : file does not exist", file.string());
+		return false;
+	}
+	// check if folder
+	if (filesystem::is_directory(file)) {
+		LOG->warn("Skipping {}, Cause : file is a directory", file.string());
+		return false;
+	}
+	// check if file a valid file
+	if (!filesystem::is_regular_file(file)) {
+		LOG->warn("Skipping {}, Cause : file is not a valid file", file.string());
+		return false;
+	}
+	// check if file size is 0
+	if (filesystem::is_empty(file)) {
+		LOG->warn("Skipping {}, Cause : file size is 0", file.string());
+		return false;
+	}
+
+	return true;
+}
+
+bool FileEncrypter::isCompressible(const filesystem::path &file)
+{
+	std::vector<byte> sample(static_cast<size_t>(std::min<uint64_t>(filesystem::file_size(file), Compression::SAMPLE_SIZE)));
+	std::ifstream ifs(file.string(), std::ios::binary);
+	ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+	ifs.read(reinterpret_cast<char*>(sample.data()), sample.size());
+	return Compression::isCompressible(sample.data(), sample.size());
+}
+
+bool FileEncrypter::nextWalkedFile(DirectoryWalker &walker, filesystem::path &file)
+{
+	while (walker.next(file))
+	{
+		{
+			std::lock_guard<std::mutex> lock(nameMutex);
+			if (reservedNames.count(file.string())) continue;
+		}
+		// the manifest, or its temporary copy, may be saved inside the tree being walked
+		if (!manifestPath.empty() && (file.filename() == manifestPath.filename() || file.filename().string() == manifestPath.filename().string() + ".tmp")) {
+			std::error_code ec;
+			const filesystem::path directory = file.has_parent_path() ? file.parent_path() : filesystem::path(".");
+			const filesystem::path manifestDirectory = manifestPath.has_parent_path() ? manifestPath.parent_path() : filesystem::path(".");
+			if (filesystem::equivalent(directory, manifestDirectory, ec)) continue;
+		}
+		return true;
+	}
+
+	return false;
+}
+
+void FileEncrypter::forEachWalkedFile(DirectoryWalker &walker, const std::function<void(const filesystem::path&)> &body)
+{
+	// every worker keeps taking files until the walker runs dry
+	auto drain = [&](size_t) {
+		filesystem::path file;
+		while (nextWalkedFile(walker, file)) body(file);
+	};
+
+	if (pool) {
+		pool->parallelFor(pool->size(), drain);
+		return;
+	}
+
+	drain(0);
+}
+
+filesystem::path FileEncrypter::encryptFile(const filesystem::path &file, const CryptoPP::SecByteBlock &key, const byte salt[])
+{
+	// one bad file is skipped, it does not end the run of the other workers
+	try
+	{
+		if (!isEncryptable(file)) return filesystem::path();
+
+		// generate new file path
+		filesystem::path newFilePath = FileEncrypter::reserveEncryptionName(file);
+		cipherFileStreamed(key, salt, file, newFilePath);
+		return newFilePath;
+	}
+	catch (const IOException &e) { LOG->critical("Skipping {}, Cause : {}", file.string(), e.what()); }
+	catch (const filesystem::filesystem_error &e) { LOG->critical("Skipping {}, Cause : {}", file.string(), e.what()); }
+	return filesystem::path();
+}
+
+bool FileEncrypter::loadManifest(const std::string &password)
+{
+	unchangedFiles = 0;
+	updatedFiles = 0;
+	if (manifestPath.empty()) {
+		manifest.reset();
+		return true;
+	}
+
+	manifest.reset(new Manifest());
+	if (!filesystem::exists(manifestPath)) {
+		LOG->info("No manifest at {}, every file is encrypted", manifestPath.string());
+		return true;
+	}
+
+	try
+	{
+		byte salt[Manifest::SALT_LENGTH];
+		uint32_t iterations;
+		Manifest::readParameters(manifestPath.string(), salt, iterations);
+		if (iterations == 0 || iterations > FileEncrypter::MAX_KDF_ITERATION_COUNT) throw IOException(manifestPath.string() + " has an invalid header");
+		const CryptoPP::SecByteBlock key = getAesKey(password, reinterpret_cast<char*>(salt), iterations);
+		manifest->load(manifestPath.string(), key);
+		return true;
+	}
+	// a manifest that can not be used must not be overwritten with an empty one
+	catch (const GeneralSecurityException &ge) { LOG->critical("Could not open manifest {} : {}", manifestPath.string(), ge.what()); }
+	catch (const IOException &e) { LOG->critical("Could not open manifest {} : {}", manifestPath.string(), e.what()); }
+	manifest.reset();
+	return false;
+}
+
+void FileEncrypter::saveManifest(const std::string &password, const bool always)
+{
+	if (!manifest) return;
+	if (!always) LOG->info("{} unchanged files skipped, {} changed files updated in place", unchangedFiles.load(), updatedFiles.load());
+	if (!manifest->isDirty() && !(always && filesystem::exists(manifestPath))) return;
+
+	// a fresh salt, and so a fresh key, for every save
+	byte salt[Manifest::SALT_LENGTH];
+	FileEncrypter::generateRandomSalt(salt, Manifest::SALT_LENGTH);
+	const CryptoPP::SecByteBlock key = getAesKey(password, reinterpret_cast<char*>(salt), FileEncrypter::KDF_ITERATION_COUNT);
+	try
+	{
+		manifest->save(manifestPath.string(), key, salt, FileEncrypter::KDF_ITERATION_COUNT);
+	}
+	catch (const IOException &e)
+	{
+		LOG->critical("Could not save manifest {} : {}", manifestPath.string(), e.what());
+	}
+}
+
+bool FileEncrypter::needsEncryption(const filesystem::path &file, std::string &source, Manifest::Entry &current, Manifest::Entry &previous)
+{
+	std::memset(current.hash, 0, Manifest::HASH_LENGTH);
+	current.segmentSize = 0;
+	current.nextCounter = 0;
+	previous.destination.clear();
+	// encryptFile reports why a file can not be stat'ed
+	if (!Manifest::stat(file, current)) return true;
+
+	source = Manifest::sourceKey(file);
+	std::error_code ec;
+	const bool known = manifest->find(source, previous) && filesystem::exists(previous.destination, ec);
+	if (!known) previous.destination.clear();
+	if (known && previous.sameMetadata(current)) return false;
+
+	// new, or the metadata moved, the contents decide. A zero hash never matches, so a failed read re-encrypts
+	try { Manifest::hash(file, current, FileEncrypter::SEGMENT_SIZE); }
+	catch (const IOException &e)
+	{
+		LOG->warn(e.what());
+		current.segmentSize = 0;
+		current.segmentHashes.clear();
+		return true;
+	}
+
+	if (known && previous.size == current.size && std::memcmp(previous.hash, current.hash, Manifest::HASH_LENGTH) == 0) {
+		// touched, copied back or restored, but the same contents
+		current.destination = previous.destination;
+		current.nextCounter = previous.nextCounter;
+		manifest->put(source, current);
+		return false;
+	}
+
+	return true;
+}
+
+bool FileEncrypter::updateFile(const filesystem::path &file, const Manifest::Entry &previous, Manifest::Entry &current, const std::string &password, KeyCache &keyCache)
+{
+	const filesystem::path destination(previous.destination);
+	const EncryptedFileHeader header = FileEncrypter::readHeader(destination);
+	const uint32_t segmentSize = header.getSegmentSize();
+	const uint64_t oldLength = header.getPlaintextLength();
+	const uint64_t oldCount = SegmentCipher::segmentCount(oldLength, segmentSize);
+	const uint64_t newLength = current.size;
+	const uint64_t newCount = SegmentCipher::segmentCount(newLength, segmentSize);
+
+	// the recorded hashes must describe the segments of the copy, and the current ones the file as it is now
+	if ((header.getFlags() & (EncryptedFileHeader::FLAG_PACKED | EncryptedFileHeader::FLAG_COMPRESSED)) != 0
+		|| previous.segmentSize != segmentSize || current.segmentSize != segmentSize
+		|| previous.segmentHashes.size() != oldCount * Manifest::SEGMENT_HASH_LENGTH
+		|| current.segmentHashes.size() != newCount * Manifest::SEGMENT_HASH_LENGTH) {
+		return false;
+	}
+
+	const CryptoPP::SecByteBlock key = getFileKey(password, header, keyCache);
+	SegmentCipher cipher(key, header.getSuite(), header.getNoncePrefix(), header.getAuthenticatedData());
+
+	// the old index holds the counters of the segments that stay, and the counters used so far
+	fileUtils::RandomAccessFile out(destination.string(), fileUtils::RandomAccessFile::UPDATE);
+	const uint64_t oldIndexOffset = EncryptedFileHeader::LENGTH + oldLength + oldCount * SegmentCipher::TAG_LENGTH;
+	if (out.size() < oldIndexOffset + SegmentIndex::FOOTER_LENGTH) {
+		throw GeneralSecurityException("File " + destination.string() + " was truncated");
+	}
+	std::vector<byte> oldIndex(static_cast<size_t>(out.size() - oldIndexOffset));
+	out.readAt(oldIndexOffset, oldIndex.data(), oldIndex.size());
+	const std::vector<SegmentIndex::Entry> oldEntries = verifyIndex(cipher, header, oldIndex.data(), oldIndex.size(), oldIndexOffset);
+	const SegmentIndex::Footer oldFooter = SegmentIndex::readFooter(oldIndex.data() + oldIndex.size() - SegmentIndex::FOOTER_LENGTH);
+
+	// the manifest remembers the counters too, so a copy rolled back to an older version can not make them repeat
+	uint64_t nextCounter = std::max<uint64_t>(SegmentIndex::nextCounter(oldFooter), previous.nextCounter);
+
+	// a segment is kept if its contents, its length and whether it is the last one did not change
+	std::vector<SegmentIndex::Entry> entries = SegmentIndex::contiguous(EncryptedFileHeader::LENGTH, newLength, segmentSize);
+	std::vector<size_t> changed;
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const bool kept = i < oldEntries.size() && oldEntries[i].plainLength == entries[i].plainLength
+			&& (i + 1 == oldEntries.size()) == (i + 1 == entries.size())
+			&& std::memcmp(previous.segmentHashes.data() + i * Manifest::SEGMENT_HASH_LENGTH,
+				current.segmentHashes.data() + i * Manifest::SEGMENT_HASH_LENGTH, Manifest::SEGMENT_HASH_LENGTH) == 0;
+		if (kept) entries[i].counter = oldEntries[i].counter;
+		else changed.push_back(i);
+	}
+
+	// every counter is used once, so running out means encrypting from scratch under a fresh nonce prefix. Counters
+	// stay below MAX_SEGMENTS, so the next one still fits the 32 bits the manifest records
+	const uint64_t pages = SegmentIndex::pageCount(newCount);
+	if (nextCounter + changed.size() + pages > SegmentCipher::MAX_SEGMENTS) {
+		throw GeneralSecurityException("Nonce counters of " + destination.string() + " are exhausted");
+	}
+	for (const size_t i : changed) entries[i].counter = static_cast<uint32_t>(nextCounter++);
+
+	fileUtils::RandomAccessFile in(file.string(), fileUtils::RandomAccessFile::READ);
+	if (in.size() != newLength) {
+		throw IOException("File " + file.string() + " changed while it was encrypted");
+	}
+
+	forEachSegmentBatch(changed.size(), [&](const uint64_t first, const uint64_t end) {
+		SegmentCipher batchCipher(key, header.getSuite(), header.getNoncePrefix(), header.getAuthenticatedData(), (end - first) * segmentSize);
+		std::vector<byte> plainSegment(segmentSize);
+		std::vector<byte> sealedSegment(segmentSize + SegmentCipher::TAG_LENGTH);
+
+		for (uint64_t j = first; j < end; ++j)
+		{
+			const size_t i = changed[static_cast<size_t>(j)];
+			const SegmentIndex::Entry &entry = entries[i];
+			in.readAt(static_cast<uint64_t>(i) * segmentSize, plainSegment.data(), entry.plainLength);
+			batchCipher.sealSegment(entry.counter, i + 1 == entries.size(), plainSegment.data(), entry.plainLength, sealedSegment.data());
+			out.writeAt(entry.offset, sealedSegment.data(), entry.sealedLength);
+		}
+	});
+
+	// the index moves with the length of the file, and is sealed under counters above those of the segments
+	const uint64_t indexOffset = EncryptedFileHeader::LENGTH + newLength + newCount * SegmentCipher::TAG_LENGTH;
+	const std::vector<byte> index = SegmentIndex::seal(cipher, entries, indexOffset, newLength, static_cast<uint32_t>(nextCounter));
+	nextCounter += pages;
+	out.writeAt(indexOffset, index.data(), index.size());
+	out.resize(indexOffset + index.size());
+
+	// the plaintext length is not bound to the segments, so the header is rewritten as is
+	EncryptedFileHeader updated = header;
+	updated.setPlaintextLength(newLength);
+	byte headerBytes[EncryptedFileHeader::LENGTH];
+	updated.write(headerBytes);
+	out.writeAt(0, headerBytes, sizeof(headerBytes));
+
+	LOG->debug("{} : {} of {} segments re-encrypted in place", destination.string(), changed.size(), newCount);
+	current.nextCounter = static_cast<uint32_t>(nextCounter);
+	return true;
+}
+
+filesystem::path FileEncrypter::updateChangedFile(const filesystem::path &file, const std::string &source, const Manifest::Entry &previous, Manifest::Entry &current, const std::string &password, KeyCache &keyCache)
+{
+	if (!inPlaceUpdates || previous.destination.empty() || previous.segmentSize == 0 || current.segmentSize == 0 || current.size == 0) return filesystem::path();
+
+	try
+	{
+		if (!updateFile(file, previous, current, password, keyCache)) return filesystem::path();
+	}
+	// the copy may be half updated, encrypting from scratch replaces it
+	catch (const GeneralSecurityException &ge)
+	{
+		LOG->warn("Could not update {} in place, encrypting it again : {}", previous.destination, ge.what());
+		return filesystem::path();
+	}
+	catch (const IOException &e)
+	{
+		LOG->warn("Could not update {} in place, encrypting it again : {}", previous.destination, e.what());
+		return filesystem::path();
+	}
+
+	++updatedFiles;
+	current.destination = previous.destination;
+	manifest->put(source, current);
+	return filesystem::path(previous.destination);
+}
+
+filesystem::path FileEncrypter::recordEncryption(const std::string &source, Manifest::Entry &current, const filesystem::path &encrypted)
+{
+	filesystem::path destination = encrypted;
+
+	Manifest::Entry previous;
+	std::error_code ec;
+	if (manifest->find(source, previous) && filesystem::exists(previous.destination, ec) && !filesystem::equivalent(previous.destination, encrypted, ec)) {
+		// replace the stale copy instead of leaving a numbered duplicate next to it
+		filesystem::rename(encrypted, previous.destination, ec);
+		if (ec) LOG->warn("Could not replace {} : {}", previous.destination, ec.message());
+		else destination = previous.destination;
+	}
+
+	current.destination = Manifest::sourceKey(destination);
+	manifest->put(source, current);
+	return destination;
+}
+
+filesystem::path FileEncrypter::encryptChangedFile(const filesystem::path &file, const CryptoPP::SecByteBlock &key, const byte salt[], const std::string &password, KeyCache &keyCache)
+{
+	if (!manifest) return encryptFile(file, key, salt);
+
+	std::string source;
+	Manifest::Entry current;
+	Manifest::Entry previous;
+	if (!needsEncryption(file, source, current, previous)) {
+		++unchangedFiles;
+		return filesystem::path();
+	}
+
+	const filesystem::path updated = updateChangedFile(file, source, previous, current, password, keyCache);
+	if (!updated.empty()) return updated;
+
+	const filesystem::path encrypted = encryptFile(file, key, salt);
+	if (encrypted.empty() || source.empty()) return encrypted;
+	return recordEncryption(source, current, encrypted);
+}
+
+std::vector<filesystem::path> FileEncrypter::encryptBatchAsync(const CryptoPP::SecByteBlock &key, const byte salt[], const std::vector<filesystem::path> &files, const std::string &password, KeyCache &keyCache)
+{
+	if (!manifest) return cipherFilesAsync(key, salt, files);
+
+	// only the changed files that can not be updated in place go to the batch engine
+	std::vector<filesystem::path> destinations(files.size());
+	std::vector<size_t> changed;
+	std::vector<filesystem::path> changedFiles;
+	std::vector<std::string> sources;
+	std::vector<Manifest::Entry> states;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		std::string source;
+		Manifest::Entry current;
+		Manifest::Entry previous;
+		if (!needsEncryption(files[i], source, current, previous)) {
+			++unchangedFiles;
+			continue;
+		}
+		destinations[i] = updateChangedFile(files[i], source, previous, current, password, keyCache);
+		if (!destinations[i].empty()) continue;
+		changed.push_back(i);
+		changedFiles.push_back(files[i]);
+		sources.push_back(source);
+		states.push_back(current);
+	}
+
+	const std::vector<filesystem::path> encrypted = cipherFilesAsync(key, salt, changedFiles);
+	for (size_t j = 0; j < changed.size(); ++j)
+	{
+		if (encrypted[j].empty() || sources[j].empty()) destinations[changed[j]] = encrypted[j];
+		else destinations[changed[j]] = recordEncryption(sources[j], states[j], encrypted[j]);
+	}
+	return destinations;
+}
+
 std::vector<filesystem::path> FileEncrypter::encryptFiles(std::vector<filesystem::path> files, const std::string &password)
 {
 
 	//create new success vector
 	std::vector<filesystem::path> successfullyEncrypted;
+	if (!loadManifest(password)) return successfullyEncrypted;
 	// generate new salt
 	byte salt[FileEncrypter::SALT_LENGTH];
 	FileEncrypter::generateRandomSalt(salt, FileEncrypter::SALT_LENGTH);
-	// generate new AES key
-	CryptoPP::SecByteBlock key = getAesKey(password, reinterpret_cast<char*>(salt));
+	// generate new AES key, shared read-only by all workers
+	const CryptoPP::SecByteBlock key = getAesKey(password, reinterpret_cast<char*>(salt), FileEncrypter::KDF_ITERATION_COUNT);
+	// keys of the earlier copies that are updated in place
+	KeyCache keyCache;
 
-	for (auto it = files.begin(); it != files.end(); ++it)
-	{
+	std::vector<char> encrypted(files.size(), 0);
+	std::atomic<size_t> processed(0);
 
-		// check if file exist
-		if (!filesystem::exists(*it)) {
-			LOG->warn("Skipping {}, Cause : file does not exist", it->string());
-			continue;
-		}
-		// check if folder
-		if (filesystem::is_directory(*it)) {
-			LOG->warn("Skipping {}, Cause : file is a directory", it->string());
-			continue;
-		}
-		// check if file a valid file
-		if (!filesystem::is_regular_file(*it)) {
-			LOG->warn("Skipping {}, Cause : file is not a valid file", it->string());
-			continue;
+	try
+	{
+		if (ioBackend == fileUtils::IoBackend::ASYNC) {
+			const std::vector<filesystem::path> destinations = encryptBatchAsync(key, salt, files, password, keyCache);
+			for (size_t i = 0; i < files.size(); ++i) encrypted[i] = !destinations[i].empty();
 		}
-		// check if file size is 0
-		if (filesystem::is_empty(*it)) {
-			LOG->warn("Skipping {}, Cause : file size is 0", it->string());
-			continue;
+		else {
+			forEachFile(files.size(), [&](const size_t i) {
+				filesystem::path newFilePath;
+				{
+					Metrics::FileTimer fileTimer(files[i].string());
+					newFilePath = encryptChangedFile(files[i], key, salt, password, keyCache);
+				}
+				const size_t done = ++processed;
+				if (newFilePath.empty()) return;
+
+				LOG->info("{}/{}  {} encrypted to {}", done, files.size(), files[i].string(), newFilePath.string());
+				encrypted[i] = 1;
+			});
 		}
+	}
+	catch (...)
+	{
+		// the files finished before the failure are not encrypted again by the next run
+		saveManifest(password);
+		throw;
+	}
 
-		// read file data
-		const std::vector<byte> dataVector = fileUtils::ReadAllBytes(it->string().c_str());
-		// generate new IV
-		byte iv[FileEncrypter::IV_LENGTH];
-		FileEncrypter::generateRandomIV(iv, FileEncrypter::IV_LENGTH);
-		// encrypt data
-		std::vector<byte> encryptedData = cipherData(key, iv, dataVector);
-		// create EncrpytedFile
-		EncryptedFile encryptedFile(encryptedData, std::vector<byte>(iv, iv + sizeof(iv)), std::vector<byte>(salt, salt + sizeof(salt)), std::vector<byte>());
-		// generate new file path
-		filesystem::path newFilePath = FileEncrypter::generateEncryptionName(*it);
+	saveManifest(password);
 
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (encrypted[i]) successfullyEncrypted.push_back(files[i]);
+	}
 
-		//try to write encrypted file to new path
-		try
-		{
-			EncryptedFile::writeEncryptedFileToDisk(newFilePath.string(), encryptedFile);
-			LOG->info("{}/{}  {} encrypted to {}", (it - files.begin()) + 1, files.size(), it->string(), newFilePath.string());
-			successfullyEncrypted.push_back(*it);
+	return successfullyEncrypted;
+}
 
+size_t FileEncrypter::encryptFiles(DirectoryWalker &walker, const std::string &password)
+{
+	if (!loadManifest(password)) return 0;
+	// generate new salt
+	byte salt[FileEncrypter::SALT_LENGTH];
+	FileEncrypter::generateRandomSalt(salt, FileEncrypter::SALT_LENGTH);
+	// generate new AES key, shared read-only by all workers
+	const CryptoPP::SecByteBlock key = getAesKey(password, reinterpret_cast<char*>(salt), FileEncrypter::KDF_ITERATION_COUNT);
+	// keys of the earlier copies that are updated in place
+	KeyCache keyCache;
+
+	std::atomic<size_t> processed(0);
+	std::atomic<size_t> encrypted(0);
+
+	try
+	{
+		if (ioBackend == fileUtils::IoBackend::ASYNC) {
+			// the batch engine takes a list, so the walker feeds it bounded batches
+			std::vector<filesystem::path> batch;
+			filesystem::path file;
+			bool more = true;
+			while (more)
+			{
+				batch.clear();
+				while (batch.size() < FileEncrypter::ASYNC_BATCH_FILES && (more = nextWalkedFile(walker, file))) batch.push_back(file);
+				if (batch.empty()) break;
+				for (const auto &destination : encryptBatchAsync(key, salt, batch, password, keyCache))
+				{
+					if (!destination.empty()) ++encrypted;
+				}
+			}
 		}
-		catch (const IOException &e)
-		{
-			LOG->critical("Failed to write {} to disk",newFilePath.string());
-			throw;
-			//TODO handle exception here
+		else {
+			forEachWalkedFile(walker, [&](const filesystem::path &file) {
+				filesystem::path newFilePath;
+				{
+					Metrics::FileTimer fileTimer(file.string());
+					newFilePath = encryptChangedFile(file, key, salt, password, keyCache);
+				}
+				const size_t done = ++processed;
+				if (newFilePath.empty()) return;
+
+				LOG->info("{}  {} encrypted to {}", done, file.string(), newFilePath.string());
+				++encrypted;
+			});
 		}
 	}
+	catch (...)
+	{
+		// the files finished before the failure are not encrypted again by the next run
+		saveManifest(password);
+		throw;
+	}
 
-	return successfullyEncrypted;
+	saveManifest(password);
+	return encrypted;
 }
 
 std::vector<filesystem::path> FileEncrypter::encryptFiles(char ** files, const size_t numFiles, const std::string &password)
@@ -210,129 +689,1667 @@ std::vector<filesystem::path> FileEncrypter::encryptFiles(char ** files, const s
 	return encryptFiles(paths, password);
 }
 
-std::vector<filesystem::path> FileEncrypter::decryptFiles(std::vector<filesystem::path> files, const std::string &password)
+filesystem::path FileEncrypter::decryptFile(const filesystem::path &file, const std::string &password, KeyCache &keyCache)
 {
-
-	// create new success vector
-	std::vector<filesystem::path> successfullyDecrypted;
-
-	for (auto it = files.begin(); it != files.end(); ++it) {
-
-		//try to read encrypted file from disk
+	// the magic tells the current format apart with a single small read
+	if (EncryptedFile::isEncryptedFile(file.string())) {
 		try
 		{
-			EncryptedFile encryptedFile = EncryptedFile::readEncryptedFileFromDisk(it->string());
-
-			// get values from encrypted file
-			const std::vector<byte> *encData = encryptedFile.getData();
-			const std::vector<byte> *iv = encryptedFile.getIv();
-			const std::vector<byte> *salt = encryptedFile.getSalt();
-			const std::vector<byte> *aad = encryptedFile.getAad();
-
-			// tedious cast (use c-style cast instead?)
-			const char * saltConstPtr = reinterpret_cast<const char*>(salt->data());
-			char * saltPtr = const_cast<char*>(saltConstPtr);
-
-			// generate AES key
-			CryptoPP::SecByteBlock key = getAesKey(password, saltPtr);
-			// decrypt data
-			std::vector<byte> decryptedData;
-			try { decryptedData = decipherData(key, iv->data(), *encData); }
-			catch (const GeneralSecurityException &ge) { LOG->critical(ge.what());	continue; }
 			// get new name for decrypted file
-			filesystem::path newFilePath = FileEncrypter::generateDecryptionName(*it);
-			// write data to new file
-			fileUtils::WriteAllBytes(newFilePath.string().c_str(), decryptedData);
-			// log result
-			LOG->info("{} decrypted to {}", it->string(), newFilePath.string());
-			// add to success list
-			successfullyDecrypted.push_back(*it);
-
-		}
-		catch (const IOException &e)
-		{
-			LOG->warn(e.what());
-			continue;
+			filesystem::path newFilePath = FileEncrypter::reserveDecryptionName(file);
+			decipherFileStreamed(password, keyCache, file, newFilePath);
+			return newFilePath;
 		}
+		catch (const GeneralSecurityException &ge) { LOG->critical(ge.what()); }
+		catch (const IOException &e) { LOG->warn(e.what()); }
+		catch (const filesystem::filesystem_error &e) { LOG->warn(e.what()); }
+		return filesystem::path();
 	}
 
-	return std::vector<filesystem::path>();
-}
-
-std::vector<filesystem::path> FileEncrypter::decryptFiles(char ** files, const size_t num_files, const std::string &password)
-{
-	return std::vector<filesystem::path>();
-}
+	//try to read legacy encrypted file from disk
+	try
+	{
+		EncryptedFile encryptedFile = EncryptedFile::readEncryptedFileFromDisk(file.string());
 
-std::vector<byte> FileEncrypter::decipherData(CryptoPP::SecByteBlock &key, const byte iv[], const std::vector<byte> &encryptedData)
-{
+		// get values from encrypted file
+		const std::vector<byte> *encData = encryptedFile.getData();
+		const std::vector<byte> *iv = encryptedFile.getIv();
+		const std::vector<byte> *salt = encryptedFile.getSalt();
 
-	// array for decrypted data
-	std::vector<byte> decryptedData(encryptedData.size());
+		if (salt->size() != FileEncrypter::SALT_LENGTH) {
+			LOG->warn("Skipping {}, Cause : invalid salt", file.string());
+			return filesystem::path();
+		}
 
-	// get cipher
-	CryptoPP::GCM<CryptoPP::AES>::Decryption decryptor;
-	decryptor.SetKeyWithIV(key, key.size(), iv, FileEncrypter::IV_LENGTH);
+		// generate AES key
+		const CryptoPP::SecByteBlock &key = getCachedAesKey(password, salt->data(), FileEncrypter::KDF_ITERATION_COUNT, keyCache);
+		if (ioBackend == fileUtils::IoBackend::MMAP) {
+			if (encData->size() < FileEncrypter::GCM_TAG_LENGTH) {
+				LOG->critical("{} is shorter than the tag", file.string());
+				return filesystem::path();
+			}
+			// get new name for decrypted file
+			filesystem::path newFilePath = FileEncrypter::reserveDecryptionName(file);
+			// decrypt straight into the mapping of the new file
+			try
+			{
+				fileUtils::MappedFile out(newFilePath.string(), encData->size() - FileEncrypter::GCM_TAG_LENGTH);
+				decipherData(key, iv->data(), encData->data(), encData->size(), out.data());
+				out.flush();
+			}
+			catch (const GeneralSecurityException &ge)
+			{
+				std::error_code ec;
+				filesystem::remove(newFilePath, ec);
+				LOG->critical(ge.what());
+				return filesystem::path();
+			}
+			catch (const IOException &)
+			{
+				std::error_code ec;
+				filesystem::remove(newFilePath, ec);
+				throw;
+			}
+			return newFilePath;
+		}
 
-	// try to decrypt
-	try
-	{
-		// ArraySource --> Decryption filter --> ArraySink
-		CryptoPP::ArraySource(&encryptedData[0], encryptedData.size(), true,
-			new CryptoPP::AuthenticatedDecryptionFilter(decryptor,
-				new CryptoPP::ArraySink(&decryptedData[0], decryptedData.size()), CryptoPP::AuthenticatedDecryptionFilter::DEFAULT_FLAGS, FileEncrypter::GCM_TAG_LENGTH));
+		// decrypt data
+		std::vector<byte> decryptedData;
+		try { decryptedData = decipherData(key, iv->data(), *encData); }
+		catch (const GeneralSecurityException &ge) { LOG->critical(ge.what());	return filesystem::path(); }
+		// get new name for decrypted file
+		filesystem::path newFilePath = FileEncrypter::reserveDecryptionName(file);
+		// write data to new file
+		fileUtils::WriteAllBytes(newFilePath.string().c_str(), decryptedData);
+		return newFilePath;
 	}
-	catch (CryptoPP::HashVerificationFilter::HashVerificationFailed& e)
+	catch (const IOException &e)
 	{
-		LOG->critical(e.what());
-		throw GeneralSecurityException(e.what());
+		LOG->warn(e.what());
+		return filesystem::path();
 	}
-	catch (CryptoPP::InvalidArgument& e)
+	catch (const filesystem::filesystem_error &e)
 	{
-		LOG->critical(e.what());
+		LOG->warn(e.what());
+		return filesystem::path();
 	}
-	catch (CryptoPP::Exception& e)
+}
+
+bool FileEncrypter::verifyFile(const filesystem::path &file, const std::string &password, KeyCache &keyCache)
+{
+	try
 	{
-		LOG->critical(e.what());
-	}
+		if (EncryptedFile::isEncryptedFile(file.string())) {
+			const EncryptedFileHeader header = FileEncrypter::readHeader(file);
+			const CryptoPP::SecByteBlock key = getFileKey(password, header, keyCache);
+
+			// the plaintext is authenticated and dropped, only the reads reach the disk
+			std::ifstream ifs(file.string(), std::ios::binary);
+			ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+			ifs.seekg(EncryptedFileHeader::LENGTH);
+			decipherStream(key, header, ifs, [](const byte[], const size_t) {});
+			return true;
+		}
+		if (!EncryptedFile::isLegacyEncryptedFile(file.string())) {
+			LOG->critical("{} is not an encrypted file", file.string());
+			return false;
+		}
 
-	return decryptedData;
+		EncryptedFile encryptedFile = EncryptedFile::readEncryptedFileFromDisk(file.string());
+		const std::vector<byte> *salt = encryptedFile.getSalt();
+		if (salt->size() != FileEncrypter::SALT_LENGTH) {
+			LOG->critical("{} has an invalid salt", file.string());
+			return false;
+		}
+		const CryptoPP::SecByteBlock &key = getCachedAesKey(password, salt->data(), FileEncrypter::KDF_ITERATION_COUNT, keyCache);
+		decipherData(key, encryptedFile.getIv()->data(), *encryptedFile.getData());
+		return true;
+	}
+	catch (const GeneralSecurityException &ge) { LOG->critical("{} : {}", file.string(), ge.what()); }
+	catch (const IOException &e) { LOG->critical("{} : {}", file.string(), e.what()); }
+	catch (const std::ios_base::failure &e) { LOG->critical("{} : {}", file.string(), e.what()); }
+	return false;
 }
 
-std::vector<byte> FileEncrypter::cipherData(CryptoPP::SecByteBlock &key, const byte iv[], const byte data[], const size_t dataLength)
+bool FileEncrypter::rekeyFile(const filesystem::path &file, const std::string &password, KeyCache &keyCache, const CryptoPP::SecByteBlock &newKey, const byte newSalt[])
 {
-	return cipherData(key, iv, std::vector<byte>(data, data + dataLength));
+	try
+	{
+		if (!EncryptedFile::isEncryptedFile(file.string())) {
+			LOG->warn("Skipping {}, Cause : not a streamed encrypted file", file.string());
+			return false;
+		}
+		EncryptedFileHeader header = FileEncrypter::readHeader(file);
+		if (!(header.getFlags() & EncryptedFileHeader::FLAG_WRAPPED_KEY)) {
+			LOG->warn("Skipping {}, Cause : it has no wrapped data key, decrypt and encrypt it again to change its password", file.string());
+			return false;
+		}
+
+		// the salt, iteration count and wrapped key are not bound to the segments
+		const CryptoPP::SecByteBlock dataKey = getFileKey(password, header, keyCache);
+		header.setKeyDerivation(newSalt, FileEncrypter::KDF_ITERATION_COUNT);
+		KeyWrap::wrap(newKey, dataKey, header);
+
+		byte headerBytes[EncryptedFileHeader::LENGTH];
+		header.write(headerBytes);
+		fileUtils::RandomAccessFile out(file.string(), fileUtils::RandomAccessFile::UPDATE);
+		out.writeAt(0, headerBytes, sizeof(headerBytes));
+		// the header holds the only copy of the wrapped key, it is counted as rekeyed once it is on the disk
+		out.sync();
+		return true;
+	}
+	catch (const GeneralSecurityException &ge) { LOG->critical("{} : {}", file.string(), ge.what()); }
+	catch (const IOException &e) { LOG->critical("{} : {}", file.string(), e.what()); }
+	return false;
 }
 
-std::vector<byte> FileEncrypter::cipherData(CryptoPP::SecByteBlock &key, const byte iv[], const std::vector<byte> &data)
+std::vector<filesystem::path> FileEncrypter::verifyFiles(const std::vector<filesystem::path> &files, const std::string &password)
 {
-	// create vector for encrytped data
-	std::vector<byte> encryptedData(data.size() + CryptoPP::AES::BLOCKSIZE);
-	// get cipher
-	CryptoPP::GCM<CryptoPP::AES>::Encryption encryptor;
-	encryptor.SetKeyWithIV(key, key.size(), iv, FileEncrypter::IV_LENGTH);
+	std::vector<char> failed(files.size(), 0);
+	std::atomic<size_t> processed(0);
+	KeyCache keyCache;
 
-	// try to encrypt
-	try
+	forEachFile(files.size(), [&](const size_t i) {
+		bool intact;
+		{
+			Metrics::FileTimer fileTimer(files[i].string());
+			intact = verifyFile(files[i], password, keyCache);
+		}
+		const size_t done = ++processed;
+		if (intact) LOG->info("{}/{}  {} verified", done, files.size(), files[i].string());
+		else failed[i] = 1;
+	});
+
+	std::vector<filesystem::path> failures;
+	for (size_t i = 0; i < files.size(); ++i)
 	{
-		// ArraySource --> Encryption filter --> ArraySink
-		CryptoPP::ArraySource(&data[0], data.size(), true,
-			new CryptoPP::AuthenticatedEncryptionFilter(encryptor,
-				new CryptoPP::ArraySink(&encryptedData[0], encryptedData.size())));
+		if (failed[i]) failures.push_back(files[i]);
 	}
-	catch (CryptoPP::Exception& e)
+	LOG->info("Verified {} files, {} failed", files.size(), failures.size());
+	return failures;
+}
+
+size_t FileEncrypter::verifyFiles(DirectoryWalker &walker, const std::string &password)
+{
+	std::atomic<size_t> processed(0);
+	std::atomic<size_t> failed(0);
+	KeyCache keyCache;
+
+	forEachWalkedFile(walker, [&](const filesystem::path &file) {
+		bool intact;
+		{
+			Metrics::FileTimer fileTimer(file.string());
+			intact = verifyFile(file, password, keyCache);
+		}
+		const size_t done = ++processed;
+		if (intact) LOG->info("{}  {} verified", done, file.string());
+		else ++failed;
+	});
+
+	LOG->info("Verified {} files, {} failed", processed.load(), failed.load());
+	return failed;
+}
+
+std::vector<filesystem::path> FileEncrypter::rekeyFiles(const std::vector<filesystem::path> &files, const std::string &password, const std::string &newPassword)
+{
+	std::vector<filesystem::path> rekeyed;
+	if (!loadManifest(password)) return rekeyed;
+	// one derivation of the new password for the whole run, one of the old one per salt found
+	byte salt[FileEncrypter::SALT_LENGTH];
+	FileEncrypter::generateRandomSalt(salt, FileEncrypter::SALT_LENGTH);
+	const CryptoPP::SecByteBlock newKey = getAesKey(newPassword, reinterpret_cast<char*>(salt), FileEncrypter::KDF_ITERATION_COUNT);
+	KeyCache keyCache;
+
+	std::vector<char> done(files.size(), 0);
+	std::atomic<size_t> processed(0);
+	forEachFile(files.size(), [&](const size_t i) {
+		bool success;
+		{
+			Metrics::FileTimer fileTimer(files[i].string());
+			success = rekeyFile(files[i], password, keyCache, newKey, salt);
+		}
+		const size_t count = ++processed;
+		if (!success) return;
+		LOG->info("{}/{}  {} rekeyed", count, files.size(), files[i].string());
+		done[i] = 1;
+	});
+
+	for (size_t i = 0; i < files.size(); ++i)
 	{
-		LOG->critical(e.what());
+		if (done[i]) rekeyed.push_back(files[i]);
 	}
+	LOG->info("Rekeyed {} of {} files", rekeyed.size(), files.size());
+	saveManifest(newPassword, true);
+	return rekeyed;
+}
+
+size_t FileEncrypter::rekeyFiles(DirectoryWalker &walker, const std::string &password, const std::string &newPassword)
+{
+	if (!loadManifest(password)) return 0;
+	// one derivation of the new password for the whole run, one of the old one per salt found
+	byte salt[FileEncrypter::SALT_LENGTH];
+	FileEncrypter::generateRandomSalt(salt, FileEncrypter::SALT_LENGTH);
+	const CryptoPP::SecByteBlock newKey = getAesKey(newPassword, reinterpret_cast<char*>(salt), FileEncrypter::KDF_ITERATION_COUNT);
+	KeyCache keyCache;
 
-	return encryptedData;
+	std::atomic<size_t> processed(0);
+	std::atomic<size_t> rekeyed(0);
+	forEachWalkedFile(walker, [&](const filesystem::path &file) {
+		bool success;
+		{
+			Metrics::FileTimer fileTimer(file.string());
+			success = rekeyFile(file, password, keyCache, newKey, salt);
+		}
+		const size_t count = ++processed;
+		if (!success) return;
+		LOG->info("{}  {} rekeyed", count, file.string());
+		++rekeyed;
+	});
+
+	LOG->info("Rekeyed {} of {} files", rekeyed.load(), processed.load());
+	saveManifest(newPassword, true);
+	return rekeyed;
 }
 
+std::vector<filesystem::path> FileEncrypter::decryptFiles(std::vector<filesystem::path> files, const std::string &password)
+{
+
+	// create new success vector
+	std::vector<filesystem::path> successfullyDecrypted;
+
+	std::vector<char> decrypted(files.size(), 0);
+	std::atomic<size_t> processed(0);
+	// files encrypted in one batch share a salt, so their key is derived once
+	KeyCache keyCache;
+
+	forEachFile(files.size(), [&](const size_t i) {
+		filesystem::path newFilePath;
+		{
+			Metrics::FileTimer fileTimer(files[i].string());
+			newFilePath = decryptFile(files[i], password, keyCache);
+		}
+		const size_t done = ++processed;
+		if (newFilePath.empty()) return;
+
+		// log result
+		LOG->info("{}/{}  {} decrypted to {}", done, files.size(), files[i].string(), newFilePath.string());
+		decrypted[i] = 1;
+	});
+
+	LOG->info("Key cache : {} hits, {} misses", keyCache.getHits(), keyCache.getMisses());
+
+	// add to success list
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (decrypted[i]) successfullyDecrypted.push_back(files[i]);
+	}
+
+	return successfullyDecrypted;
+}
+
+size_t FileEncrypter::decryptFiles(DirectoryWalker &walker, const std::string &password)
+{
+	std::atomic<size_t> processed(0);
+	std::atomic<size_t> decrypted(0);
+	// files encrypted in one batch share a salt, so their key is derived once
+	KeyCache keyCache;
+
+	forEachWalkedFile(walker, [&](const filesystem::path &file) {
+		filesystem::path newFilePath;
+		{
+			Metrics::FileTimer fileTimer(file.string());
+			newFilePath = decryptFile(file, password, keyCache);
+		}
+		const size_t done = ++processed;
+		if (newFilePath.empty()) return;
+
+		LOG->info("{}  {} decrypted to {}", done, file.string(), newFilePath.string());
+		++decrypted;
+	});
+
+	LOG->info("Key cache : {} hits, {} misses", keyCache.getHits(), keyCache.getMisses());
+	return decrypted;
+}
+
+std::vector<filesystem::path> FileEncrypter::decryptFiles(char ** files, const size_t numFiles, const std::string &password)
+{
+	// create vector from 2d array
+	std::vector<filesystem::path> paths(numFiles);
+	for (size_t i = 0; i < numFiles; i++)
+	{
+		paths[i] = filesystem::path(files[i]);
+	}
+
+	return decryptFiles(paths, password);
+}
+
+std::vector<byte> FileEncrypter::decipherData(const CryptoPP::SecByteBlock &key, const byte iv[], const std::vector<byte> &encryptedData)
+{
+	if (encryptedData.size() < FileEncrypter::GCM_TAG_LENGTH) {
+		throw GeneralSecurityException("Encrypted data is shorter than the tag");
+	}
+
+	// array for decrypted data, the tag is not part of it
+	std::vector<byte> decryptedData(encryptedData.size() - FileEncrypter::GCM_TAG_LENGTH);
+	decipherData(key, iv, encryptedData.data(), encryptedData.size(), decryptedData.data());
+	return decryptedData;
+}
+
+void FileEncrypter::decipherData(const CryptoPP::SecByteBlock &key, const byte iv[], const byte encryptedData[], const size_t encryptedLength, byte output[])
+{
+	if (encryptedLength < FileEncrypter::GCM_TAG_LENGTH) {
+		throw GeneralSecurityException("Encrypted data is shorter than the tag");
+	}
+
+	Metrics::Timer timer(Metrics::CIPHER, encryptedLength);
+	// get cipher
+	CryptoPP::GCM<CryptoPP::AES>::Decryption decryptor;
+	decryptor.SetKey(key, key.size());
+
+	// decrypt straight into the output, without a filter chain buffering the data
+	const size_t length = encryptedLength - FileEncrypter::GCM_TAG_LENGTH;
+	if (!decryptor.DecryptAndVerify(output, encryptedData + length, FileEncrypter::GCM_TAG_LENGTH, iv, FileEncrypter::IV_LENGTH,
+		nullptr, 0, encryptedData, length)) {
+		throw GeneralSecurityException("Encrypted data failed authentication");
+	}
+}
+
+void FileEncrypter::cipherStream(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, std::istream &in, std::ostream &out)
+{
+	uint64_t remaining = header.getPlaintextLength();
+	cipherStream(key, header, [&](byte buffer[], const size_t length) {
+		in.read(reinterpret_cast<char*>(buffer), length);
+		// a stream that runs short fails the read, one that grew is caught after the last segment
+		remaining -= length;
+		if (remaining == 0 && in.peek() != std::char_traits<char>::eof()) {
+			throw IOException("Input changed while it was encrypted");
+		}
+	}, out);
+}
+
+void FileEncrypter::cipherStream(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const std::function<void(byte[], size_t)> &read, std::ostream &out)
+{
+	SegmentCipher cipher(key, header.getSuite(), header.getNoncePrefix(), header.getAuthenticatedData(), header.getPlaintextLength());
+	const uint64_t plaintextLength = header.getPlaintextLength();
+	const uint32_t segmentSize = header.getSegmentSize();
+	const uint64_t segmentCount = SegmentCipher::segmentCount(plaintextLength, segmentSize);
+	const uint64_t firstOffset = static_cast<uint64_t>(out.tellp());
+	const bool compress = (header.getFlags() & EncryptedFileHeader::FLAG_COMPRESSED) != 0;
+	std::vector<SegmentIndex::Entry> entries = SegmentIndex::contiguous(firstOffset, plaintextLength, segmentSize);
+	std::vector<byte> compressedSegment(compress ? segmentSize : 0);
+	uint64_t indexOffset = firstOffset;
+
+	// the next segment is read and the previous one written while the current one is sealed
+	Pipeline::run(segmentCount, segmentSize, segmentSize + SegmentCipher::TAG_LENGTH,
+		[&](Pipeline::Buffer &buffer) {
+			buffer.length = static_cast<size_t>(std::min<uint64_t>(plaintextLength - buffer.sequence * segmentSize, segmentSize));
+			Metrics::Timer timer(Metrics::READ, buffer.length);
+			read(buffer.input.data(), buffer.length);
+		},
+		[&](Pipeline::Buffer &buffer) {
+			SegmentIndex::Entry &entry = entries[static_cast<size_t>(buffer.sequence)];
+			const bool last = buffer.sequence + 1 == segmentCount;
+			const size_t compressedLength = compress ? Compression::deflate(buffer.input.data(), buffer.length, compressedSegment.data()) : 0;
+			if (compressedLength != 0) {
+				cipher.sealSegment(buffer.sequence, last, compressedSegment.data(), compressedLength, buffer.output.data());
+				entry.sealedLength = static_cast<uint32_t>(compressedLength + SegmentCipher::TAG_LENGTH);
+			}
+			else cipher.sealSegment(buffer.sequence, last, buffer.input.data(), buffer.length, buffer.output.data());
+
+			// segments are stored back to back, whatever their length
+			entry.offset = indexOffset;
+			indexOffset += entry.sealedLength;
+		},
+		[&](Pipeline::Buffer &buffer) {
+			const SegmentIndex::Entry &entry = entries[static_cast<size_t>(buffer.sequence)];
+			Metrics::Timer timer(Metrics::WRITE, entry.sealedLength);
+			out.write(reinterpret_cast<const char*>(buffer.output.data()), entry.sealedLength);
+		});
+
+	const std::vector<byte> index = SegmentIndex::seal(cipher, entries, indexOffset, plaintextLength);
+	out.write(reinterpret_cast<const char*>(index.data()), index.size());
+}
+
+void FileEncrypter::decipherStream(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, std::istream &in, std::ostream &out)
+{
+	decipherStream(key, header, in, [&](const byte buffer[], const size_t length) {
+		out.write(reinterpret_cast<const char*>(buffer), length);
+	});
+}
+
+void FileEncrypter::decipherStream(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, std::istream &in, const std::function<void(const byte[], size_t)> &write)
+{
+	SegmentCipher cipher(key, header.getSuite(), header.getNoncePrefix(), header.getAuthenticatedData(), header.getPlaintextLength());
+	const uint64_t plaintextLength = header.getPlaintextLength();
+	const uint32_t segmentSize = header.getSegmentSize();
+	const uint64_t segmentCount = SegmentCipher::segmentCount(plaintextLength, segmentSize);
+
+	// the segment index follows the last segment and holds the nonce counters, so it is read first
+	const std::streamoff firstOffset = in.tellg();
+	uint64_t indexOffset = static_cast<uint64_t>(firstOffset) + plaintextLength + segmentCount * SegmentCipher::TAG_LENGTH;
+	in.seekg(0, std::ios::end);
+	const uint64_t fileSize = static_cast<uint64_t>(in.tellg());
+	if (header.getFlags() & EncryptedFileHeader::FLAG_COMPRESSED) {
+		// compressed segments have no fixed length, only the footer locates the index
+		if (fileSize < static_cast<uint64_t>(firstOffset) + SegmentIndex::FOOTER_LENGTH) {
+			throw GeneralSecurityException("Segment index is truncated");
+		}
+		byte footer[SegmentIndex::FOOTER_LENGTH];
+		in.seekg(static_cast<std::streamoff>(fileSize - SegmentIndex::FOOTER_LENGTH));
+		in.read(reinterpret_cast<char*>(footer), sizeof(footer));
+		indexOffset = SegmentIndex::readFooter(footer).indexOffset;
+		if (indexOffset < static_cast<uint64_t>(firstOffset) || indexOffset > fileSize - SegmentIndex::FOOTER_LENGTH) {
+			throw GeneralSecurityException("Segment index does not match its location");
+		}
+	}
+	if (fileSize < indexOffset + SegmentIndex::FOOTER_LENGTH) {
+		throw GeneralSecurityException("Segment index is truncated, the file ends at offset " + std::to_string(fileSize) + " of at least "
+			+ std::to_string(indexOffset + SegmentIndex::FOOTER_LENGTH));
+	}
+	std::vector<byte> index(static_cast<size_t>(fileSize - indexOffset));
+	in.seekg(static_cast<std::streamoff>(indexOffset));
+	in.read(reinterpret_cast<char*>(index.data()), index.size());
+	const std::vector<SegmentIndex::Entry> entries = verifyIndex(cipher, header, index.data(), index.size(), indexOffset);
+	in.seekg(firstOffset);
+	std::vector<byte> compressedSegment((header.getFlags() & EncryptedFileHeader::FLAG_COMPRESSED) ? segmentSize : 0);
+
+	// the next segment is read and the previous one written while the current one is verified
+	Pipeline::run(segmentCount, segmentSize + SegmentCipher::TAG_LENGTH, segmentSize,
+		[&](Pipeline::Buffer &buffer) {
+			buffer.length = entries[static_cast<size_t>(buffer.sequence)].sealedLength;
+			Metrics::Timer timer(Metrics::READ, buffer.length);
+			in.read(reinterpret_cast<char*>(buffer.input.data()), buffer.length);
+		},
+		[&](Pipeline::Buffer &buffer) {
+			const SegmentIndex::Entry &entry = entries[static_cast<size_t>(buffer.sequence)];
+			if (!openStoredSegment(cipher, entry, buffer.sequence + 1 == segmentCount, buffer.input.data(), compressedSegment.data(), buffer.output.data())) {
+				throw GeneralSecurityException("Segment " + std::to_string(buffer.sequence) + " at offset " + std::to_string(entry.offset) + " failed authentication");
+			}
+		},
+		[&](Pipeline::Buffer &buffer) {
+			const SegmentIndex::Entry &entry = entries[static_cast<size_t>(buffer.sequence)];
+			Metrics::Timer timer(Metrics::WRITE, entry.plainLength);
+			write(buffer.output.data(), entry.plainLength);
+		});
+}
+
+std::vector<SegmentIndex::Entry> FileEncrypter::verifyIndex(SegmentCipher &cipher, const EncryptedFileHeader &header, const byte index[], const size_t indexLength, const uint64_t indexOffset)
+{
+	std::vector<SegmentIndex::Entry> entries = SegmentIndex::open(cipher, index, indexLength, indexOffset, header.getPlaintextLength());
+	const std::vector<SegmentIndex::Entry> expected = SegmentIndex::contiguous(EncryptedFileHeader::LENGTH, header.getPlaintextLength(), header.getSegmentSize());
+	if (header.getFlags() & EncryptedFileHeader::FLAG_COMPRESSED) {
+		// compressed segments are stored back to back, each one no longer than stored as is
+		bool valid = entries.size() == expected.size();
+		uint64_t offset = EncryptedFileHeader::LENGTH;
+		for (size_t i = 0; valid && i < entries.size(); ++i)
+		{
+			valid = entries[i].offset == offset && entries[i].plainLength == expected[i].plainLength
+				&& entries[i].sealedLength >= SegmentCipher::TAG_LENGTH && entries[i].sealedLength <= expected[i].sealedLength;
+			offset += entries[i].sealedLength;
+		}
+		if (!valid || offset != indexOffset) throw GeneralSecurityException("Segment index does not match the segments");
+	}
+	else if (entries != expected) {
+		throw GeneralSecurityException("Segment index does not match the segments");
+	}
+	return entries;
+}
+
+bool FileEncrypter::openStoredSegment(SegmentCipher &cipher, const SegmentIndex::Entry &entry, const bool last, const byte sealed[], byte scratch[], byte output[])
+{
+	// a segment stored as is is exactly its plaintext plus the tag
+	if (entry.sealedLength == entry.plainLength + SegmentCipher::TAG_LENGTH) {
+		return cipher.openSegment(entry.counter, last, sealed, entry.sealedLength, output);
+	}
+	if (!cipher.openSegment(entry.counter, last, sealed, entry.sealedLength, scratch)) return false;
+	Compression::inflate(scratch, entry.sealedLength - SegmentCipher::TAG_LENGTH, output, entry.plainLength);
+	return true;
+}
+
+EncryptedFileHeader FileEncrypter::readHeader(const filesystem::path &source)
+{
+	const EncryptedFileHeader header = EncryptedFile::readHeader(source.string());
+
+	if (!CipherSuite::isSupported(header.getSuite()) || header.getKdf() != EncryptedFileHeader::KDF_PBKDF2_HMAC_SHA256
+		|| (header.getFlags() & ~(EncryptedFileHeader::FLAG_PACKED | EncryptedFileHeader::FLAG_COMPRESSED | EncryptedFileHeader::FLAG_WRAPPED_KEY)) != 0) {
+		throw IOException("File " + source.string() + " uses an unsupported cipher suite, key derivation or flag");
+	}
+	// validate header before deriving or allocating anything based on it
+	if (header.getKdfIterations() == 0 || header.getKdfIterations() > FileEncrypter::MAX_KDF_ITERATION_COUNT
+		|| header.getSegmentSize() == 0 || header.getSegmentSize() > FileEncrypter::MAX_SEGMENT_SIZE
+		|| SegmentCipher::segmentCount(header.getPlaintextLength(), header.getSegmentSize()) > SegmentCipher::MAX_SEGMENTS) {
+		throw IOException("File " + source.string() + " has an invalid header");
+	}
+
+	return header;
+}
+
+void FileEncrypter::cipherFileStreamed(const CryptoPP::SecByteBlock &key, const byte salt[], const filesystem::path &source, const filesystem::path &destination)
+{
+	// generate new nonce prefix
+	byte noncePrefix[SegmentCipher::NONCE_PREFIX_LENGTH];
+	FileEncrypter::generateRandomIV(noncePrefix, SegmentCipher::NONCE_PREFIX_LENGTH);
+
+	try
+	{
+		const uint64_t plaintextLength = filesystem::file_size(source);
+		EncryptedFileHeader header(salt, noncePrefix, FileEncrypter::KDF_ITERATION_COUNT, FileEncrypter::SEGMENT_SIZE, plaintextLength);
+		header.setSuite(suite);
+
+		// compressed segments have no fixed offsets, so only the streaming path writes them
+		const bool compress = compression && isCompressible(source);
+		if (compress) header.setFlags(EncryptedFileHeader::FLAG_COMPRESSED);
+		// the run key only wraps the random key of the file
+		const CryptoPP::SecByteBlock dataKey = KeyWrap::generate(key, header);
+
+		if (!compress && ioBackend == fileUtils::IoBackend::MMAP) {
+			cipherFileMapped(dataKey, header, source, destination);
+			return;
+		}
+
+		if (!compress && ioBackend == fileUtils::IoBackend::DIRECT) {
+			cipherFileDirect(dataKey, header, source, destination);
+			return;
+		}
+
+		// big files are split across the worker pool
+		if (!compress && pool && plaintextLength >= 2ull * FileEncrypter::SEGMENTS_PER_TASK * FileEncrypter::SEGMENT_SIZE) {
+			cipherFileParallel(dataKey, header, source, destination);
+			return;
+		}
+
+		std::ifstream ifs(source.string(), std::ios::binary);
+		ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		std::ofstream ofs(destination.string(), std::ios::binary);
+		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+
+		EncryptedFile::writeHeader(ofs, header);
+		cipherStream(dataKey, header, ifs, ofs);
+		ofs.close();
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		LOG->critical(e.what());
+		std::error_code ec;
+		filesystem::remove(destination, ec);
+		throw IOException(e.what());
+	}
+	catch (const filesystem::filesystem_error &e)
+	{
+		LOG->critical(e.what());
+		std::error_code ec;
+		filesystem::remove(destination, ec);
+		throw IOException(e.what());
+	}
+	catch (const IOException &)
+	{
+		std::error_code ec;
+		filesystem::remove(destination, ec);
+		throw;
+	}
+}
+
+void FileEncrypter::decipherFileStreamed(const std::string &password, KeyCache &keyCache, const filesystem::path &source, const filesystem::path &destination)
+{
+	try
+	{
+		const EncryptedFileHeader header = FileEncrypter::readHeader(source);
+		if (header.getFlags() & EncryptedFileHeader::FLAG_PACKED) {
+			throw IOException(source.string() + " is a packed archive, extract it with -u --pack");
+		}
+
+		const CryptoPP::SecByteBlock key = getFileKey(password, header, keyCache);
+		const bool compressed = (header.getFlags() & EncryptedFileHeader::FLAG_COMPRESSED) != 0;
+
+		if (!compressed && ioBackend == fileUtils::IoBackend::MMAP) {
+			decipherFileMapped(key, header, source, destination);
+			return;
+		}
+
+		// big files are split across the worker pool
+		if (!compressed && pool && header.getPlaintextLength() >= 2ull * FileEncrypter::SEGMENTS_PER_TASK * header.getSegmentSize()) {
+			decipherFileParallel(key, header, source, destination);
+			return;
+		}
+
+		std::ifstream ifs(source.string(), std::ios::binary);
+		ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		ifs.seekg(EncryptedFileHeader::LENGTH);
+		std::ofstream ofs(destination.string(), std::ios::binary);
+		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+		decipherStream(key, header, ifs, ofs);
+		ofs.close();
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		std::error_code ec;
+		filesystem::remove(destination, ec);
+		throw IOException(source.string() + " : " + e.what());
+	}
+	catch (...)
+	{
+		std::error_code ec;
+		filesystem::remove(destination, ec);
+		throw;
+	}
+}
+
+void FileEncrypter::cipherFileParallel(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const filesystem::path &source, const filesystem::path &destination)
+{
+	const uint64_t plaintextLength = header.getPlaintextLength();
+	const uint32_t segmentSize = header.getSegmentSize();
+	const uint64_t segmentCount = SegmentCipher::segmentCount(plaintextLength, segmentSize);
+	const byte * const noncePrefix = header.getNoncePrefix();
+	const std::vector<byte> headerAad = header.getAuthenticatedData();
+
+	// the header has a fixed length, so the offset of every segment is known
+	byte headerBytes[EncryptedFileHeader::LENGTH];
+	header.write(headerBytes);
+
+	const uint64_t indexOffset = EncryptedFileHeader::LENGTH + plaintextLength + segmentCount * SegmentCipher::TAG_LENGTH;
+
+	fileUtils::RandomAccessFile in(source.string(), fileUtils::RandomAccessFile::READ);
+	if (in.size() != plaintextLength) {
+		throw IOException("File " + source.string() + " changed while it was encrypted");
+	}
+	fileUtils::RandomAccessFile out(destination.string(), fileUtils::RandomAccessFile::WRITE);
+	out.writeAt(0, headerBytes, sizeof(headerBytes));
+	out.resize(indexOffset + SegmentIndex::sealedLength(segmentCount));
+
+	forEachSegmentBatch(segmentCount, [&](const uint64_t first, const uint64_t end) {
+		SegmentCipher cipher(key, header.getSuite(), noncePrefix, headerAad, (end - first) * segmentSize);
+		std::vector<byte> plainSegment(segmentSize);
+		std::vector<byte> sealedSegment(segmentSize + SegmentCipher::TAG_LENGTH);
+
+		for (uint64_t i = first; i < end; ++i)
+		{
+			const uint64_t plainOffset = i * segmentSize;
+			const size_t length = static_cast<size_t>(std::min<uint64_t>(plaintextLength - plainOffset, segmentSize));
+			in.readAt(plainOffset, plainSegment.data(), length);
+			cipher.sealSegment(i, i + 1 == segmentCount, plainSegment.data(), length, sealedSegment.data());
+			out.writeAt(EncryptedFileHeader::LENGTH + i * (segmentSize + SegmentCipher::TAG_LENGTH), sealedSegment.data(), length + SegmentCipher::TAG_LENGTH);
+		}
+	});
+
+	SegmentCipher cipher(key, header.getSuite(), noncePrefix, headerAad);
+	const std::vector<byte> index = SegmentIndex::seal(cipher, SegmentIndex::contiguous(EncryptedFileHeader::LENGTH, plaintextLength, segmentSize), indexOffset, plaintextLength);
+	out.writeAt(indexOffset, index.data(), index.size());
+}
+
+std::vector<filesystem::path> FileEncrypter::cipherFilesAsync(const CryptoPP::SecByteBlock &key, const byte salt[], const std::vector<filesystem::path> &files)
+{
+	// a file being encrypted
+	struct Job {
+		size_t file;
+		filesystem::path destination;
+		EncryptedFileHeader header;
+		CryptoPP::SecByteBlock dataKey;
+		std::vector<byte> headerAad;
+		std::unique_ptr<fileUtils::RandomAccessFile> in;
+		std::unique_ptr<fileUtils::RandomAccessFile> out;
+		uint64_t segmentCount;
+		uint64_t nextSegment;
+		uint64_t writtenSegments;
+		unsigned int inFlight;
+		bool failed;
+	};
+
+	// a segment buffer, read into and sealed in place, then written from
+	struct Slot {
+		AsyncIo::Request request;
+		std::vector<byte> buffer;
+		Job *job;
+		uint64_t segment;
+	};
+
+	const size_t sealedSegmentSize = FileEncrypter::SEGMENT_SIZE + SegmentCipher::TAG_LENGTH;
+	std::vector<filesystem::path> destinations(files.size());
+	size_t processed = 0;
+
+	// declared before the backend, so buffers and files outlive any request still in flight on an exception
+	std::vector<Slot> slots(FileEncrypter::ASYNC_QUEUE_DEPTH);
+	std::vector<Slot*> freeSlots;
+	for (Slot &slot : slots)
+	{
+		slot.buffer.resize(sealedSegmentSize);
+		slot.request.context = &slot;
+		freeSlots.push_back(&slot);
+	}
+	std::list<std::unique_ptr<Job>> jobs;
+
+	std::unique_ptr<AsyncIo> io = AsyncIo::create(FileEncrypter::ASYNC_QUEUE_DEPTH);
+	LOG->info("Asynchronous I/O through {}", io->name());
+
+	auto finish = [&](Job &job) {
+		++processed;
+		if (!job.failed) {
+			try
+			{
+				// the header has a fixed length, so it can go last along with the index
+				byte headerBytes[EncryptedFileHeader::LENGTH];
+				job.header.write(headerBytes);
+				job.out->writeAt(0, headerBytes, sizeof(headerBytes));
+
+				const uint64_t plaintextLength = job.header.getPlaintextLength();
+				const uint64_t indexOffset = EncryptedFileHeader::LENGTH + plaintextLength + job.segmentCount * SegmentCipher::TAG_LENGTH;
+				SegmentCipher cipher(job.dataKey, job.header.getSuite(), job.header.getNoncePrefix(), job.headerAad);
+				const std::vector<byte> index = SegmentIndex::seal(cipher, SegmentIndex::contiguous(EncryptedFileHeader::LENGTH, plaintextLength, FileEncrypter::SEGMENT_SIZE), indexOffset, plaintextLength);
+				job.out->writeAt(indexOffset, index.data(), index.size());
+
+				LOG->info("{}/{}  {} encrypted to {}", processed, files.size(), files[job.file].string(), job.destination.string());
+				destinations[job.file] = job.destination;
+			}
+			catch (const IOException &e)
+			{
+				LOG->critical(e.what());
+				job.failed = true;
+			}
+		}
+
+		job.in.reset();
+		job.out.reset();
+		if (job.failed) {
+			LOG->critical("Failed to write {} to disk", job.destination.string());
+			std::error_code ec;
+			filesystem::remove(job.destination, ec);
+		}
+	};
+
+	unsigned int inFlight = 0;
+	// returns a slot whose request is done for good, and completes its file after the last one
+	auto release = [&](Slot &slot) {
+		Job &job = *slot.job;
+		freeSlots.push_back(&slot);
+		--job.inFlight;
+		--inFlight;
+
+		if (job.inFlight == 0 && (job.failed || job.writtenSegments == job.segmentCount)) {
+			finish(job);
+			jobs.remove_if([&](const std::unique_ptr<Job> &j) { return j.get() == &job; });
+		}
+	};
+
+	// seals a read segment in place, on whichever thread of the pool runs it
+	std::vector<Slot*> sealing;
+	auto seal = [&](const size_t i) {
+		Slot &slot = *sealing[i];
+		const Job &job = *slot.job;
+		SegmentCipher cipher(job.dataKey, job.header.getSuite(), job.header.getNoncePrefix(), job.headerAad, slot.request.length);
+		cipher.sealSegment(slot.segment, slot.segment + 1 == job.segmentCount, slot.buffer.data(), slot.request.length, slot.buffer.data());
+	};
+
+	size_t nextFile = 0;
+	for (;;)
+	{
+		// open the next files
+		while (jobs.size() < FileEncrypter::ASYNC_OPEN_FILES && nextFile < files.size())
+		{
+			const size_t file = nextFile++;
+			if (!isEncryptable(files[file])) {
+				++processed;
+				continue;
+			}
+
+			std::unique_ptr<Job> job(new Job());
+			job->file = file;
+			job->destination = reserveEncryptionName(files[file]);
+			try
+			{
+				byte noncePrefix[SegmentCipher::NONCE_PREFIX_LENGTH];
+				FileEncrypter::generateRandomIV(noncePrefix, SegmentCipher::NONCE_PREFIX_LENGTH);
+
+				const uint64_t plaintextLength = filesystem::file_size(files[file]);
+				job->header = EncryptedFileHeader(salt, noncePrefix, FileEncrypter::KDF_ITERATION_COUNT, FileEncrypter::SEGMENT_SIZE, plaintextLength);
+				job->header.setSuite(suite);
+				job->dataKey = KeyWrap::generate(key, job->header);
+				job->headerAad = job->header.getAuthenticatedData();
+				job->segmentCount = SegmentCipher::segmentCount(plaintextLength, FileEncrypter::SEGMENT_SIZE);
+				job->in.reset(new fileUtils::RandomAccessFile(files[file].string(), fileUtils::RandomAccessFile::READ));
+				job->out.reset(new fileUtils::RandomAccessFile(job->destination.string(), fileUtils::RandomAccessFile::WRITE));
+				job->out->resize(EncryptedFileHeader::LENGTH + plaintextLength + job->segmentCount * SegmentCipher::TAG_LENGTH + SegmentIndex::sealedLength(job->segmentCount));
+			}
+			catch (const filesystem::filesystem_error &e)
+			{
+				LOG->critical(e.what());
+				job->failed = true;
+				finish(*job);
+				continue;
+			}
+			catch (const IOException &e)
+			{
+				LOG->critical(e.what());
+				job->failed = true;
+				finish(*job);
+				continue;
+			}
+			jobs.push_back(std::move(job));
+		}
+
+		// read the next segments, oldest files first so they are completed and closed early
+		for (auto it = jobs.begin(); it != jobs.end() && !freeSlots.empty(); ++it)
+		{
+			Job &job = **it;
+			while (!job.failed && job.nextSegment < job.segmentCount && !freeSlots.empty())
+			{
+				Slot &slot = *freeSlots.back();
+				freeSlots.pop_back();
+
+				const uint64_t plainOffset = job.nextSegment * FileEncrypter::SEGMENT_SIZE;
+				slot.job = &job;
+				slot.segment = job.nextSegment++;
+				slot.request.file = job.in.get();
+				slot.request.offset = plainOffset;
+				slot.request.buffer = slot.buffer.data();
+				slot.request.length = static_cast<size_t>(std::min<uint64_t>(job.header.getPlaintextLength() - plainOffset, FileEncrypter::SEGMENT_SIZE));
+				slot.request.write = false;
+				slot.request.error.clear();
+				io->submit(&slot.request);
+				++job.inFlight;
+				++inFlight;
+			}
+		}
+
+		if (inFlight == 0) {
+			if (nextFile == files.size()) break;
+			continue;
+		}
+
+		// wait for one completion and take every other one that is ready, the reads among them are sealed together
+		for (AsyncIo::Request *request = io->wait(); request; request = io->poll())
+		{
+			Slot &slot = *static_cast<Slot*>(request->context);
+			Job &job = *slot.job;
+
+			if (!request->error.empty()) {
+				LOG->critical(request->error);
+				job.failed = true;
+			}
+			else if (!request->write && !job.failed) {
+				// the slot stays in flight until its segment is written
+				sealing.push_back(&slot);
+				continue;
+			}
+			else if (request->write) {
+				++job.writtenSegments;
+			}
+			release(slot);
+		}
+		if (sealing.empty()) continue;
+
+		// the requests still in flight keep the device busy while the workers seal
+		if (pool) pool->parallelFor(sealing.size(), seal);
+		else for (size_t i = 0; i < sealing.size(); ++i) seal(i);
+
+		// write every segment to its final offset
+		for (Slot *slot : sealing)
+		{
+			if (slot->job->failed) {
+				release(*slot);
+				continue;
+			}
+			AsyncIo::Request &request = slot->request;
+			request.file = slot->job->out.get();
+			request.offset = EncryptedFileHeader::LENGTH + slot->segment * sealedSegmentSize;
+			request.length += SegmentCipher::TAG_LENGTH;
+			request.write = true;
+			io->submit(&request);
+		}
+		sealing.clear();
+	}
+
+	return destinations;
+}
+
+void FileEncrypter::decipherFileParallel(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const filesystem::path &source, const filesystem::path &destination)
+{
+	const uint64_t plaintextLength = header.getPlaintextLength();
+	const uint32_t segmentSize = header.getSegmentSize();
+	const uint64_t segmentCount = SegmentCipher::segmentCount(plaintextLength, segmentSize);
+	const byte * const noncePrefix = header.getNoncePrefix();
+	const std::vector<byte> headerAad = header.getAuthenticatedData();
+
+	const uint64_t indexOffset = EncryptedFileHeader::LENGTH + plaintextLength + segmentCount * SegmentCipher::TAG_LENGTH;
+
+	fileUtils::RandomAccessFile in(source.string(), fileUtils::RandomAccessFile::READ);
+	// segments are verified out of order, so truncation and extension are checked up front, by the index
+	if (in.size() < indexOffset + SegmentIndex::FOOTER_LENGTH) {
+		throw GeneralSecurityException("File " + source.string() + " was truncated");
+	}
+	std::vector<SegmentIndex::Entry> entries;
+	{
+		SegmentCipher cipher(key, header.getSuite(), noncePrefix, headerAad);
+		std::vector<byte> index(static_cast<size_t>(in.size() - indexOffset));
+		in.readAt(indexOffset, index.data(), index.size());
+		entries = verifyIndex(cipher, header, index.data(), index.size(), indexOffset);
+	}
+
+	fileUtils::RandomAccessFile out(destination.string(), fileUtils::RandomAccessFile::WRITE);
+	out.resize(plaintextLength);
+
+	forEachSegmentBatch(segmentCount, [&](const uint64_t first, const uint64_t end) {
+		SegmentCipher cipher(key, header.getSuite(), noncePrefix, headerAad, (end - first) * segmentSize);
+		std::vector<byte> sealedSegment(segmentSize + SegmentCipher::TAG_LENGTH);
+		std::vector<byte> plainSegment(segmentSize);
+
+		for (uint64_t i = first; i < end; ++i)
+		{
+			const uint64_t plainOffset = i * segmentSize;
+			const size_t length = static_cast<size_t>(std::min<uint64_t>(plaintextLength - plainOffset, segmentSize));
+			in.readAt(EncryptedFileHeader::LENGTH + i * (segmentSize + SegmentCipher::TAG_LENGTH), sealedSegment.data(), length + SegmentCipher::TAG_LENGTH);
+			if (!cipher.openSegment(entries[static_cast<size_t>(i)].counter, i + 1 == segmentCount, sealedSegment.data(), length + SegmentCipher::TAG_LENGTH, plainSegment.data())) {
+				throw GeneralSecurityException("Segment " + std::to_string(i) + " of " + source.string() + " failed authentication");
+			}
+			out.writeAt(plainOffset, plainSegment.data(), length);
+		}
+	});
+}
+
+void FileEncrypter::cipherFileMapped(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const filesystem::path &source, const filesystem::path &destination)
+{
+	const uint64_t plaintextLength = header.getPlaintextLength();
+	const uint32_t segmentSize = header.getSegmentSize();
+	const uint64_t segmentCount = SegmentCipher::segmentCount(plaintextLength, segmentSize);
+	const byte * const noncePrefix = header.getNoncePrefix();
+	const std::vector<byte> headerAad = header.getAuthenticatedData();
+
+	byte headerBytes[EncryptedFileHeader::LENGTH];
+	header.write(headerBytes);
+
+	const fileUtils::MappedFile in(source.string());
+	if (in.size() != plaintextLength) {
+		throw IOException("File " + source.string() + " changed while it was encrypted");
+	}
+	const uint64_t indexOffset = EncryptedFileHeader::LENGTH + plaintextLength + segmentCount * SegmentCipher::TAG_LENGTH;
+	fileUtils::MappedFile out(destination.string(), indexOffset + SegmentIndex::sealedLength(segmentCount));
+	std::memcpy(out.data(), headerBytes, sizeof(headerBytes));
+
+	// segments are sealed straight from the input mapping into the output mapping
+	forEachSegmentBatch(segmentCount, [&](const uint64_t first, const uint64_t end) {
+		SegmentCipher cipher(key, header.getSuite(), noncePrefix, headerAad, (end - first) * segmentSize);
+		for (uint64_t i = first; i < end; ++i)
+		{
+			const uint64_t plainOffset = i * segmentSize;
+			const size_t length = static_cast<size_t>(std::min<uint64_t>(plaintextLength - plainOffset, segmentSize));
+			cipher.sealSegment(i, i + 1 == segmentCount, in.data() + plainOffset, length,
+				out.data() + EncryptedFileHeader::LENGTH + i * (segmentSize + SegmentCipher::TAG_LENGTH));
+		}
+	});
+
+	SegmentCipher cipher(key, header.getSuite(), noncePrefix, headerAad);
+	const std::vector<byte> index = SegmentIndex::seal(cipher, SegmentIndex::contiguous(EncryptedFileHeader::LENGTH, plaintextLength, segmentSize), indexOffset, plaintextLength);
+	std::memcpy(out.data() + indexOffset, index.data(), index.size());
+
+	out.flush();
+}
+
+void FileEncrypter::cipherFileDirect(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const filesystem::path &source, const filesystem::path &destination)
+{
+	const size_t alignment = fileUtils::AlignedBuffer::ALIGNMENT;
+	const uint64_t plaintextLength = header.getPlaintextLength();
+	const uint32_t segmentSize = header.getSegmentSize();
+	const uint64_t segmentCount = SegmentCipher::segmentCount(plaintextLength, segmentSize);
+	const byte * const noncePrefix = header.getNoncePrefix();
+	const std::vector<byte> headerAad = header.getAuthenticatedData();
+	const size_t sealedSegmentSize = segmentSize + SegmentCipher::TAG_LENGTH;
+
+	fileUtils::RandomAccessFile in(source.string(), fileUtils::RandomAccessFile::READ, true);
+	if (in.size() != plaintextLength) {
+		throw IOException("File " + source.string() + " changed while it was encrypted");
+	}
+	const uint64_t indexOffset = EncryptedFileHeader::LENGTH + plaintextLength + segmentCount * SegmentCipher::TAG_LENGTH;
+	const uint64_t totalLength = indexOffset + SegmentIndex::sealedLength(segmentCount);
+	fileUtils::RandomAccessFile out(destination.string(), fileUtils::RandomAccessFile::WRITE, true);
+	out.allocate(totalLength);
+
+	fileUtils::AlignedBufferPool::Lease input(directBuffers);
+	fileUtils::AlignedBufferPool::Lease output(directBuffers);
+	// output bytes are written in aligned blocks, the unaligned tail stays at the front of the buffer
+	uint64_t written = 0;
+	size_t pending = 0;
+	const auto flush = [&](const bool last) {
+		size_t length = pending & ~(alignment - 1);
+		if (last && length != pending) {
+			length += alignment;
+			std::memset(output.data() + pending, 0, length - pending);
+		}
+		if (length == 0) return;
+		out.writeAt(written, output.data(), length);
+		written += length;
+		pending = last ? 0 : pending - length;
+		std::memmove(output.data(), output.data() + length, pending);
+	};
+
+	header.write(output.data());
+	pending = EncryptedFileHeader::LENGTH;
+
+	// the tail of the previous chunk and a chunk of sealed segments fit the output buffer
+	const uint64_t chunkSegments = (output.size() - alignment) / sealedSegmentSize;
+	for (uint64_t chunkFirst = 0; chunkFirst < segmentCount; chunkFirst += chunkSegments)
+	{
+		const uint64_t chunkEnd = std::min<uint64_t>(chunkFirst + chunkSegments, segmentCount);
+		const uint64_t plainOffset = chunkFirst * segmentSize;
+		const size_t plainLength = static_cast<size_t>(std::min<uint64_t>(plaintextLength - plainOffset, (chunkEnd - chunkFirst) * segmentSize));
+		const size_t alignedLength = (plainLength + alignment - 1) & ~(alignment - 1);
+		if (in.readAvailableAt(plainOffset, input.data(), alignedLength) < plainLength) {
+			throw IOException("File " + source.string() + " changed while it was encrypted");
+		}
+
+		byte * const sealed = output.data() + pending;
+		forEachSegmentBatch(chunkEnd - chunkFirst, [&](const uint64_t first, const uint64_t end) {
+			SegmentCipher cipher(key, header.getSuite(), noncePrefix, headerAad, (end - first) * segmentSize);
+			for (uint64_t j = first; j < end; ++j)
+			{
+				const uint64_t i = chunkFirst + j;
+				const size_t length = static_cast<size_t>(std::min<uint64_t>(plaintextLength - i * segmentSize, segmentSize));
+				cipher.sealSegment(i, i + 1 == segmentCount, input.data() + j * segmentSize, length, sealed + j * sealedSegmentSize);
+			}
+		});
+		pending += plainLength + (chunkEnd - chunkFirst) * SegmentCipher::TAG_LENGTH;
+		flush(false);
+	}
+
+	SegmentCipher cipher(key, header.getSuite(), noncePrefix, headerAad);
+	const std::vector<byte> index = SegmentIndex::seal(cipher, SegmentIndex::contiguous(EncryptedFileHeader::LENGTH, plaintextLength, segmentSize), indexOffset, plaintextLength);
+	for (size_t copied = 0; copied < index.size();)
+	{
+		const size_t length = std::min<size_t>(index.size() - copied, output.size() - pending);
+		std::memcpy(output.data() + pending, index.data() + copied, length);
+		pending += length;
+		copied += length;
+		flush(false);
+	}
+	flush(true);
+
+	// drop the padding of the last block
+	out.resize(totalLength);
+}
+
+void FileEncrypter::decipherFileMapped(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const filesystem::path &source, const filesystem::path &destination)
+{
+	const uint64_t plaintextLength = header.getPlaintextLength();
+	const uint32_t segmentSize = header.getSegmentSize();
+	const uint64_t segmentCount = SegmentCipher::segmentCount(plaintextLength, segmentSize);
+	const byte * const noncePrefix = header.getNoncePrefix();
+	const std::vector<byte> headerAad = header.getAuthenticatedData();
+
+	const uint64_t indexOffset = EncryptedFileHeader::LENGTH + plaintextLength + segmentCount * SegmentCipher::TAG_LENGTH;
+
+	const fileUtils::MappedFile in(source.string());
+	if (in.size() < indexOffset + SegmentIndex::FOOTER_LENGTH) {
+		throw GeneralSecurityException("File " + source.string() + " was truncated");
+	}
+	std::vector<SegmentIndex::Entry> entries;
+	{
+		SegmentCipher cipher(key, header.getSuite(), noncePrefix, headerAad);
+		entries = verifyIndex(cipher, header, in.data() + indexOffset, static_cast<size_t>(in.size() - indexOffset), indexOffset);
+	}
+	fileUtils::MappedFile out(destination.string(), plaintextLength);
+
+	// segments are opened straight from the input mapping into the output mapping
+	forEachSegmentBatch(segmentCount, [&](const uint64_t first, const uint64_t end) {
+		SegmentCipher cipher(key, header.getSuite(), noncePrefix, headerAad, (end - first) * segmentSize);
+		for (uint64_t i = first; i < end; ++i)
+		{
+			const uint64_t plainOffset = i * segmentSize;
+			const size_t length = static_cast<size_t>(std::min<uint64_t>(plaintextLength - plainOffset, segmentSize));
+			if (!cipher.openSegment(entries[static_cast<size_t>(i)].counter, i + 1 == segmentCount, in.data() + EncryptedFileHeader::LENGTH + i * (segmentSize + SegmentCipher::TAG_LENGTH),
+				length + SegmentCipher::TAG_LENGTH, out.data() + plainOffset)) {
+				throw GeneralSecurityException("Segment " + std::to_string(i) + " of " + source.string() + " failed authentication");
+			}
+		}
+	});
+
+	out.flush();
+}
+
+std::vector<byte> FileEncrypter::decryptRange(const filesystem::path &file, const std::string &password, const uint64_t offset, const uint64_t length)
+{
+	KeyCache keyCache;
+	return decryptRange(file, password, offset, length, keyCache);
+}
+
+std::vector<byte> FileEncrypter::decryptRange(const filesystem::path &file, const std::string &password, const uint64_t offset, const uint64_t length, KeyCache &keyCache)
+{
+	std::vector<byte> range;
+	decryptRange(file, password, offset, length, keyCache, [&](const byte data[], const size_t size) {
+		range.insert(range.end(), data, data + size);
+	});
+	return range;
+}
+
+uint64_t FileEncrypter::decryptRange(const filesystem::path &file, const std::string &password, const uint64_t offset, const uint64_t length, KeyCache &keyCache, const std::function<void(const byte[], size_t)> &write)
+{
+	try
+	{
+		const EncryptedFileHeader header = FileEncrypter::readHeader(file);
+		const uint64_t headerLength = EncryptedFileHeader::LENGTH;
+
+		const uint64_t plaintextLength = header.getPlaintextLength();
+		const uint32_t segmentSize = header.getSegmentSize();
+		const uint64_t segmentCount = SegmentCipher::segmentCount(plaintextLength, segmentSize);
+
+		// locate the index through the footer
+		fileUtils::RandomAccessFile in(file.string(), fileUtils::RandomAccessFile::READ);
+		const uint64_t fileSize = in.size();
+		if (fileSize < headerLength + SegmentIndex::FOOTER_LENGTH) {
+			throw GeneralSecurityException("File " + file.string() + " is truncated");
+		}
+		byte footerBytes[SegmentIndex::FOOTER_LENGTH];
+		in.readAt(fileSize - SegmentIndex::FOOTER_LENGTH, footerBytes, sizeof(footerBytes));
+		const SegmentIndex::Footer footer = SegmentIndex::readFooter(footerBytes);
+		if (footer.segmentCount != segmentCount || footer.indexOffset < headerLength
+			|| footer.indexOffset + SegmentIndex::sealedLength(footer) != fileSize) {
+			throw GeneralSecurityException("Segment index of " + file.string() + " does not match its location");
+		}
+
+		if (length == 0) return 0;
+		if (offset >= plaintextLength) {
+			throw IOException("Offset " + std::to_string(offset) + " is past the end of " + file.string() + ", which holds " + std::to_string(plaintextLength) + " bytes");
+		}
+		const uint64_t end = offset + std::min(length, plaintextLength - offset);
+
+		const CryptoPP::SecByteBlock key = getFileKey(password, header, keyCache);
+		SegmentCipher cipher(key, header.getSuite(), header.getNoncePrefix(), header.getAuthenticatedData());
+
+		std::vector<byte> sealedSegment(segmentSize + SegmentCipher::TAG_LENGTH);
+		std::vector<byte> plainSegment(segmentSize);
+		std::vector<byte> compressedSegment((header.getFlags() & EncryptedFileHeader::FLAG_COMPRESSED) ? segmentSize : 0);
+		std::vector<SegmentIndex::Entry> page;
+		uint64_t loadedPage = UINT64_MAX;
+
+		// only the segments covering the range, and the index pages locating them, are read and verified
+		for (uint64_t i = offset / segmentSize; i * segmentSize < end; ++i)
+		{
+			const uint64_t pageNumber = i / footer.entriesPerPage;
+			if (pageNumber != loadedPage) {
+				std::vector<byte> sealedPage(SegmentIndex::sealedPageLength(footer, pageNumber));
+				in.readAt(SegmentIndex::pageOffset(footer, pageNumber), sealedPage.data(), sealedPage.size());
+				page = SegmentIndex::openPage(cipher, footer, plaintextLength, pageNumber, sealedPage.data());
+				loadedPage = pageNumber;
+			}
+
+			const SegmentIndex::Entry &entry = page[static_cast<size_t>(i % footer.entriesPerPage)];
+			const uint64_t segmentStart = i * segmentSize;
+			const bool sealedLengthValid = compressedSegment.empty() ? entry.sealedLength == entry.plainLength + SegmentCipher::TAG_LENGTH
+				: entry.sealedLength >= SegmentCipher::TAG_LENGTH && entry.sealedLength <= entry.plainLength + SegmentCipher::TAG_LENGTH;
+			if (entry.plainLength != std::min<uint64_t>(plaintextLength - segmentStart, segmentSize) || !sealedLengthValid
+				|| entry.offset < headerLength || entry.offset + entry.sealedLength > footer.indexOffset) {
+				throw GeneralSecurityException("Segment index entry " + std::to_string(i) + " of " + file.string() + " is invalid");
+			}
+
+			in.readAt(entry.offset, sealedSegment.data(), entry.sealedLength);
+			if (!openStoredSegment(cipher, entry, i + 1 == segmentCount, sealedSegment.data(), compressedSegment.data(), plainSegment.data())) {
+				throw GeneralSecurityException("Segment " + std::to_string(i) + " of " + file.string() + " failed authentication");
+			}
+
+			// copy the part of the segment that falls inside the range
+			const uint64_t from = std::max(offset, segmentStart);
+			const uint64_t to = std::min(end, segmentStart + entry.plainLength);
+			write(plainSegment.data() + (from - segmentStart), static_cast<size_t>(to - from));
+		}
+
+		return end - offset;
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		throw IOException(file.string() + " : " + e.what());
+	}
+}
+
+std::vector<filesystem::path> FileEncrypter::decryptRangeFiles(std::vector<filesystem::path> files, const std::string &password, const uint64_t offset, const uint64_t length)
+{
+	std::vector<char> decrypted(files.size(), 0);
+	KeyCache keyCache;
+
+	forEachFile(files.size(), [&](const size_t i) {
+		filesystem::path newFilePath;
+		try
+		{
+			// get new name for decrypted file
+			newFilePath = FileEncrypter::reserveDecryptionName(files[i]);
+			std::ofstream ofs(newFilePath.string(), std::ios::binary);
+			ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+			// written segment by segment, so the range is not held in memory at once
+			const uint64_t written = decryptRange(files[i], password, offset, length, keyCache, [&](const byte data[], const size_t size) {
+				ofs.write(reinterpret_cast<const char*>(data), size);
+			});
+			ofs.close();
+			LOG->info("{} bytes at offset {} of {} decrypted to {}", written, offset, files[i].string(), newFilePath.string());
+			decrypted[i] = 1;
+		}
+		catch (const GeneralSecurityException &ge) { LOG->critical(ge.what()); }
+		catch (const IOException &e) { LOG->warn(e.what()); }
+		catch (const std::ios_base::failure &e) { LOG->warn("{} : {}", newFilePath.string(), e.what()); }
+		catch (const filesystem::filesystem_error &e) { LOG->warn(e.what()); }
+
+		if (!decrypted[i] && !newFilePath.empty()) {
+			std::error_code ec;
+			filesystem::remove(newFilePath, ec);
+		}
+	});
+
+	LOG->info("Key cache : {} hits, {} misses", keyCache.getHits(), keyCache.getMisses());
+
+	std::vector<filesystem::path> successfullyDecrypted;
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (decrypted[i]) successfullyDecrypted.push_back(files[i]);
+	}
+
+	return successfullyDecrypted;
+}
+
+std::vector<filesystem::path> FileEncrypter::packFiles(const std::vector<filesystem::path> &files, const std::string &password, const filesystem::path &archive)
+{
+	std::vector<filesystem::path> packed;
+	if (filesystem::exists(archive)) {
+		LOG->critical("Not packing into {}, Cause : file already exists", archive.string());
+		return packed;
+	}
+
+	// one stat per file, the member table is complete before anything is written
+	std::vector<PackArchive::Member> members;
+	uint64_t dataLength = 0;
+	for (const auto &file : files)
+	{
+		std::error_code ec;
+		if (!filesystem::is_regular_file(file, ec)) {
+			LOG->warn("Skipping {}, Cause : file is not a valid file", file.string());
+			continue;
+		}
+		const uint64_t length = filesystem::file_size(file, ec);
+		const std::string name = PackArchive::memberName(file);
+		if (ec || name.empty() || name.size() > PackArchive::MAX_NAME_LENGTH) {
+			LOG->warn("Skipping {}, Cause : file size or name can not be stored", file.string());
+			continue;
+		}
+		members.push_back({ name, dataLength, length });
+		packed.push_back(file);
+		dataLength += length;
+	}
+	if (packed.empty()) {
+		LOG->warn("Nothing to pack into {}", archive.string());
+		return packed;
+	}
+
+	// the directory and the trailer locating it follow the member data
+	std::vector<byte> tail = PackArchive::encodeDirectory(members);
+	const uint64_t directoryLength = tail.size();
+	tail.resize(tail.size() + PackArchive::TRAILER_LENGTH);
+	endian::storeLE64(tail.data() + directoryLength, directoryLength);
+	const uint64_t plaintextLength = dataLength + tail.size();
+
+	// one salt, key and nonce prefix for the whole archive
+	byte salt[FileEncrypter::SALT_LENGTH];
+	FileEncrypter::generateRandomSalt(salt, FileEncrypter::SALT_LENGTH);
+	const CryptoPP::SecByteBlock key = getAesKey(password, reinterpret_cast<char*>(salt), FileEncrypter::KDF_ITERATION_COUNT);
+	byte noncePrefix[SegmentCipher::NONCE_PREFIX_LENGTH];
+	FileEncrypter::generateRandomIV(noncePrefix, SegmentCipher::NONCE_PREFIX_LENGTH);
+	EncryptedFileHeader header(salt, noncePrefix, FileEncrypter::KDF_ITERATION_COUNT, PackArchive::SEGMENT_SIZE, plaintextLength);
+	header.setSuite(suite);
+	header.setFlags(EncryptedFileHeader::FLAG_PACKED);
+	const CryptoPP::SecByteBlock dataKey = KeyWrap::generate(key, header);
+
+	try
+	{
+		std::ofstream ofs(archive.string(), std::ios::binary);
+		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+		EncryptedFile::writeHeader(ofs, header);
+
+		size_t member = 0;
+		uint64_t remaining = members[0].length;
+		size_t tailPosition = 0;
+		std::ifstream current;
+		current.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+
+		// segments span member boundaries, a file that shrank since it was listed fails the read
+		cipherStream(dataKey, header, [&](byte buffer[], size_t length) {
+			while (length > 0)
+			{
+				if (member == members.size()) {
+					std::memcpy(buffer, tail.data() + tailPosition, length);
+					tailPosition += length;
+					return;
+				}
+				if (remaining > 0) {
+					if (!current.is_open()) current.open(packed[member].string(), std::ios::binary);
+					const size_t n = static_cast<size_t>(std::min<uint64_t>(length, remaining));
+					current.read(reinterpret_cast<char*>(buffer), n);
+					buffer += n;
+					length -= n;
+					remaining -= n;
+					if (remaining > 0) return;
+					current.close();
+				}
+				if (++member < members.size()) remaining = members[member].length;
+			}
+		}, ofs);
+		ofs.close();
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		LOG->critical("Failed to pack {} : {}", archive.string(), e.what());
+		std::error_code ec;
+		filesystem::remove(archive, ec);
+		return std::vector<filesystem::path>();
+	}
+	catch (const IOException &e)
+	{
+		LOG->critical("Failed to pack {} : {}", archive.string(), e.what());
+		std::error_code ec;
+		filesystem::remove(archive, ec);
+		return std::vector<filesystem::path>();
+	}
+
+	LOG->info("{} files packed into {}", packed.size(), archive.string());
+	return packed;
+}
+
+std::vector<PackArchive::Member> FileEncrypter::listPack(const filesystem::path &archive, const std::string &password)
+{
+	KeyCache keyCache;
+	return listPack(archive, password, keyCache);
+}
+
+std::vector<PackArchive::Member> FileEncrypter::listPack(const filesystem::path &archive, const std::string &password, KeyCache &keyCache)
+{
+	const EncryptedFileHeader header = FileEncrypter::readHeader(archive);
+	if (!(header.getFlags() & EncryptedFileHeader::FLAG_PACKED)) {
+		throw IOException(archive.string() + " is not a packed archive");
+	}
+
+	const uint64_t plaintextLength = header.getPlaintextLength();
+	if (plaintextLength < PackArchive::TRAILER_LENGTH) {
+		throw GeneralSecurityException(archive.string() + " has no archive directory");
+	}
+
+	// the trailer locates the directory, both are read through the segment index
+	const std::vector<byte> trailer = decryptRange(archive, password, plaintextLength - PackArchive::TRAILER_LENGTH, PackArchive::TRAILER_LENGTH, keyCache);
+	const uint64_t directoryLength = endian::loadLE64(trailer.data());
+	if (directoryLength > plaintextLength - PackArchive::TRAILER_LENGTH) {
+		throw GeneralSecurityException("Archive directory of " + archive.string() + " is out of place");
+	}
+
+	const uint64_t dataLength = plaintextLength - PackArchive::TRAILER_LENGTH - directoryLength;
+	const std::vector<byte> directory = decryptRange(archive, password, dataLength, directoryLength, keyCache);
+	return PackArchive::decodeDirectory(directory.data(), directory.size(), dataLength);
+}
+
+void FileEncrypter::extractMember(const filesystem::path &archive, const std::string &password, const PackArchive::Member &member, const filesystem::path &destination, KeyCache &keyCache)
+{
+	try
+	{
+		std::ofstream ofs(destination.string(), std::ios::binary);
+		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+
+		// written segment by segment, so a large member is not held in memory at once
+		decryptRange(archive, password, member.offset, member.length, keyCache, [&](const byte data[], const size_t size) {
+			ofs.write(reinterpret_cast<const char*>(data), size);
+		});
+		ofs.close();
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		std::error_code ec;
+		filesystem::remove(destination, ec);
+		throw IOException(destination.string() + " : " + e.what());
+	}
+	catch (...)
+	{
+		std::error_code ec;
+		filesystem::remove(destination, ec);
+		throw;
+	}
+}
+
+std::vector<filesystem::path> FileEncrypter::unpackFiles(const filesystem::path &archive, const std::string &password, const std::vector<std::string> &names, const filesystem::path &outputDirectory)
+{
+	std::vector<filesystem::path> extracted;
+	KeyCache keyCache;
+
+	std::vector<PackArchive::Member> members;
+	try { members = listPack(archive, password, keyCache); }
+	catch (const GeneralSecurityException &ge) { LOG->critical(ge.what()); return extracted; }
+	catch (const IOException &e) { LOG->warn(e.what()); return extracted; }
+
+	// where a member goes, or an empty path if it is skipped
+	auto destinationOf = [&](const PackArchive::Member &member) {
+		if (!PackArchive::isSafeName(member.name)) {
+			LOG->critical("Skipping {}, Cause : member name leaves the output directory", member.name);
+			return filesystem::path();
+		}
+		const filesystem::path destination = outputDirectory / filesystem::path(member.name);
+		if (filesystem::exists(destination)) {
+			LOG->warn("Skipping {}, Cause : {} already exists", member.name, destination.string());
+			return filesystem::path();
+		}
+		filesystem::create_directories(destination.parent_path());
+		return destination;
+	};
+
+	if (!names.empty()) {
+		for (const auto &name : names)
+		{
+			const auto member = std::find_if(members.begin(), members.end(), [&](const PackArchive::Member &m) { return m.name == name; });
+			if (member == members.end()) {
+				LOG->warn("Skipping {}, Cause : not in {}", name, archive.string());
+				continue;
+			}
+
+			try
+			{
+				const filesystem::path destination = destinationOf(*member);
+				if (destination.empty()) continue;
+				extractMember(archive, password, *member, destination, keyCache);
+				LOG->info("{} extracted to {}", name, destination.string());
+				extracted.push_back(destination);
+			}
+			catch (const GeneralSecurityException &ge) { LOG->critical(ge.what()); }
+			catch (const IOException &e) { LOG->warn(e.what()); }
+			catch (const filesystem::filesystem_error &e) { LOG->warn(e.what()); }
+		}
+		return extracted;
+	}
+
+	// everything is wanted, so the archive is decrypted once from front to back and split at the member boundaries
+	std::vector<filesystem::path> created;
+	try
+	{
+		const EncryptedFileHeader header = FileEncrypter::readHeader(archive);
+		const CryptoPP::SecByteBlock key = getFileKey(password, header, keyCache);
+
+		std::ifstream ifs(archive.string(), std::ios::binary);
+		ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		ifs.seekg(EncryptedFileHeader::LENGTH);
+
+		size_t member = 0;
+		uint64_t remaining = members.empty() ? 0 : members[0].length;
+		bool started = false;
+		std::ofstream current;
+		current.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+
+		decipherStream(key, header, ifs, [&](const byte buffer[], size_t length) {
+			// the directory and the trailer after the last member are dropped
+			while (length > 0 && member < members.size())
+			{
+				if (!started) {
+					const filesystem::path destination = destinationOf(members[member]);
+					if (!destination.empty()) {
+						current.open(destination.string(), std::ios::binary);
+						created.push_back(destination);
+					}
+					started = true;
+				}
+
+				const size_t n = static_cast<size_t>(std::min<uint64_t>(length, remaining));
+				if (current.is_open()) current.write(reinterpret_cast<const char*>(buffer), n);
+				buffer += n;
+				length -= n;
+				remaining -= n;
+				if (remaining > 0) return;
+
+				if (current.is_open()) current.close();
+				started = false;
+				if (++member < members.size()) remaining = members[member].length;
+			}
+		});
+	}
+	catch (const std::exception &e)
+	{
+		// segments are authenticated one by one, but the archive as a whole only at its end
+		LOG->critical("Failed to extract {} : {}", archive.string(), e.what());
+		for (const auto &file : created)
+		{
+			std::error_code ec;
+			filesystem::remove(file, ec);
+		}
+		return extracted;
+	}
+
+	for (const auto &file : created) LOG->info("{} extracted from {}", file.string(), archive.string());
+	return created;
+}
+
+std::unique_ptr<DedupStore> FileEncrypter::openDedupStore(const filesystem::path &store, const std::string &password, const bool create, byte salt[], uint32_t &iterations)
+{
+	if (filesystem::exists(DedupStore::catalogPath(store))) {
+		DedupStore::readParameters(store, salt, iterations);
+		if (iterations == 0 || iterations > FileEncrypter::MAX_KDF_ITERATION_COUNT) throw IOException(store.string() + " has an invalid header");
+	}
+	else if (create) {
+		// chunk ids depend on the key, so the salt is chosen once and kept by the store
+		FileEncrypter::generateRandomSalt(salt, DedupStore::SALT_LENGTH);
+		iterations = FileEncrypter::KDF_ITERATION_COUNT;
+	}
+	else {
+		throw IOException(store.string() + " is not a dedup store");
+	}
+
+	std::unique_ptr<DedupStore> opened(new DedupStore(store));
+	const CryptoPP::SecByteBlock key = getAesKey(password, reinterpret_cast<char*>(salt), iterations);
+	opened->open(key);
+	return opened;
+}
+
+std::vector<filesystem::path> FileEncrypter::dedupFiles(const std::vector<filesystem::path> &files, const std::string &password, const filesystem::path &store)
+{
+	std::vector<filesystem::path> stored;
+	byte salt[DedupStore::SALT_LENGTH];
+	uint32_t iterations;
+	std::unique_ptr<DedupStore> dedup;
+	try { dedup = openDedupStore(store, password, true, salt, iterations); }
+	catch (const GeneralSecurityException &ge) { LOG->critical("Could not open {} : {}", store.string(), ge.what()); return stored; }
+	catch (const IOException &e) { LOG->critical("Could not open {} : {}", store.string(), e.what()); return stored; }
+
+	std::vector<char> added(files.size(), 0);
+	forEachFile(files.size(), [&](const size_t i) {
+		const filesystem::path &file = files[i];
+		std::error_code ec;
+		if (!filesystem::is_regular_file(file, ec)) {
+			LOG->warn("Skipping {}, Cause : file is not a valid file", file.string());
+			return;
+		}
+		const std::string name = PackArchive::memberName(file);
+		if (name.empty() || name.size() > DedupStore::MAX_NAME_LENGTH) {
+			LOG->warn("Skipping {}, Cause : file name can not be stored", file.string());
+			return;
+		}
+
+		try
+		{
+			Metrics::FileTimer fileTimer(file.string());
+			dedup->add(file, name);
+			added[i] = 1;
+			LOG->info("{} stored in {}", file.string(), store.string());
+		}
+		catch (const IOException &e) { LOG->warn(e.what()); }
+	});
+
+	// chunks without a catalog entry are only dead weight, the previous catalog stays valid
+	try { dedup->save(salt, iterations); }
+	catch (const IOException &e)
+	{
+		LOG->critical("Could not save the catalog of {} : {}", store.string(), e.what());
+		return stored;
+	}
+	LOG->info("{} new chunks ({} bytes) encrypted, {} chunks ({} bytes) already stored", dedup->getStoredChunks(), dedup->getStoredBytes(),
+		dedup->getReusedChunks(), dedup->getReusedBytes());
+
+	for (size_t i = 0; i < files.size(); ++i)
+	{
+		if (added[i]) stored.push_back(files[i]);
+	}
+	return stored;
+}
+
+std::vector<DedupStore::File> FileEncrypter::listDedup(const filesystem::path &store, const std::string &password)
+{
+	byte salt[DedupStore::SALT_LENGTH];
+	uint32_t iterations;
+	return openDedupStore(store, password, false, salt, iterations)->list();
+}
+
+std::vector<filesystem::path> FileEncrypter::restoreDedup(const filesystem::path &store, const std::string &password, const std::vector<std::string> &names, const filesystem::path &outputDirectory)
+{
+	std::vector<filesystem::path> restored;
+	byte salt[DedupStore::SALT_LENGTH];
+	uint32_t iterations;
+	std::unique_ptr<DedupStore> dedup;
+	try { dedup = openDedupStore(store, password, false, salt, iterations); }
+	catch (const GeneralSecurityException &ge) { LOG->critical("Could not open {} : {}", store.string(), ge.what()); return restored; }
+	catch (const IOException &e) { LOG->critical("Could not open {} : {}", store.string(), e.what()); return restored; }
+
+	std::vector<DedupStore::File> wanted = dedup->list();
+	if (!names.empty()) {
+		std::vector<DedupStore::File> named;
+		for (const auto &name : names)
+		{
+			const auto file = std::find_if(wanted.begin(), wanted.end(), [&](const DedupStore::File &f) { return f.name == name; });
+			if (file == wanted.end()) LOG->warn("Skipping {}, Cause : not in {}", name, store.string());
+			else named.push_back(*file);
+		}
+		wanted.swap(named);
+	}
+
+	std::vector<char> done(wanted.size(), 0);
+	forEachFile(wanted.size(), [&](const size_t i) {
+		const DedupStore::File &file = wanted[i];
+		if (!PackArchive::isSafeName(file.name)) {
+			LOG->critical("Skipping {}, Cause : file name leaves the output directory", file.name);
+			return;
+		}
+		const filesystem::path destination = outputDirectory / filesystem::path(file.name);
+
+		try
+		{
+			if (filesystem::exists(destination)) {
+				LOG->warn("Skipping {}, Cause : {} already exists", file.name, destination.string());
+				return;
+			}
+			filesystem::create_directories(destination.parent_path());
+			Metrics::FileTimer fileTimer(destination.string());
+			dedup->restore(file, destination);
+			LOG->info("{} restored to {}", file.name, destination.string());
+			done[i] = 1;
+		}
+		catch (const GeneralSecurityException &ge) { LOG->critical(ge.what()); }
+		catch (const IOException &e) { LOG->warn(e.what()); }
+		catch (const filesystem::filesystem_error &e) { LOG->warn(e.what()); }
+	});
+
+	for (size_t i = 0; i < wanted.size(); ++i)
+	{
+		if (done[i]) restored.push_back(outputDirectory / filesystem::path(wanted[i].name));
+	}
+	return restored;
+}
 
 /// <summary>
 /// Initializes a new instance of the <see cref="FileEncrypter"/> class.
 /// </summary>
 FileEncrypter::FileEncrypter()
+	:threadCount(1), ioBackend(fileUtils::IoBackend::STREAM), compression(false), inPlaceUpdates(false), suite(EncryptedFileHeader::SUITE_AES_256_GCM), unchangedFiles(0), updatedFiles(0),
+	directBuffers(FileEncrypter::DIRECT_BUFFER_SIZE)
 {
 	/*Empty*/
 }
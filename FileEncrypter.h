@@ -1,17 +1,48 @@
 #pragma once
 
 #include <string>
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <unordered_set>
 #include "secblock.h"
 #include "EncryptedFile.h"
 #include "Utils.h"
+#include "ThreadPool.h"
+#include "SegmentCipher.h"
+#include "SegmentIndex.h"
+#include "KeyCache.h"
+#include "PackArchive.h"
+#include "DirectoryWalker.h"
+#include "Manifest.h"
+#include "DedupStore.h"
+#include <atomic>
 
 namespace filesystem = std::experimental::filesystem::v1;
 
 class FileEncrypter
 {
+	// measures the private key derivation and decryption helpers
+	friend class Benchmark;
 
 private:
 
+	unsigned int threadCount;
+	fileUtils::IoBackend ioBackend;
+	bool compression;
+	bool inPlaceUpdates;
+	byte suite;
+	std::unique_ptr<ThreadPool> pool;
+	std::mutex nameMutex;
+	std::unordered_set<std::string> reservedNames;
+	filesystem::path manifestPath;
+	std::unique_ptr<Manifest> manifest;
+	std::atomic<size_t> unchangedFiles;
+	std::atomic<size_t> updatedFiles;
+	fileUtils::AlignedBufferPool directBuffers;
+
 	/// <summary>
 	/// Derive a key using HMAC-based Extract-and-Expand key derivation function by Krawczyk and Eronen.
 	/// </summary>
@@ -26,12 +57,35 @@ private:
 	/// </summary>
 	/// <param name="password">The password.</param>
 	/// <param name="salt">The salt.</param>
+	/// <param name="iterations">The iteration count.</param>
 	/// <returns>A key</returns>
-	CryptoPP::SecByteBlock getAesKey(const std::string &password, char salt[]);
+	CryptoPP::SecByteBlock getAesKey(const std::string &password, char salt[], const unsigned int iterations);
+
+
+	/// <summary>
+	/// Derive a key using PKCS5 PBKDF2 HMAC, unless the cache already holds the key for the salt and iteration count.
+	/// </summary>
+	/// <param name="password">The password.</param>
+	/// <param name="salt">The salt, <see cref="SALT_LENGTH"/> bytes.</param>
+	/// <param name="iterations">The iteration count.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	/// <returns>A key, valid as long as the cache</returns>
+	const CryptoPP::SecByteBlock & getCachedAesKey(const std::string &password, const byte salt[], const unsigned int iterations, KeyCache &keyCache);
+
+	/// <summary>
+	/// Gets the key the segments of a streamed file are sealed with: the data key unwrapped from the header, see
+	/// <see cref="KeyWrap"/>, or the derived key itself for files without one. The password key is derived once per salt,
+	/// see <see cref="getCachedAesKey"/>. Throws a <see cref="GeneralSecurityException"/> if the data key does not unwrap.
+	/// </summary>
+	/// <param name="password">The password.</param>
+	/// <param name="header">The header of the file.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	/// <returns>The key</returns>
+	CryptoPP::SecByteBlock getFileKey(const std::string &password, const EncryptedFileHeader &header, KeyCache &keyCache);
 
 
 	/// <summary>
-	/// Generates a random initialization vector
+	/// Generates a random initialization vector, see <see cref="RandomSource"/>.
 	/// </summary>
 	/// <param name="iv">Pointer to iv array.</param>
 	/// <param name="ivSize">Size of the iv.</param>
@@ -39,7 +93,7 @@ private:
 
 
 	/// <summary>
-	/// Generates a random salt
+	/// Generates a random salt, see <see cref="RandomSource"/>.
 	/// </summary>
 	/// <param name="salt">Pointer to the salt array.</param>
 	/// <param name="saltSize">Size of the salt.</param>
@@ -63,15 +117,453 @@ private:
 	/// <returns>A unique name</returns>
 	filesystem::path generateDecryptionName(filesystem::path encryptedFile);
 
-	std::vector<byte> decipherData(CryptoPP::SecByteBlock &key, const byte iv[], const std::vector<byte> &encryptedData);
-	std::vector<byte> cipherData(CryptoPP::SecByteBlock &key, const byte iv[], const byte data[], const size_t dataLength);
-	std::vector<byte> cipherData(CryptoPP::SecByteBlock &key, const byte iv[], const std::vector<byte> &data);
+	/// <summary>
+	/// Generates a new name for an encrypted file and creates it empty, so concurrent workers never pick the same name.
+	/// </summary>
+	/// <param name="originalFile">The original file.</param>
+	/// <returns>A new unique name</returns>
+	filesystem::path reserveEncryptionName(const filesystem::path &originalFile);
+
+	/// <summary>
+	/// Generates a new name for a decrypted file and creates it empty, so concurrent workers never pick the same name.
+	/// </summary>
+	/// <param name="encryptedFile">The encrypted file.</param>
+	/// <returns>A unique name</returns>
+	filesystem::path reserveDecryptionName(const filesystem::path &encryptedFile);
+
+	/// <summary>
+	/// Calls <paramref name="body"/> for every file index, on the worker pool if one is configured. Workers finish in
+	/// any order, so callers record results in one slot per index rather than appending them.
+	/// </summary>
+	/// <param name="count">Number of files.</param>
+	/// <param name="body">The body.</param>
+	void forEachFile(const size_t count, const std::function<void(size_t)> &body);
+
+	/// <summary>
+	/// Gets the next file of the walker that this run did not write itself. The walker may still be listing a directory
+	/// that outputs are written to, so the outputs reserved so far and the manifest are skipped.
+	/// </summary>
+	/// <param name="walker">The walker.</param>
+	/// <param name="file">Receives the file.</param>
+	/// <returns><c>false</c> once the walker has run dry</returns>
+	bool nextWalkedFile(DirectoryWalker &walker, filesystem::path &file);
+
+	/// <summary>
+	/// Calls <paramref name="body"/> for every file of the walker as soon as it is found, on the worker pool if one is configured.
+	/// Files written by this run are skipped, see <see cref="nextWalkedFile"/>.
+	/// </summary>
+	/// <param name="walker">The walker.</param>
+	/// <param name="body">The body.</param>
+	void forEachWalkedFile(DirectoryWalker &walker, const std::function<void(const filesystem::path&)> &body);
+
+	/// <summary>
+	/// Checks that a file exists, is a regular non-empty file, and logs why it is skipped otherwise.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <returns><c>true</c> if the file can be encrypted</returns>
+	bool isEncryptable(const filesystem::path &file);
+
+	/// <summary>
+	/// Samples the start of a file to decide whether its segments are worth compressing, see <see cref="Compression::isCompressible"/>.
+	/// </summary>
+	/// <param name="file">The plaintext file.</param>
+	/// <returns><c>true</c> if the file should be compressed</returns>
+	bool isCompressible(const filesystem::path &file);
+
+	/// <summary>
+	/// Loads the manifest of an incremental run, if one is configured, see <see cref="setManifest"/>.
+	/// </summary>
+	/// <param name="password">The password.</param>
+	/// <returns><c>false</c> if a manifest exists but can not be read or authenticated; the run must not go on</returns>
+	bool loadManifest(const std::string &password);
+
+	/// <summary>
+	/// Saves the manifest of an incremental run under a fresh salt, if anything changed.
+	/// </summary>
+	/// <param name="password">The password.</param>
+	/// <param name="always">Whether to save an existing manifest that did not change too, e.g. under a new password.</param>
+	void saveManifest(const std::string &password, const bool always = false);
+
+	/// <summary>
+	/// Compares a file with the manifest. A stat decides when the metadata matches, the content hash otherwise.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <param name="source">Receives the key of the file in the manifest, empty if the file can not be stat'ed.</param>
+	/// <param name="current">Receives the current state of the file, with its hashes unless the metadata matched.</param>
+	/// <param name="previous">Receives the recorded state of the file, with an empty destination if there is no encrypted copy.</param>
+	/// <returns><c>true</c> if the file is new or changed</returns>
+	bool needsEncryption(const filesystem::path &file, std::string &source, Manifest::Entry &current, Manifest::Entry &previous);
+
+	/// <summary>
+	/// Updates the encrypted copy of a changed file in place. Only the segments whose hash changed are read, sealed
+	/// under nonce counters the file never used before and written over the old ones; then the index is sealed again
+	/// and the header gets the new length. Throws an <see cref="IOException"/> or <see cref="GeneralSecurityException"/>
+	/// on failure, which can leave the encrypted copy damaged; it must be encrypted from scratch then.
+	/// </summary>
+	/// <param name="file">The changed file.</param>
+	/// <param name="previous">The recorded state of the file and of its encrypted copy.</param>
+	/// <param name="current">The current state of the file, with its hashes. Receives the counter state of the updated copy.</param>
+	/// <param name="password">The password the copy was encrypted with.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	/// <returns><c>false</c> if the copy can not be updated, e.g. it was written with another segment size</returns>
+	bool updateFile(const filesystem::path &file, const Manifest::Entry &previous, Manifest::Entry &current, const std::string &password, KeyCache &keyCache);
+
+	/// <summary>
+	/// Tries <see cref="updateFile"/> on a changed file that has an encrypted copy, if in-place updates are enabled
+	/// (see <see cref="setInPlaceUpdates"/>), and records the result.
+	/// </summary>
+	/// <param name="file">The changed file.</param>
+	/// <param name="source">The key of the file in the manifest.</param>
+	/// <param name="previous">The recorded state of the file.</param>
+	/// <param name="current">The current state of the file.</param>
+	/// <param name="password">The password.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	/// <returns>The updated copy, or an empty path if the file must be encrypted from scratch</returns>
+	filesystem::path updateChangedFile(const filesystem::path &file, const std::string &source, const Manifest::Entry &previous, Manifest::Entry &current, const std::string &password, KeyCache &keyCache);
+
+	/// <summary>
+	/// Records a fresh encryption in the manifest. An encrypted copy from an earlier run is replaced by the new one.
+	/// </summary>
+	/// <param name="source">The key of the source file in the manifest.</param>
+	/// <param name="current">The state of the source file that was encrypted.</param>
+	/// <param name="encrypted">The new encrypted file.</param>
+	/// <returns>Where the encrypted file ended up</returns>
+	filesystem::path recordEncryption(const std::string &source, Manifest::Entry &current, const filesystem::path &encrypted);
+
+	/// <summary>
+	/// Encrypts a single file, unless the manifest shows it did not change. A changed file is updated in place when it can be.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <param name="key">The key.</param>
+	/// <param name="salt">The salt the key was derived with.</param>
+	/// <param name="password">The password, for updating copies encrypted under another salt.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	/// <returns>The path of the encrypted file, or an empty path if the file was skipped</returns>
+	filesystem::path encryptChangedFile(const filesystem::path &file, const CryptoPP::SecByteBlock &key, const byte salt[], const std::string &password, KeyCache &keyCache);
+
+	/// <summary>
+	/// Encrypts the files of a batch that the manifest shows changed through <see cref="cipherFilesAsync"/>. Changed
+	/// files are updated in place first where they can be.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="salt">The salt the key was derived with.</param>
+	/// <param name="files">The plaintext files.</param>
+	/// <param name="password">The password, for updating copies encrypted under another salt.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	/// <returns>The path of each encrypted file, or an empty path if the file was skipped or failed</returns>
+	std::vector<filesystem::path> encryptBatchAsync(const CryptoPP::SecByteBlock &key, const byte salt[], const std::vector<filesystem::path> &files, const std::string &password, KeyCache &keyCache);
+
+	/// <summary>
+	/// Encrypts a single file. Failures are logged and the file is skipped.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <param name="key">The key.</param>
+	/// <param name="salt">The salt the key was derived with.</param>
+	/// <returns>The path of the encrypted file, or an empty path if the file was skipped or failed</returns>
+	filesystem::path encryptFile(const filesystem::path &file, const CryptoPP::SecByteBlock &key, const byte salt[]);
+
+	/// <summary>
+	/// Decrypts a single file.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <param name="password">The password.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	/// <returns>The path of the decrypted file, or an empty path if the file could not be decrypted</returns>
+	filesystem::path decryptFile(const filesystem::path &file, const std::string &password, KeyCache &keyCache);
+
+	/// <summary>
+	/// Rewraps the data key of a single file under a new key and rewrites its header in place. The segments are not
+	/// touched, and the header is a single write of <see cref="EncryptedFileHeader::LENGTH"/> bytes.
+	/// </summary>
+	/// <param name="file">The encrypted file.</param>
+	/// <param name="password">The current password.</param>
+	/// <param name="keyCache">The key cache of the run, for the current password.</param>
+	/// <param name="newKey">The key derived from the new password.</param>
+	/// <param name="newSalt">The salt <paramref name="newKey"/> was derived with.</param>
+	/// <returns><c>true</c> if the header was rewritten</returns>
+	bool rekeyFile(const filesystem::path &file, const std::string &password, KeyCache &keyCache, const CryptoPP::SecByteBlock &newKey, const byte newSalt[]);
+
+	/// <summary>
+	/// Authenticates a single file without writing its plaintext anywhere. Why a file fails is logged, with the
+	/// offset of the first bad segment or the length a truncated file is missing.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <param name="password">The password.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	/// <returns><c>true</c> if the file is intact and authentic</returns>
+	bool verifyFile(const filesystem::path &file, const std::string &password, KeyCache &keyCache);
+
+	/// <summary>
+	/// Decrypts a byte range of a streamed file, see the public overload.
+	/// </summary>
+	std::vector<byte> decryptRange(const filesystem::path &file, const std::string &password, const uint64_t offset, const uint64_t length, KeyCache &keyCache);
+
+	/// <summary>
+	/// Decrypts a byte range of a streamed file, see the public overload, with the plaintext going to a function one
+	/// segment at a time. The file is opened, and its key derived, once for the whole range.
+	/// </summary>
+	/// <param name="file">The encrypted file.</param>
+	/// <param name="password">The password.</param>
+	/// <param name="offset">Plaintext offset of the first byte.</param>
+	/// <param name="length">Number of bytes.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	/// <param name="write">Consumes authenticated plaintext of the range in order.</param>
+	/// <returns>The number of bytes decrypted, after clipping</returns>
+	uint64_t decryptRange(const filesystem::path &file, const std::string &password, const uint64_t offset, const uint64_t length, KeyCache &keyCache, const std::function<void(const byte[], size_t)> &write);
+
+	/// <summary>
+	/// Calls <paramref name="body"/> with ranges [first, end) of <see cref="SEGMENTS_PER_TASK"/> segments,
+	/// on the worker pool if one is configured, otherwise once with the whole range.
+	/// </summary>
+	/// <param name="segmentCount">Number of segments.</param>
+	/// <param name="body">The body.</param>
+	void forEachSegmentBatch(const uint64_t segmentCount, const std::function<void(uint64_t, uint64_t)> &body);
+
+	std::vector<byte> decipherData(const CryptoPP::SecByteBlock &key, const byte iv[], const std::vector<byte> &encryptedData);
+
+	/// <summary>
+	/// Decrypts data into a caller-provided buffer of <paramref name="encryptedLength"/> - <see cref="GCM_TAG_LENGTH"/> bytes.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="iv">The iv.</param>
+	/// <param name="encryptedData">The ciphertext followed by the tag.</param>
+	/// <param name="encryptedLength">Length of the ciphertext plus the tag.</param>
+	/// <param name="output">The output buffer.</param>
+	void decipherData(const CryptoPP::SecByteBlock &key, const byte iv[], const byte encryptedData[], const size_t encryptedLength, byte output[]);
+
+	/// <summary>
+	/// Encrypts a stream segment by segment. Reading, sealing and writing overlap, see <see cref="Pipeline"/>, and only
+	/// <see cref="Pipeline::DEPTH"/> segments are held in memory.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="header">The header, already written to <paramref name="out"/>.</param>
+	/// <param name="in">The plaintext stream, <see cref="EncryptedFileHeader::getPlaintextLength"/> bytes are read. A longer stream throws an <see cref="IOException"/>.</param>
+	/// <param name="out">The ciphertext stream.</param>
+	void cipherStream(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, std::istream &in, std::ostream &out);
+
+	/// <summary>
+	/// Encrypts a stream segment by segment, see the overload above, with the plaintext coming from a function.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="header">The header, already written to <paramref name="out"/>.</param>
+	/// <param name="read">Fills a buffer with the given number of plaintext bytes, on the reader thread of the <see cref="Pipeline"/>.</param>
+	/// <param name="out">The ciphertext stream.</param>
+	void cipherStream(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const std::function<void(byte[], size_t)> &read, std::ostream &out);
+
+	/// <summary>
+	/// Decrypts a stream segment by segment, with reading, verifying and writing overlapped. Throws a <see cref="GeneralSecurityException"/> if a segment
+	/// fails authentication, or if the stream was truncated or extended.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="header">The header read from <paramref name="in"/>.</param>
+	/// <param name="in">The ciphertext stream, positioned at the first segment.</param>
+	/// <param name="out">The plaintext stream.</param>
+	void decipherStream(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, std::istream &in, std::ostream &out);
+
+	/// <summary>
+	/// Decrypts a stream segment by segment, see the overload above, with the plaintext going to a function.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="header">The header read from <paramref name="in"/>.</param>
+	/// <param name="in">The ciphertext stream, positioned at the first segment.</param>
+	/// <param name="write">Consumes authenticated plaintext in order, on the writer thread of the <see cref="Pipeline"/>.</param>
+	void decipherStream(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, std::istream &in, const std::function<void(const byte[], size_t)> &write);
+
+	/// <summary>
+	/// Lists a packed archive, see the public overload.
+	/// </summary>
+	std::vector<PackArchive::Member> listPack(const filesystem::path &archive, const std::string &password, KeyCache &keyCache);
+
+	/// <summary>
+	/// Opens a dedup store. Throws an <see cref="IOException"/> if it can not be read, and a <see cref="GeneralSecurityException"/>
+	/// if its catalog is not authentic under the password.
+	/// </summary>
+	/// <param name="store">The store directory.</param>
+	/// <param name="password">The password.</param>
+	/// <param name="create">Whether a store that does not exist yet is created, under a fresh salt.</param>
+	/// <param name="salt">Receives the salt of the store, <see cref="DedupStore::SALT_LENGTH"/> bytes.</param>
+	/// <param name="iterations">Receives the KDF iteration count of the store.</param>
+	/// <returns>The opened store</returns>
+	std::unique_ptr<DedupStore> openDedupStore(const filesystem::path &store, const std::string &password, const bool create, byte salt[], uint32_t &iterations);
+
+	/// <summary>
+	/// Extracts one member of a packed archive through a single range decryption. Throws on failure, removing the partial file.
+	/// </summary>
+	/// <param name="archive">The archive.</param>
+	/// <param name="password">The password.</param>
+	/// <param name="member">The member.</param>
+	/// <param name="destination">The extracted file.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	void extractMember(const filesystem::path &archive, const std::string &password, const PackArchive::Member &member, const filesystem::path &destination, KeyCache &keyCache);
+
+	/// <summary>
+	/// Reads and validates the header of an encrypted file.
+	/// </summary>
+	/// <param name="source">The encrypted file.</param>
+	/// <returns>The header</returns>
+	EncryptedFileHeader readHeader(const filesystem::path &source);
+
+	/// <summary>
+	/// Decrypts the segment index of a streamed file and checks it describes the segments written before it.
+	/// Throws a <see cref="GeneralSecurityException"/> otherwise.
+	/// </summary>
+	/// <param name="cipher">The cipher of the file.</param>
+	/// <param name="header">The header of the file.</param>
+	/// <param name="index">The encrypted index followed by the footer.</param>
+	/// <param name="indexLength">Length of the encrypted index plus the footer.</param>
+	/// <param name="indexOffset">File offset of the index.</param>
+	/// <returns>One entry per segment, with the nonce counter to open it with</returns>
+	std::vector<SegmentIndex::Entry> verifyIndex(SegmentCipher &cipher, const EncryptedFileHeader &header, const byte index[], const size_t indexLength, const uint64_t indexOffset);
+
+	/// <summary>
+	/// Opens a segment located by its index entry, inflating it if it was stored compressed. Throws a
+	/// <see cref="GeneralSecurityException"/> if a compressed segment is malformed.
+	/// </summary>
+	/// <param name="cipher">The segment cipher of the file.</param>
+	/// <param name="entry">The index entry of the segment.</param>
+	/// <param name="last">Whether it is the last segment.</param>
+	/// <param name="sealed">The sealed segment, <see cref="SegmentIndex::Entry::sealedLength"/> bytes.</param>
+	/// <param name="scratch">Room for the compressed plaintext, at least the segment size.</param>
+	/// <param name="output">Receives <see cref="SegmentIndex::Entry::plainLength"/> bytes of plaintext.</param>
+	/// <returns><c>false</c> if the segment is not authentic</returns>
+	static bool openStoredSegment(SegmentCipher &cipher, const SegmentIndex::Entry &entry, const bool last, const byte sealed[], byte scratch[], byte output[]);
+
+	/// <summary>
+	/// Encrypts a file. A partially written destination is removed on failure.
+	/// </summary>
+	/// <param name="key">The key of the run, which wraps the random data key of the file.</param>
+	/// <param name="salt">The salt the key was derived with.</param>
+	/// <param name="source">The plaintext file.</param>
+	/// <param name="destination">The encrypted file.</param>
+	void cipherFileStreamed(const CryptoPP::SecByteBlock &key, const byte salt[], const filesystem::path &source, const filesystem::path &destination);
+
+	/// <summary>
+	/// Encrypts a file to a streamed file on the worker pool. The output is sized up front and every
+	/// segment is sealed independently and written to its final offset.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="header">The header of the encrypted file.</param>
+	/// <param name="source">The plaintext file.</param>
+	/// <param name="destination">The encrypted file.</param>
+	void cipherFileParallel(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const filesystem::path &source, const filesystem::path &destination);
+
+	/// <summary>
+	/// Encrypts many files through <see cref="AsyncIo"/>. Up to <see cref="ASYNC_OPEN_FILES"/> files are open at once and
+	/// <see cref="ASYNC_QUEUE_DEPTH"/> segment reads and writes are in flight across them. The segments whose reads have
+	/// completed are sealed in place together, on the worker pool if one is configured, while the other requests stay in
+	/// flight. The header and index of a file are written once all of its segments are.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="salt">The salt the key was derived with.</param>
+	/// <param name="files">The plaintext files.</param>
+	/// <returns>The path of each encrypted file, or an empty path if the file was skipped or failed</returns>
+	std::vector<filesystem::path> cipherFilesAsync(const CryptoPP::SecByteBlock &key, const byte salt[], const std::vector<filesystem::path> &files);
+
+	/// <summary>
+	/// Decrypts a streamed file on the worker pool. Segments are verified independently and written to their final offsets.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="header">The header of the encrypted file.</param>
+	/// <param name="source">The encrypted file.</param>
+	/// <param name="destination">The plaintext file.</param>
+	void decipherFileParallel(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const filesystem::path &source, const filesystem::path &destination);
+
+	/// <summary>
+	/// Encrypts a file to a streamed file through memory mappings. Segments are sealed straight from the
+	/// input mapping into the preallocated output mapping, on the worker pool if one is configured.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="header">The header of the encrypted file.</param>
+	/// <param name="source">The plaintext file.</param>
+	/// <param name="destination">The encrypted file.</param>
+	void cipherFileMapped(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const filesystem::path &source, const filesystem::path &destination);
+
+	/// <summary>
+	/// Encrypts a file to a streamed file with direct I/O. The output is preallocated, and chunks of segments are
+	/// read into and written from aligned buffers of <see cref="directBuffers"/>, so large files neither evict the
+	/// page cache nor get copied through it.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="header">The header of the encrypted file.</param>
+	/// <param name="source">The plaintext file.</param>
+	/// <param name="destination">The encrypted file.</param>
+	void cipherFileDirect(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const filesystem::path &source, const filesystem::path &destination);
+
+	/// <summary>
+	/// Decrypts a streamed file through memory mappings. Segments are opened straight from the
+	/// input mapping into the preallocated output mapping, on the worker pool if one is configured.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="header">The header of the encrypted file.</param>
+	/// <param name="source">The encrypted file.</param>
+	/// <param name="destination">The plaintext file.</param>
+	void decipherFileMapped(const CryptoPP::SecByteBlock &key, const EncryptedFileHeader &header, const filesystem::path &source, const filesystem::path &destination);
+
+	/// <summary>
+	/// Decrypts a file. A partially written destination is removed on failure.
+	/// </summary>
+	/// <param name="password">The password.</param>
+	/// <param name="keyCache">The key cache of the run.</param>
+	/// <param name="source">The encrypted file.</param>
+	/// <param name="destination">The plaintext file.</param>
+	void decipherFileStreamed(const std::string &password, KeyCache &keyCache, const filesystem::path &source, const filesystem::path &destination);
 
 public:
 	const static unsigned int IV_LENGTH = 32; //bytes
 	const static unsigned int SALT_LENGTH = 16; //bytes
 	const static unsigned int GCM_TAG_LENGTH = 16;//bytes
 	const static unsigned int KDF_ITERATION_COUNT = 10000;
+	const static unsigned int MAX_KDF_ITERATION_COUNT = 10000000;
+	const static unsigned int SEGMENT_SIZE = 1 << 20; //bytes
+	const static unsigned int MAX_SEGMENT_SIZE = 1 << 26; //bytes
+	const static unsigned int SEGMENTS_PER_TASK = 4;
+	const static unsigned int ASYNC_QUEUE_DEPTH = 32; // requests in flight
+	const static unsigned int ASYNC_OPEN_FILES = 64;
+	const static unsigned int ASYNC_BATCH_FILES = 1024;
+	const static unsigned int DIRECT_BUFFER_SIZE = 1 << 23; //bytes
+
+	/// <summary>
+	/// Sets the number of threads. Files are processed in parallel, and the segments of large files are
+	/// spread over the threads as well. The key derived for a run is shared read-only by all workers.
+	/// </summary>
+	/// <param name="threadCount">Number of threads. 0 means one per hardware thread.</param>
+	void setThreadCount(const unsigned int threadCount);
+
+	/// <summary>
+	/// Sets how file contents are read and written.
+	/// </summary>
+	/// <param name="backend">The I/O backend.</param>
+	void setIoBackend(const fileUtils::IoBackend backend) { this->ioBackend = backend; }
+
+	/// <summary>
+	/// Deflates the segments of files before they are encrypted. Files whose first bytes look compressed already are
+	/// encrypted as they are, and so is every segment that does not shrink. Compressed files are written and read by
+	/// the streaming path, whatever the I/O backend.
+	/// </summary>
+	/// <param name="compression">Whether to compress.</param>
+	void setCompression(const bool compression) { this->compression = compression; }
+
+	/// <summary>
+	/// Sets the cipher suite new files are encrypted with. Files are decrypted with the suite their header names.
+	/// </summary>
+	/// <param name="suite">The suite, see <see cref="CipherSuite"/>.</param>
+	void setSuite(const byte suite) { this->suite = suite; }
+
+	/// <summary>
+	/// Makes encryption incremental. The manifest records every encrypted file; files whose size, modification time and
+	/// inode, or else contents, still match are skipped, and a changed file is encrypted again into a new copy that is
+	/// renamed over the earlier one. The manifest is created by the first run and encrypted under the password of the run.
+	/// </summary>
+	/// <param name="manifest">The manifest file, empty to encrypt everything.</param>
+	void setManifest(const filesystem::path &manifest) { this->manifestPath = manifest; }
+
+	/// <summary>
+	/// Lets incremental runs re-encrypt only the changed segments of a changed file, in its earlier encrypted copy,
+	/// see <see cref="updateFile"/>. Much less is written, but there is no journal: an update that is interrupted leaves
+	/// the only encrypted copy damaged. Off by default.
+	/// </summary>
+	/// <param name="inPlaceUpdates">Whether to update copies in place.</param>
+	void setInPlaceUpdates(const bool inPlaceUpdates) { this->inPlaceUpdates = inPlaceUpdates; }
 
 	/// <summary>
 	/// Encrypts one or many files. The vector can contain one, or many files. The files can be files, or folders.
@@ -96,6 +588,17 @@ public:
 	/// </returns>
 	std::vector<filesystem::path> encryptFiles(char **files, const size_t num_files, const std::string &password);
 
+	/// <summary>
+	/// Encrypts the files of a directory walker while it is still listing, so the first file is encrypted right
+	/// away however large the tree is. Successfully encrypted files are counted rather than collected.
+	/// </summary>
+	/// <param name="walker">The walker.</param>
+	/// <param name="password">The password.</param>
+	/// <returns>
+	/// The number of files that were successfully encrypted
+	/// </returns>
+	size_t encryptFiles(DirectoryWalker &walker, const std::string &password);
+
 	/// <summary>
 	/// Decrypts one or many files. The vector can contain one, or many files. The files can be files, or folders.
 	/// If its a folder, every file in the folder, including all sub folders will be decrypted.
@@ -119,6 +622,159 @@ public:
 	/// </returns>
 	std::vector<filesystem::path> decryptFiles(char **files, const size_t num_files, const std::string &password);
 
+	/// <summary>
+	/// Decrypts the files of a directory walker while it is still listing. Successfully decrypted files are counted rather than collected.
+	/// </summary>
+	/// <param name="walker">The walker.</param>
+	/// <param name="password">The password.</param>
+	/// <returns>
+	/// The number of files that were successfully decrypted
+	/// </returns>
+	size_t decryptFiles(DirectoryWalker &walker, const std::string &password);
+
+	/// <summary>
+	/// Checks that encrypted files are intact by authenticating every segment and the segment index, in parallel
+	/// across files, without writing any plaintext. Legacy files are authenticated in memory.
+	/// </summary>
+	/// <param name="files">The files.</param>
+	/// <param name="password">The password.</param>
+	/// <returns>
+	/// A vector of the files that failed verification
+	/// </returns>
+	std::vector<filesystem::path> verifyFiles(const std::vector<filesystem::path> &files, const std::string &password);
+
+	/// <summary>
+	/// Verifies the files of a directory walker while it is still listing, see <see cref="verifyFiles"/>.
+	/// </summary>
+	/// <param name="walker">The walker.</param>
+	/// <param name="password">The password.</param>
+	/// <returns>
+	/// The number of files that failed verification
+	/// </returns>
+	size_t verifyFiles(DirectoryWalker &walker, const std::string &password);
+
+	/// <summary>
+	/// Changes the password of encrypted files without re-encrypting them. The new password goes through the key
+	/// derivation function once, and the data key of every file is rewrapped under it in parallel across files, so
+	/// only the header of each file is rewritten. Files encrypted before data keys were wrapped, and legacy files,
+	/// have to be decrypted and encrypted again. The manifest, if one is configured, is saved under the new password.
+	/// </summary>
+	/// <param name="files">The encrypted files.</param>
+	/// <param name="password">The current password.</param>
+	/// <param name="newPassword">The new password.</param>
+	/// <returns>
+	/// A vector of the files that were rekeyed
+	/// </returns>
+	std::vector<filesystem::path> rekeyFiles(const std::vector<filesystem::path> &files, const std::string &password, const std::string &newPassword);
+
+	/// <summary>
+	/// Rekeys the files of a directory walker while it is still listing, see <see cref="rekeyFiles"/>.
+	/// </summary>
+	/// <param name="walker">The walker.</param>
+	/// <param name="password">The current password.</param>
+	/// <param name="newPassword">The new password.</param>
+	/// <returns>
+	/// The number of files that were rekeyed
+	/// </returns>
+	size_t rekeyFiles(DirectoryWalker &walker, const std::string &password, const std::string &newPassword);
+
+	/// <summary>
+	/// Decrypts a byte range of a streamed file. Only the index pages and segments covering the range are read
+	/// and authenticated, so the cost is proportional to the range rather than the file. The range is clipped
+	/// to the end of the plaintext; an <see cref="IOException"/> is thrown if a non-empty range starts at or past it.
+	/// </summary>
+	/// <param name="file">The encrypted file.</param>
+	/// <param name="password">The password.</param>
+	/// <param name="offset">Plaintext offset of the first byte.</param>
+	/// <param name="length">Number of bytes.</param>
+	/// <returns>
+	/// The decrypted bytes
+	/// </returns>
+	std::vector<byte> decryptRange(const filesystem::path &file, const std::string &password, const uint64_t offset, const uint64_t length);
+
+	/// <summary>
+	/// Decrypts the same byte range of one or many streamed files. Each range is written to the name the
+	/// whole file would have been decrypted to.
+	/// </summary>
+	/// <param name="files">A vector of <see cref="std::experimental::filesystem::v1::path"/></param>
+	/// <param name="password">The password.</param>
+	/// <param name="offset">Plaintext offset of the first byte.</param>
+	/// <param name="length">Number of bytes.</param>
+	/// <returns>
+	/// A vector of the files whose range was successfully decrypted
+	/// </returns>
+	std::vector<filesystem::path> decryptRangeFiles(std::vector<filesystem::path> files, const std::string &password, const uint64_t offset, const uint64_t length);
+
+	/// <summary>
+	/// Encrypts many files into a single packed archive, see <see cref="PackArchive"/>. The files are streamed into
+	/// one output file under one key derivation and one nonce prefix, so the output side costs a constant number of
+	/// file system operations however many files there are. A partially written archive is removed on failure.
+	/// </summary>
+	/// <param name="files">A vector of <see cref="std::experimental::filesystem::v1::path"/>, regular files only.</param>
+	/// <param name="password">The password.</param>
+	/// <param name="archive">The archive to create.</param>
+	/// <returns>
+	/// A vector of the files that were packed, empty if the archive could not be written
+	/// </returns>
+	std::vector<filesystem::path> packFiles(const std::vector<filesystem::path> &files, const std::string &password, const filesystem::path &archive);
+
+	/// <summary>
+	/// Lists the members of a packed archive. Only the segments holding the directory are read and decrypted.
+	/// Throws an <see cref="IOException"/> if the file is not a packed archive, and a <see cref="GeneralSecurityException"/>
+	/// if the directory is not authentic.
+	/// </summary>
+	/// <param name="archive">The archive.</param>
+	/// <param name="password">The password.</param>
+	/// <returns>The members, in archive order</returns>
+	std::vector<PackArchive::Member> listPack(const filesystem::path &archive, const std::string &password);
+
+	/// <summary>
+	/// Extracts members of a packed archive below a directory. Named members are extracted on their own, through range
+	/// decryption; without names the whole archive is decrypted in a single pass. Existing files are not overwritten.
+	/// </summary>
+	/// <param name="archive">The archive.</param>
+	/// <param name="password">The password.</param>
+	/// <param name="names">Names of the members to extract, all members if empty.</param>
+	/// <param name="outputDirectory">The directory to extract to.</param>
+	/// <returns>
+	/// A vector of the files that were successfully extracted
+	/// </returns>
+	std::vector<filesystem::path> unpackFiles(const filesystem::path &archive, const std::string &password, const std::vector<std::string> &names, const filesystem::path &outputDirectory);
+
+	/// <summary>
+	/// Stores files in a dedup store, see <see cref="DedupStore"/>, creating the store if it does not exist. Only
+	/// chunks the store does not hold yet are encrypted and written, so storage and encryption work follow the
+	/// amount of new data. A file stored under the same name before is replaced.
+	/// </summary>
+	/// <param name="files">A vector of <see cref="std::experimental::filesystem::v1::path"/>, regular files only.</param>
+	/// <param name="password">The password. Must be the one the store was created with.</param>
+	/// <param name="store">The store directory.</param>
+	/// <returns>
+	/// A vector of the files that were stored
+	/// </returns>
+	std::vector<filesystem::path> dedupFiles(const std::vector<filesystem::path> &files, const std::string &password, const filesystem::path &store);
+
+	/// <summary>
+	/// Lists the files of a dedup store. Throws an <see cref="IOException"/> if the directory is not a store, and a
+	/// <see cref="GeneralSecurityException"/> if its catalog is not authentic.
+	/// </summary>
+	/// <param name="store">The store directory.</param>
+	/// <param name="password">The password.</param>
+	/// <returns>The files, by name</returns>
+	std::vector<DedupStore::File> listDedup(const filesystem::path &store, const std::string &password);
+
+	/// <summary>
+	/// Restores files of a dedup store below a directory. Existing files are not overwritten.
+	/// </summary>
+	/// <param name="store">The store directory.</param>
+	/// <param name="password">The password.</param>
+	/// <param name="names">Names of the files to restore, all files if empty.</param>
+	/// <param name="outputDirectory">The directory to restore to.</param>
+	/// <returns>
+	/// A vector of the files that were successfully restored
+	/// </returns>
+	std::vector<filesystem::path> restoreDedup(const filesystem::path &store, const std::string &password, const std::vector<std::string> &names, const filesystem::path &outputDirectory);
+
 
 	FileEncrypter();
 	~FileEncrypter();
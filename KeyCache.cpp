@@ -0,0 +1,32 @@
+#include "KeyCache.h"
+
+
+const CryptoPP::SecByteBlock & KeyCache::get(const byte salt[], const size_t saltLength, const std::function<CryptoPP::SecByteBlock()> &derive)
+{
+	std::shared_ptr<Entry> entry;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::shared_ptr<Entry> &slot = keys[std::string(reinterpret_cast<const char*>(salt), saltLength)];
+		if (!slot) slot = std::make_shared<Entry>();
+		entry = slot;
+	}
+
+	// derive outside the lock, so other salts are not held up. Waiters for the same salt block here.
+	bool derivedHere = false;
+	std::call_once(entry->derived, [&]() {
+		entry->key = derive();
+		derivedHere = true;
+	});
+
+	if (derivedHere) ++misses;
+	else ++hits;
+
+	return entry->key;
+}
+
+void KeyCache::clear()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	// SecByteBlock wipes its storage when the last entry reference goes away
+	keys.clear();
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <functional>
+#include <cstdint>
+#include "secblock.h"
+
+typedef unsigned char byte;
+
+/// <summary>
+/// Caches derived keys by salt, so every distinct salt goes through the key derivation function once.
+/// A cache belongs to one run with one password. The keys are held in <see cref="CryptoPP::SecByteBlock"/>
+/// storage, which is wiped when the cache is destroyed. Safe to share between threads: concurrent
+/// requests for the same salt wait for a single derivation.
+/// </summary>
+class KeyCache
+{
+
+private:
+	struct Entry {
+		std::once_flag derived;
+		CryptoPP::SecByteBlock key;
+	};
+
+	std::map<std::string, std::shared_ptr<Entry>> keys;
+	std::mutex mutex;
+	std::atomic<uint64_t> hits;
+	std::atomic<uint64_t> misses;
+
+public:
+
+	/// <summary>
+	/// Initializes a new instance of the <see cref="KeyCache"/> class.
+	/// </summary>
+	KeyCache() :hits(0), misses(0) {}
+
+	/// <summary>
+	/// Finalizes an instance of the <see cref="KeyCache"/> class. All keys are wiped.
+	/// </summary>
+	~KeyCache() { clear(); }
+
+	KeyCache(const KeyCache&) = delete;
+	KeyCache& operator=(const KeyCache&) = delete;
+
+	/// <summary>
+	/// Gets the key for a salt, deriving it on the first request.
+	/// </summary>
+	/// <param name="salt">The salt.</param>
+	/// <param name="saltLength">Length of the salt.</param>
+	/// <param name="derive">Derives the key for <paramref name="salt"/>.</param>
+	/// <returns>The key, valid until the cache is cleared or destroyed</returns>
+	const CryptoPP::SecByteBlock & get(const byte salt[], const size_t saltLength, const std::function<CryptoPP::SecByteBlock()> &derive);
+
+	/// <summary>
+	/// Wipes and removes all keys.
+	/// </summary>
+	void clear();
+
+	/// <summary>
+	/// Gets the number of requests served from the cache.
+	/// </summary>
+	/// <returns></returns>
+	uint64_t getHits() const { return hits; }
+	/// <summary>
+	/// Gets the number of requests that derived a key.
+	/// </summary>
+	/// <returns></returns>
+	uint64_t getMisses() const { return misses; }
+
+};
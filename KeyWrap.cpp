@@ -0,0 +1,46 @@
+#include "KeyWrap.h"
+#include "CipherSuite.h"
+#include "RandomSource.h"
+#include "GeneralSecurityException.h"
+
+static_assert(KeyWrap::DATA_KEY_LENGTH + 16 == EncryptedFileHeader::WRAPPED_KEY_LENGTH, "wrapped key does not fit the header");
+static_assert(EncryptedFileHeader::WRAP_NONCE_LENGTH == 12, "key wrap nonce must be a GCM nonce");
+
+
+CryptoPP::SecByteBlock KeyWrap::generate(const CryptoPP::SecByteBlock &kek, EncryptedFileHeader &header)
+{
+	CryptoPP::SecByteBlock dataKey(KeyWrap::DATA_KEY_LENGTH);
+	RandomSource::generate(dataKey, dataKey.size());
+
+	// the flag is authenticated too, so it is set before wrapping
+	header.setFlags(header.getFlags() | EncryptedFileHeader::FLAG_WRAPPED_KEY);
+	KeyWrap::wrap(kek, dataKey, header);
+	return dataKey;
+}
+
+void KeyWrap::wrap(const CryptoPP::SecByteBlock &kek, const CryptoPP::SecByteBlock &dataKey, EncryptedFileHeader &header)
+{
+	// random nonces, one key-encryption key wraps the keys of a single run
+	byte nonce[EncryptedFileHeader::WRAP_NONCE_LENGTH];
+	RandomSource::generate(nonce, sizeof(nonce));
+
+	const std::vector<byte> aad = header.getAuthenticatedData();
+	byte wrapped[EncryptedFileHeader::WRAPPED_KEY_LENGTH];
+	CipherSuite::threadEngine(EncryptedFileHeader::SUITE_AES_256_GCM, kek)->seal(nonce, aad.data(), aad.size(), dataKey, dataKey.size(), wrapped);
+	header.setWrappedKey(nonce, wrapped);
+}
+
+CryptoPP::SecByteBlock KeyWrap::unwrap(const CryptoPP::SecByteBlock &kek, const EncryptedFileHeader &header)
+{
+	if (!(header.getFlags() & EncryptedFileHeader::FLAG_WRAPPED_KEY)) {
+		throw GeneralSecurityException("File has no wrapped data key");
+	}
+
+	const std::vector<byte> aad = header.getAuthenticatedData();
+	CryptoPP::SecByteBlock dataKey(KeyWrap::DATA_KEY_LENGTH);
+	if (!CipherSuite::threadEngine(EncryptedFileHeader::SUITE_AES_256_GCM, kek)->open(header.getWrapNonce(), aad.data(), aad.size(),
+		header.getWrappedKey(), KeyWrap::DATA_KEY_LENGTH, dataKey)) {
+		throw GeneralSecurityException("Data key failed authentication, wrong password or tampered header");
+	}
+	return dataKey;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "secblock.h"
+#include "EncryptedFile.h"
+
+typedef unsigned char byte;
+
+/// <summary>
+/// The two-level key hierarchy of streamed files. The password goes through the key derivation function once per
+/// run and gives a key-encryption key; every file is sealed with its own random data key, which is stored in the
+/// header sealed under the key-encryption key with AES-256-GCM. Changing the password rewraps the data key and
+/// rewrites the header, the segments stay as they are. The wrapped key is bound to the authenticated header fields,
+/// so it can not be moved to another file.
+/// </summary>
+class KeyWrap
+{
+
+public:
+	const static unsigned int DATA_KEY_LENGTH = 32; //bytes
+
+	/// <summary>
+	/// Creates a random data key for a new file, wraps it into the header and sets <see cref="EncryptedFileHeader::FLAG_WRAPPED_KEY"/>.
+	/// The suite and the other flags of the header must be final, they are authenticated with the wrapped key.
+	/// </summary>
+	/// <param name="kek">The key-encryption key.</param>
+	/// <param name="header">The header of the new file.</param>
+	/// <returns>The data key</returns>
+	static CryptoPP::SecByteBlock generate(const CryptoPP::SecByteBlock &kek, EncryptedFileHeader &header);
+
+	/// <summary>
+	/// Wraps a data key into a header under a fresh nonce.
+	/// </summary>
+	/// <param name="kek">The key-encryption key.</param>
+	/// <param name="dataKey">The data key.</param>
+	/// <param name="header">The header.</param>
+	static void wrap(const CryptoPP::SecByteBlock &kek, const CryptoPP::SecByteBlock &dataKey, EncryptedFileHeader &header);
+
+	/// <summary>
+	/// Unwraps the data key of a header. Throws a <see cref="GeneralSecurityException"/> if the key-encryption key
+	/// is wrong or the header was tampered with.
+	/// </summary>
+	/// <param name="kek">The key-encryption key.</param>
+	/// <param name="header">The header.</param>
+	/// <returns>The data key</returns>
+	static CryptoPP::SecByteBlock unwrap(const CryptoPP::SecByteBlock &kek, const EncryptedFileHeader &header);
+
+};
@@ -1,6 +1,12 @@
 #include "tclap\CmdLine.h"
 #include "spdlog\spdlog.h"
 #include "FileEncrypter.h"
+#include "IOException.h"
+#include "GeneralSecurityException.h"
+#include "Metrics.h"
+#include "CipherSuite.h"
+#include <chrono>
+#include <stdexcept>
 
 
 
@@ -15,13 +21,47 @@ int main(int argc, char* argv[])
 		TCLAP::SwitchArg mod("u", "unlock", "decrypt files", false);
 		TCLAP::SwitchArg dir("d", "directory", "process files in a directory", false);
 		TCLAP::SwitchArg rec("r", "recursive", "look for files recursively. Must be used in combination with -d. If -d is not specified, the argument is ignored", false);
-		TCLAP::ValueArg<std::string> pass("p", "password", "password used for processing", true, "Password", "string");
-		TCLAP::UnlabeledMultiArg<std::string> fileArgs("files", "files/folders you want to process", true, "string");
+		TCLAP::SwitchArg info("i", "info", "print the header of encrypted files without decrypting them", false);
+		TCLAP::ValueArg<unsigned int> jobs("j", "jobs", "number of worker threads. Files, and the segments of large files, are processed in parallel. 0 uses one thread per core", false, 1, "unsigned int");
+		TCLAP::ValueArg<std::string> io("", "io", "I/O backend: stream (default), mmap, async (io_uring when available, encryption only) or direct (page cache bypass, encryption only)", false, "stream", "stream|mmap|async|direct");
+		TCLAP::ValueArg<std::string> suite("", "suite", "cipher suite of new files: aes-256-gcm (default), chacha20-poly1305, or auto to pick the fastest for this CPU", false, "aes-256-gcm", "aes-256-gcm|chacha20-poly1305|auto");
+		TCLAP::ValueArg<std::string> gcmTables("", "gcm-tables", "GHASH table size of AES-GCM: auto (default, 64K tables for bulk data on CPUs without carry-less multiply), small (2K) or large (64K)", false, "auto", "auto|small|large");
+		TCLAP::SwitchArg capabilities("", "capabilities", "report the crypto instructions of the CPU and the measured throughput of every cipher suite at startup", false);
+		TCLAP::SwitchArg verify("", "verify", "check that encrypted files are intact and authentic, in parallel, without writing any plaintext. Fails if any file does not verify", false);
+		TCLAP::SwitchArg compress("", "compress", "deflate files before encrypting them, unless they look compressed already. Decryption detects compressed files by itself", false);
+		TCLAP::ValueArg<std::string> range("", "range", "decrypt only the given byte range of streamed files. Must be used in combination with -u", false, "", "offset:length");
+		TCLAP::ValueArg<std::string> metrics("", "metrics", "write per-stage timings, byte counts, latency histograms and the slowest files of the run as JSON", false, "", "out.json");
+		TCLAP::ValueArg<std::string> pack("", "pack", "encrypt the files into a single packed archive. With -u, extract the archive into the directory given as file argument", false, "", "archive.gcmpack");
+		TCLAP::ValueArg<std::string> dedup("", "dedup", "store the files in a deduplicating store, encrypting only chunks it does not hold yet. The store is created if it does not exist. With -u, restore the store into the directory given as file argument", false, "", "store directory");
+		TCLAP::SwitchArg list("", "list", "list the members of the archive given with --pack, or the files of the store given with --dedup", false);
+		TCLAP::MultiArg<std::string> member("", "member", "extract only the named member of the archive given with --pack, or the named file of the store given with --dedup. Can be repeated", false, "name");
+		TCLAP::ValueArg<std::string> manifest("", "manifest", "encrypt incrementally: only files that are new or changed since the run that wrote the manifest are encrypted. The manifest is created if it does not exist", false, "", "manifest.gcmman");
+		TCLAP::SwitchArg inPlace("", "in-place", "with --manifest, re-encrypt only the changed segments of a changed file, in its existing encrypted copy. Writes far less, but an interrupted update leaves that copy unrecoverable", false);
+		TCLAP::ValueArg<std::string> pass("p", "password", "password used for processing. Required unless -i is specified", false, "", "string");
+		TCLAP::ValueArg<std::string> newPass("", "new-password", "change the password of encrypted files to the given one. Only the headers are rewritten, the data stays as it is. The manifest given with --manifest is saved under the new password", false, "", "string");
+		TCLAP::UnlabeledMultiArg<std::string> fileArgs("files", "files/folders you want to process", false, "string");
 
 		cmd.add(pass);
+		cmd.add(newPass);
 		cmd.add(mod);
 		cmd.add(rec);
 		cmd.add(dir);
+		cmd.add(info);
+		cmd.add(jobs);
+		cmd.add(io);
+		cmd.add(suite);
+		cmd.add(gcmTables);
+		cmd.add(capabilities);
+		cmd.add(compress);
+		cmd.add(verify);
+		cmd.add(range);
+		cmd.add(metrics);
+		cmd.add(pack);
+		cmd.add(dedup);
+		cmd.add(list);
+		cmd.add(member);
+		cmd.add(manifest);
+		cmd.add(inPlace);
 		cmd.add(fileArgs);
 
 		cmd.parse(argc, argv);
@@ -31,21 +71,64 @@ int main(int argc, char* argv[])
 		const bool recursive = rec.getValue();
 		const bool directory = dir.getValue();
 		const bool decryptionMode = mod.getValue();
+		const bool infoMode = info.getValue();
+		if (!infoMode && !(capabilities.getValue() && files.empty()) && !pass.isSet()) { LOG->critical("A password is required, see -p"); return 1; }
+		const std::string ioBackend = io.getValue();
+		if (ioBackend != "stream" && ioBackend != "mmap" && ioBackend != "async" && ioBackend != "direct") { LOG->critical("Unknown I/O backend {}", ioBackend); return 1; }
+		const std::string suiteName = suite.getValue();
+		if (suiteName != "auto" && suiteName != CipherSuite::name(EncryptedFileHeader::SUITE_AES_256_GCM) && suiteName != CipherSuite::name(EncryptedFileHeader::SUITE_CHACHA20_POLY1305)) {
+			LOG->critical("Unknown cipher suite {}", suiteName); return 1;
+		}
+		const std::string tables = gcmTables.getValue();
+		if (tables != "auto" && tables != "small" && tables != "large") { LOG->critical("Unknown GCM table size {}", tables); return 1; }
+		CipherSuite::setGcmTables(tables == "small" ? CipherSuite::GcmTables::SMALL : tables == "large" ? CipherSuite::GcmTables::LARGE : CipherSuite::GcmTables::AUTO);
+		if (capabilities.getValue()) {
+			for (const auto &line : CipherSuite::report()) LOG->info(line);
+			if (files.empty()) return 0;
+		}
+		const bool packMode = pack.isSet();
+		const bool dedupMode = dedup.isSet();
+		if (packMode && dedupMode) { LOG->critical("--pack and --dedup can not be combined"); return 1; }
+		if (!packMode && !dedupMode && (list.getValue() || member.isSet())) { LOG->critical("--list and --member must be used in combination with --pack or --dedup"); return 1; }
+		if (compress.getValue() && (decryptionMode || packMode || dedupMode || ioBackend == "async")) {
+			LOG->critical("--compress only applies to encrypting single files with the stream, mmap or direct backend"); return 1;
+		}
+		if (verify.getValue() && (packMode || dedupMode || range.isSet() || compress.getValue())) {
+			LOG->critical("--verify can not be combined with --pack, --dedup, --range or --compress"); return 1;
+		}
+		if (inPlace.getValue() && !manifest.isSet()) { LOG->critical("--in-place must be used in combination with --manifest"); return 1; }
+		const bool rekeyMode = newPass.isSet();
+		if (rekeyMode && (decryptionMode || infoMode || packMode || dedupMode || verify.getValue() || range.isSet() || compress.getValue())) {
+			LOG->critical("--new-password can not be combined with -u, -i, --pack, --dedup, --verify, --range or --compress"); return 1;
+		}
+		if (files.empty() && !((packMode || dedupMode) && list.getValue())) { LOG->critical("No files given"); return 1; }
+
+		// the directory an archive is extracted or a store restored to is not an input file
+		filesystem::path outputDirectory;
+		if ((packMode || dedupMode) && decryptionMode && !list.getValue()) {
+			if (files.size() != 1) { LOG->critical("Give the directory to {} to as the only file argument", packMode ? "extract" : "restore"); return 1; }
+			outputDirectory = filesystem::path(files[0]);
+			files.clear();
+		}
+
+		// listing is part of the run, so recording starts before it
+		Metrics::setEnabled(metrics.isSet());
+		const auto start = std::chrono::steady_clock::now();
 
 
 
 		std::vector<filesystem::path> ALL_FILES;
+		std::unique_ptr<DirectoryWalker> walker;
 
 		if (directory) {
-			for (auto file : files)
-			{
-				if (!filesystem::is_directory(filesystem::path(file))) { LOG->warn("SKIPPING {}. Cause : not a directory!", file); continue; }
-				if (!filesystem::exists(filesystem::path(file))) { LOG->warn("SKIPPING {}. Cause : does not exist!", file); continue; }
+			// the walker checks the directories itself and lists them in the background
+			walker.reset(new DirectoryWalker(std::vector<filesystem::path>(files.begin(), files.end()), recursive));
 
-				std::vector<filesystem::path> tmp;
-				if (recursive) tmp = fileUtils::ListFilesInDirRecursively(file.c_str());
-				else tmp = fileUtils::ListFilesInDir(file.c_str());
-				ALL_FILES.insert(std::end(ALL_FILES), std::begin(tmp), std::end(tmp));
+			// only whole-file encryption, decryption and verification consume files while they are found
+			if (infoMode || packMode || dedupMode || (decryptionMode && range.isSet())) {
+				filesystem::path file;
+				while (walker->next(file)) ALL_FILES.push_back(file);
+				walker.reset();
 			}
 		}
 		else {
@@ -58,21 +141,136 @@ int main(int argc, char* argv[])
 		}
 
 
-		FileEncrypter enc;
-
-		if (decryptionMode) {
-			enc.decryptFiles(ALL_FILES, password);
+		// every mode ends below, so the metrics report is written whatever ran
+		int exitCode = 0;
+		if (packMode && (list.getValue() || decryptionMode)) {
+			FileEncrypter enc;
+			try
+			{
+				if (list.getValue()) {
+					for (const auto &m : enc.listPack(filesystem::path(pack.getValue()), password)) LOG->info("{}  {} bytes", m.name, m.length);
+				}
+				else {
+					enc.unpackFiles(filesystem::path(pack.getValue()), password, member.getValue(), outputDirectory);
+				}
+			}
+			catch (const GeneralSecurityException &ge) { LOG->critical(ge.what()); }
+			catch (const IOException &e) { LOG->critical(e.what()); }
+		}
+		else if (dedupMode && list.getValue()) {
+			FileEncrypter enc;
+			try
+			{
+				for (const auto &f : enc.listDedup(filesystem::path(dedup.getValue()), password))
+				{
+					LOG->info("{}  {} bytes in {} chunks", f.name, f.length, f.chunks.size() / DedupStore::ID_LENGTH);
+				}
+			}
+			catch (const GeneralSecurityException &ge) { LOG->critical(ge.what()); }
+			catch (const IOException &e) { LOG->critical(e.what()); }
+		}
+		else if (infoMode) {
+			// only the fixed-size header is read
+			for (const auto &file : ALL_FILES)
+			{
+				try
+				{
+					if (EncryptedFile::isEncryptedFile(file.string())) {
+						const EncryptedFileHeader header = EncryptedFile::readHeader(file.string());
+						LOG->info("{} : format {}, suite {}, kdf {} ({} iterations), segment size {}, plaintext length {}{}{}{}", file.string(), EncryptedFileHeader::VERSION,
+							CipherSuite::name(header.getSuite()), header.getKdf(), header.getKdfIterations(), header.getSegmentSize(), header.getPlaintextLength(),
+							(header.getFlags() & EncryptedFileHeader::FLAG_PACKED) ? ", packed archive" : "",
+							(header.getFlags() & EncryptedFileHeader::FLAG_COMPRESSED) ? ", compressed" : "",
+							(header.getFlags() & EncryptedFileHeader::FLAG_WRAPPED_KEY) ? ", wrapped data key" : "");
+					}
+					else if (EncryptedFile::isLegacyEncryptedFile(file.string())) LOG->info("{} : legacy format", file.string());
+					else LOG->info("{} : not encrypted", file.string());
+				}
+				catch (const IOException &e) { LOG->warn(e.what()); }
+			}
 		}
 		else {
-			enc.encryptFiles(ALL_FILES, password);
+			FileEncrypter enc;
+			enc.setThreadCount(jobs.getValue());
+			if (ioBackend == "mmap") enc.setIoBackend(fileUtils::IoBackend::MMAP);
+			else if (ioBackend == "async") enc.setIoBackend(fileUtils::IoBackend::ASYNC);
+			else if (ioBackend == "direct") enc.setIoBackend(fileUtils::IoBackend::DIRECT);
+			else enc.setIoBackend(fileUtils::IoBackend::STREAM);
+			enc.setCompression(compress.getValue());
+			if (!decryptionMode) enc.setSuite(CipherSuite::fromName(suiteName));
+			if (manifest.isSet()) enc.setManifest(filesystem::path(manifest.getValue()));
+			enc.setInPlaceUpdates(inPlace.getValue());
+
+			if (decryptionMode && range.isSet()) {
+				const std::string value = range.getValue();
+				const size_t separator = value.find(':');
+				try
+				{
+					if (separator == std::string::npos) throw std::invalid_argument(value);
+					const uint64_t offset = std::stoull(value.substr(0, separator));
+					const uint64_t length = std::stoull(value.substr(separator + 1));
+					enc.decryptRangeFiles(ALL_FILES, password, offset, length);
+				}
+				catch (const std::logic_error &)
+				{
+					LOG->critical("Range must be given as offset:length");
+					exitCode = 1;
+				}
+			}
+			else if (rekeyMode) {
+				std::string newPassword = newPass.getValue();
+				if (walker) enc.rekeyFiles(*walker, password, newPassword);
+				else enc.rekeyFiles(ALL_FILES, password, newPassword);
+				newPassword.erase(newPassword.begin(), newPassword.end());
+			}
+			else if (verify.getValue()) {
+				const size_t failed = walker ? enc.verifyFiles(*walker, password) : enc.verifyFiles(ALL_FILES, password).size();
+				if (failed != 0) exitCode = 1;
+			}
+			else if (dedupMode && decryptionMode) {
+				enc.restoreDedup(filesystem::path(dedup.getValue()), password, member.getValue(), outputDirectory);
+			}
+			else if (decryptionMode) {
+				if (walker) enc.decryptFiles(*walker, password);
+				else enc.decryptFiles(ALL_FILES, password);
+			}
+			else if (packMode) {
+				enc.packFiles(ALL_FILES, password, filesystem::path(pack.getValue()));
+			}
+			else if (dedupMode) {
+				enc.dedupFiles(ALL_FILES, password, filesystem::path(dedup.getValue()));
+			}
+			else {
+				if (walker) enc.encryptFiles(*walker, password);
+				else enc.encryptFiles(ALL_FILES, password);
+			}
 		}
 
 		password.erase(password.begin(), password.end());
 
+		if (metrics.isSet()) {
+			try
+			{
+				Metrics::writeJson(metrics.getValue(), std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+			}
+			catch (const IOException &e) { LOG->critical(e.what()); }
+		}
+		return exitCode;
+
 	}
 	catch (const TCLAP::ArgException &e)
 	{
 		LOG->critical(e.what());
 	}
+	catch (const GeneralSecurityException &ge)
+	{
+		LOG->critical(ge.what());
+		return 1;
+	}
+	catch (const IOException &e)
+	{
+		LOG->critical(e.what());
+		return 1;
+	}
 
 }
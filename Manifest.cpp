@@ -0,0 +1,286 @@
+#include "Manifest.h"
+#include "BufferCipher.h"
+#include "IOException.h"
+#include "GeneralSecurityException.h"
+#include "Endian.h"
+#include "Metrics.h"
+#include "sha.h"
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+
+namespace filesystem = std::experimental::filesystem::v1;
+
+static const byte MANIFEST_MAGIC[8] = { 'G', 'C', 'M', 'M', 'A', 'N', 'I', 'F' };
+static const size_t HASH_CHUNK_SIZE = 1 << 20;
+
+/// <summary>
+/// Appends a length-prefixed string.
+/// </summary>
+static void putString(std::vector<byte> &out, const std::string &value)
+{
+	const size_t at = out.size();
+	out.resize(at + 4 + value.size());
+	endian::storeLE32(out.data() + at, static_cast<uint32_t>(value.size()));
+	std::memcpy(out.data() + at + 4, value.data(), value.size());
+}
+
+/// <summary>
+/// Reads a length-prefixed string, advancing <paramref name="position"/>.
+/// </summary>
+static std::string getString(const std::vector<byte> &in, size_t &position)
+{
+	if (in.size() - position < 4) throw GeneralSecurityException("Manifest is truncated");
+	const uint32_t length = endian::loadLE32(in.data() + position);
+	position += 4;
+	if (length > Manifest::MAX_PATH_LENGTH || in.size() - position < length) throw GeneralSecurityException("Manifest is malformed");
+	std::string value(reinterpret_cast<const char*>(in.data() + position), length);
+	position += length;
+	return value;
+}
+
+void Manifest::readParameters(const std::string &filename, byte salt[], uint32_t &iterations)
+{
+	std::ifstream ifs(filename, std::ios::binary);
+	byte header[Manifest::HEADER_LENGTH];
+	if (!ifs.read(reinterpret_cast<char*>(header), sizeof(header)) || std::memcmp(header, MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) != 0) {
+		throw IOException(filename + " is not a manifest");
+	}
+	const uint32_t version = endian::loadLE32(header + 8);
+	if (version == 0 || version > Manifest::VERSION) throw IOException(filename + " has an unsupported manifest version");
+
+	iterations = endian::loadLE32(header + 12);
+	std::memcpy(salt, header + 16, Manifest::SALT_LENGTH);
+}
+
+void Manifest::load(const std::string &filename, const CryptoPP::SecByteBlock &key)
+{
+	std::vector<byte> sealed;
+	uint32_t version;
+	try
+	{
+		std::ifstream ifs(filename, std::ios::binary | std::ios::ate);
+		ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		const uint64_t fileSize = static_cast<uint64_t>(ifs.tellg());
+		if (fileSize < Manifest::HEADER_LENGTH + BufferCipher::OVERHEAD) throw IOException(filename + " is truncated");
+		Metrics::Timer timer(Metrics::READ, fileSize);
+		byte header[Manifest::HEADER_LENGTH];
+		ifs.seekg(0);
+		ifs.read(reinterpret_cast<char*>(header), sizeof(header));
+		version = endian::loadLE32(header + 8);
+		sealed.resize(static_cast<size_t>(fileSize - Manifest::HEADER_LENGTH));
+		ifs.read(reinterpret_cast<char*>(sealed.data()), sealed.size());
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		throw IOException(filename + " : " + e.what());
+	}
+
+	// decrypted in place, behind the nonce
+	BufferCipher cipher(key);
+	const size_t length = cipher.open(sealed.data(), sealed.size(), sealed.data() + BufferCipher::NONCE_LENGTH, BufferCipher::plaintextLength(sealed.size()));
+	std::vector<byte> body(sealed.begin() + BufferCipher::NONCE_LENGTH, sealed.begin() + BufferCipher::NONCE_LENGTH + length);
+
+	if (body.size() < 8) throw GeneralSecurityException("Manifest is truncated");
+	const uint64_t count = endian::loadLE64(body.data());
+	size_t position = 8;
+
+	std::map<std::string, Entry> loaded;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		const std::string source = getString(body, position);
+		Entry entry;
+		if (body.size() - position < 24 + Manifest::HASH_LENGTH) throw GeneralSecurityException("Manifest is truncated");
+		entry.size = endian::loadLE64(body.data() + position);
+		entry.mtime = static_cast<int64_t>(endian::loadLE64(body.data() + position + 8));
+		entry.inode = endian::loadLE64(body.data() + position + 16);
+		std::memcpy(entry.hash, body.data() + position + 24, Manifest::HASH_LENGTH);
+		position += 24 + Manifest::HASH_LENGTH;
+		entry.destination = getString(body, position);
+
+		// version 1 entries have no segment hashes, so the next change re-encrypts the file as a whole
+		entry.segmentSize = 0;
+		entry.nextCounter = 0;
+		if (version >= 2) {
+			if (body.size() - position < 12) throw GeneralSecurityException("Manifest is truncated");
+			entry.segmentSize = endian::loadLE32(body.data() + position);
+			entry.nextCounter = endian::loadLE32(body.data() + position + 4);
+			const size_t hashesLength = static_cast<size_t>(endian::loadLE32(body.data() + position + 8)) * Manifest::SEGMENT_HASH_LENGTH;
+			position += 12;
+			if (body.size() - position < hashesLength) throw GeneralSecurityException("Manifest is truncated");
+			entry.segmentHashes.assign(body.begin() + position, body.begin() + position + hashesLength);
+			position += hashesLength;
+		}
+		loaded[source] = entry;
+	}
+	if (position != body.size()) throw GeneralSecurityException("Manifest is malformed");
+
+	std::lock_guard<std::mutex> lock(mutex);
+	entries.swap(loaded);
+	dirty = false;
+}
+
+void Manifest::save(const std::string &filename, const CryptoPP::SecByteBlock &key, const byte salt[], const uint32_t iterations)
+{
+	std::vector<byte> body(8);
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		endian::storeLE64(body.data(), entries.size());
+		for (const auto &item : entries)
+		{
+			putString(body, item.first);
+			const size_t at = body.size();
+			body.resize(at + 24 + Manifest::HASH_LENGTH);
+			endian::storeLE64(body.data() + at, item.second.size);
+			endian::storeLE64(body.data() + at + 8, static_cast<uint64_t>(item.second.mtime));
+			endian::storeLE64(body.data() + at + 16, item.second.inode);
+			std::memcpy(body.data() + at + 24, item.second.hash, Manifest::HASH_LENGTH);
+			putString(body, item.second.destination);
+
+			const size_t segmentsAt = body.size();
+			body.resize(segmentsAt + 12);
+			endian::storeLE32(body.data() + segmentsAt, item.second.segmentSize);
+			endian::storeLE32(body.data() + segmentsAt + 4, item.second.nextCounter);
+			endian::storeLE32(body.data() + segmentsAt + 8, static_cast<uint32_t>(item.second.segmentHashes.size() / Manifest::SEGMENT_HASH_LENGTH));
+			body.insert(body.end(), item.second.segmentHashes.begin(), item.second.segmentHashes.end());
+		}
+	}
+
+	std::vector<byte> file(Manifest::HEADER_LENGTH + BufferCipher::sealedLength(body.size()));
+	std::memcpy(file.data(), MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+	endian::storeLE32(file.data() + 8, Manifest::VERSION);
+	endian::storeLE32(file.data() + 12, iterations);
+	std::memcpy(file.data() + 16, salt, Manifest::SALT_LENGTH);
+	BufferCipher cipher(key);
+	cipher.seal(body.data(), body.size(), file.data() + Manifest::HEADER_LENGTH, file.size() - Manifest::HEADER_LENGTH);
+
+	const std::string temporary = filename + ".tmp";
+	try
+	{
+		Metrics::Timer timer(Metrics::WRITE, file.size());
+		std::ofstream ofs(temporary, std::ios::binary);
+		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+		ofs.write(reinterpret_cast<const char*>(file.data()), file.size());
+		ofs.close();
+		filesystem::rename(temporary, filename);
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		std::error_code ec;
+		filesystem::remove(temporary, ec);
+		throw IOException(filename + " : " + e.what());
+	}
+	catch (const filesystem::filesystem_error &e)
+	{
+		std::error_code ec;
+		filesystem::remove(temporary, ec);
+		throw IOException(e.what());
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	dirty = false;
+}
+
+bool Manifest::find(const std::string &source, Entry &entry)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	const auto item = entries.find(source);
+	if (item == entries.end()) return false;
+	entry = item->second;
+	return true;
+}
+
+void Manifest::put(const std::string &source, const Entry &entry)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	entries[source] = entry;
+	dirty = true;
+}
+
+bool Manifest::isDirty()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return dirty;
+}
+
+std::string Manifest::sourceKey(const filesystem::path &file)
+{
+	std::error_code ec;
+	const filesystem::path canonical = filesystem::canonical(file, ec);
+	return ec ? filesystem::absolute(file).string() : canonical.string();
+}
+
+bool Manifest::stat(const filesystem::path &file, Entry &entry)
+{
+	std::error_code ec;
+	entry.size = filesystem::file_size(file, ec);
+	if (ec) return false;
+	entry.mtime = static_cast<int64_t>(filesystem::last_write_time(file, ec).time_since_epoch().count());
+	if (ec) return false;
+
+	entry.inode = 0;
+#ifndef _WIN32
+	struct ::stat status;
+	if (::stat(file.c_str(), &status) != 0) return false;
+	entry.inode = static_cast<uint64_t>(status.st_ino);
+#endif
+	return true;
+}
+
+void Manifest::hash(const filesystem::path &file, Entry &entry, const uint32_t segmentSize)
+{
+	entry.segmentSize = segmentSize;
+	entry.segmentHashes.clear();
+	try
+	{
+		std::ifstream ifs(file.string(), std::ios::binary);
+		ifs.exceptions(std::ifstream::badbit);
+		if (!ifs) throw IOException("Could not open " + file.string());
+
+		CryptoPP::SHA256 sha;
+		CryptoPP::SHA256 segmentSha;
+		uint32_t segmentFill = 0;
+		auto finishSegment = [&]() {
+			const size_t at = entry.segmentHashes.size();
+			entry.segmentHashes.resize(at + Manifest::SEGMENT_HASH_LENGTH);
+			segmentSha.TruncatedFinal(entry.segmentHashes.data() + at, Manifest::SEGMENT_HASH_LENGTH);
+			segmentFill = 0;
+		};
+
+		std::vector<byte> chunk(HASH_CHUNK_SIZE);
+		while (ifs)
+		{
+			size_t read;
+			{
+				Metrics::Timer timer(Metrics::READ);
+				ifs.read(reinterpret_cast<char*>(chunk.data()), chunk.size());
+				read = static_cast<size_t>(ifs.gcount());
+				timer.addBytes(read);
+			}
+			sha.Update(chunk.data(), read);
+
+			// chunks and segments need not line up
+			for (size_t done = 0; done < read;)
+			{
+				const size_t part = std::min<size_t>(read - done, segmentSize - segmentFill);
+				segmentSha.Update(chunk.data() + done, part);
+				segmentFill += static_cast<uint32_t>(part);
+				done += part;
+				if (segmentFill == segmentSize) finishSegment();
+			}
+		}
+		sha.Final(entry.hash);
+
+		// a partial last segment, or the single empty segment of an empty file
+		if (segmentFill > 0 || entry.segmentHashes.empty()) finishSegment();
+	}
+	catch (const std::ios_base::failure &e)
+	{
+		throw IOException(file.string() + " : " + e.what());
+	}
+}
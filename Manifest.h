@@ -0,0 +1,148 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <experimental/filesystem>
+#include "secblock.h"
+
+typedef unsigned char byte;
+
+/// <summary>
+/// Remembers which source files were encrypted to which destination, and in which state, so a later run can skip the
+/// files that did not change. A file counts as unchanged when its size, modification time and inode match the manifest,
+/// which costs a single stat. When only the modification time or inode moved, the content hash decides, so a touched
+/// but identical file is not encrypted again either. Version 2 adds a hash per segment, so a changed file can be
+/// updated in place by re-encrypting only the segments whose hash changed, and the nonce counter the encrypted file
+/// must continue from; version 1 manifests are still read.
+///
+/// The manifest is stored encrypted, since it lists file names and content hashes:
+///
+///   magic (8) | version (4) | KDF iterations (4) | salt (16) | sealed entries, see <see cref="BufferCipher"/>
+///
+/// Safe to share between threads.
+/// </summary>
+class Manifest
+{
+
+public:
+	const static unsigned int VERSION = 2;
+	const static unsigned int HEADER_LENGTH = 32; //bytes
+	const static unsigned int SALT_LENGTH = 16; //bytes
+	const static unsigned int HASH_LENGTH = 32; //bytes
+	const static unsigned int SEGMENT_HASH_LENGTH = 16; //bytes, truncated SHA-256
+	const static unsigned int MAX_PATH_LENGTH = 1 << 16; //bytes
+
+	/// <summary>
+	/// The recorded state of a source file.
+	/// </summary>
+	struct Entry {
+		uint64_t size;
+		/// <summary>Modification time, in file clock ticks.</summary>
+		int64_t mtime;
+		/// <summary>Inode number, 0 where the platform has none.</summary>
+		uint64_t inode;
+		/// <summary>SHA-256 of the contents.</summary>
+		byte hash[HASH_LENGTH];
+		/// <summary>The encrypted file.</summary>
+		std::string destination;
+		/// <summary>Segment size of <see cref="segmentHashes"/>, 0 if there are none.</summary>
+		uint32_t segmentSize;
+		/// <summary><see cref="SEGMENT_HASH_LENGTH"/> bytes per segment of <see cref="segmentSize"/>.</summary>
+		std::vector<byte> segmentHashes;
+		/// <summary>The first nonce counter the encrypted file has not used yet, 0 if unknown.</summary>
+		uint32_t nextCounter;
+
+		/// <summary>
+		/// Whether size, modification time and inode match.
+		/// </summary>
+		bool sameMetadata(const Entry &other) const { return size == other.size && mtime == other.mtime && inode == other.inode; }
+	};
+
+private:
+	std::map<std::string, Entry> entries;
+	std::mutex mutex;
+	bool dirty;
+
+public:
+
+	/// <summary>
+	/// Initializes a new, empty instance of the <see cref="Manifest"/> class.
+	/// </summary>
+	Manifest() :dirty(false) {}
+
+	/// <summary>
+	/// Reads the key derivation parameters of a stored manifest. Throws an <see cref="IOException"/> if the file is not a
+	/// manifest of a supported version.
+	/// </summary>
+	/// <param name="filename">The manifest file.</param>
+	/// <param name="salt">Receives the salt, <see cref="SALT_LENGTH"/> bytes.</param>
+	/// <param name="iterations">Receives the KDF iteration count.</param>
+	static void readParameters(const std::string &filename, byte salt[], uint32_t &iterations);
+
+	/// <summary>
+	/// Replaces the entries with those of a stored manifest. Throws an <see cref="IOException"/> if it can not be read,
+	/// and a <see cref="GeneralSecurityException"/> if it is not authentic under the key.
+	/// </summary>
+	/// <param name="filename">The manifest file.</param>
+	/// <param name="key">The key derived from the parameters of the file.</param>
+	void load(const std::string &filename, const CryptoPP::SecByteBlock &key);
+
+	/// <summary>
+	/// Stores the manifest. It is written next to the target and renamed over it, so an interrupted save leaves the
+	/// previous manifest intact. Throws an <see cref="IOException"/> on failure.
+	/// </summary>
+	/// <param name="filename">The manifest file.</param>
+	/// <param name="key">The key.</param>
+	/// <param name="salt">The salt the key was derived with, <see cref="SALT_LENGTH"/> bytes.</param>
+	/// <param name="iterations">The KDF iteration count the key was derived with.</param>
+	void save(const std::string &filename, const CryptoPP::SecByteBlock &key, const byte salt[], const uint32_t iterations);
+
+	/// <summary>
+	/// Looks up a source file.
+	/// </summary>
+	/// <param name="source">The source key, see <see cref="sourceKey"/>.</param>
+	/// <param name="entry">Receives the entry.</param>
+	/// <returns><c>true</c> if the file is recorded</returns>
+	bool find(const std::string &source, Entry &entry);
+
+	/// <summary>
+	/// Records a source file.
+	/// </summary>
+	/// <param name="source">The source key, see <see cref="sourceKey"/>.</param>
+	/// <param name="entry">The entry.</param>
+	void put(const std::string &source, const Entry &entry);
+
+	/// <summary>
+	/// Whether entries were added or changed since the manifest was loaded.
+	/// </summary>
+	/// <returns></returns>
+	bool isDirty();
+
+	/// <summary>
+	/// Gets the key a file is recorded under, its canonical path.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <returns>The key</returns>
+	static std::string sourceKey(const std::experimental::filesystem::v1::path &file);
+
+	/// <summary>
+	/// Fills in the size, modification time and inode of a file.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <param name="entry">The entry.</param>
+	/// <returns><c>false</c> if the file can not be stat'ed</returns>
+	static bool stat(const std::experimental::filesystem::v1::path &file, Entry &entry);
+
+	/// <summary>
+	/// Computes the content hash of a file into <see cref="Entry::hash"/>, and in the same pass the hash of every
+	/// segment into <see cref="Entry::segmentHashes"/>. Throws an <see cref="IOException"/> if it can not be read.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <param name="entry">The entry.</param>
+	/// <param name="segmentSize">The segment size of the encrypted file.</param>
+	static void hash(const std::experimental::filesystem::v1::path &file, Entry &entry, const uint32_t segmentSize);
+
+};
@@ -0,0 +1,121 @@
+#include "Metrics.h"
+#include "IOException.h"
+#include <experimental/filesystem>
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+
+
+namespace filesystem = std::experimental::filesystem::v1;
+
+std::atomic<bool> Metrics::enabled(false);
+Metrics::StageCounters Metrics::stages[Metrics::STAGE_COUNT];
+std::atomic<uint64_t> Metrics::fileCount(0);
+std::mutex Metrics::outlierMutex;
+std::vector<Metrics::FileRecord> Metrics::outliers;
+
+static const char * const STAGE_NAMES[Metrics::STAGE_COUNT] = { "list", "kdf", "name", "read", "cipher", "serialize", "index", "compress", "write" };
+
+
+void Metrics::record(const Stage stage, const uint64_t bytes, const uint64_t nanoseconds)
+{
+	StageCounters &counters = stages[stage];
+	counters.calls.fetch_add(1, std::memory_order_relaxed);
+	counters.bytes.fetch_add(bytes, std::memory_order_relaxed);
+	counters.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+
+	uint64_t max = counters.maxNanoseconds.load(std::memory_order_relaxed);
+	while (nanoseconds > max && !counters.maxNanoseconds.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {}
+
+	// log2 buckets of microseconds
+	unsigned int bucket = 0;
+	for (uint64_t micros = nanoseconds / 1000; micros > 0 && bucket + 1 < Metrics::BUCKET_COUNT; micros >>= 1) ++bucket;
+	counters.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+void Metrics::recordFile(const std::string &file, const uint64_t nanoseconds)
+{
+	fileCount.fetch_add(1, std::memory_order_relaxed);
+
+	std::error_code ec;
+	const uintmax_t size = filesystem::file_size(file, ec);
+	const FileRecord record = { file, ec ? 0 : static_cast<uint64_t>(size), nanoseconds };
+
+	// keep the slowest files, sorted slowest first
+	std::lock_guard<std::mutex> lock(outlierMutex);
+	if (outliers.size() == Metrics::OUTLIER_COUNT && outliers.back().nanoseconds >= nanoseconds) return;
+	const auto position = std::find_if(outliers.begin(), outliers.end(), [&](const FileRecord &r) { return r.nanoseconds < nanoseconds; });
+	outliers.insert(position, record);
+	if (outliers.size() > Metrics::OUTLIER_COUNT) outliers.pop_back();
+}
+
+void Metrics::reset()
+{
+	for (StageCounters &counters : stages)
+	{
+		counters.calls = 0;
+		counters.bytes = 0;
+		counters.nanoseconds = 0;
+		counters.maxNanoseconds = 0;
+		for (auto &bucket : counters.buckets) bucket = 0;
+	}
+	fileCount = 0;
+
+	std::lock_guard<std::mutex> lock(outlierMutex);
+	outliers.clear();
+}
+
+/// <summary>
+/// Writes a string as a JSON string literal.
+/// </summary>
+static void writeJsonString(std::ostream &out, const std::string &value)
+{
+	out << '"';
+	for (const char c : value)
+	{
+		if (c == '"' || c == '\\') out << '\\' << c;
+		else if (static_cast<unsigned char>(c) < 0x20) out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec << std::setfill(' ');
+		else out << c;
+	}
+	out << '"';
+}
+
+void Metrics::writeJson(const std::string &filename, const double wallSeconds)
+{
+	std::ofstream out(filename);
+	if (!out) throw IOException("Cannot write metrics to " + filename);
+
+	out << std::setprecision(9);
+	out << "{\n  \"wallSeconds\": " << wallSeconds << ",\n  \"files\": " << fileCount.load() << ",\n  \"stages\": {\n";
+	for (unsigned int s = 0; s < Metrics::STAGE_COUNT; ++s)
+	{
+		const StageCounters &counters = stages[s];
+		const double seconds = counters.nanoseconds.load() / 1e9;
+		out << "    \"" << STAGE_NAMES[s] << "\": {\"calls\": " << counters.calls.load() << ", \"bytes\": " << counters.bytes.load()
+			<< ", \"seconds\": " << seconds << ", \"maxSeconds\": " << counters.maxNanoseconds.load() / 1e9
+			<< ", \"bytesPerSecond\": " << (seconds > 0 ? counters.bytes.load() / seconds : 0) << ", \"histogramMicros\": {";
+
+		// only the buckets that were hit, keyed by their upper bound
+		bool first = true;
+		for (unsigned int b = 0; b < Metrics::BUCKET_COUNT; ++b)
+		{
+			const uint64_t count = counters.buckets[b].load();
+			if (count == 0) continue;
+			out << (first ? "" : ", ") << "\"<" << (1ull << b) << "\": " << count;
+			first = false;
+		}
+		out << "}}" << (s + 1 < Metrics::STAGE_COUNT ? ",\n" : "\n");
+	}
+	out << "  },\n  \"slowestFiles\": [\n";
+
+	std::lock_guard<std::mutex> lock(outlierMutex);
+	for (size_t i = 0; i < outliers.size(); ++i)
+	{
+		out << "    {\"file\": ";
+		writeJsonString(out, outliers[i].file);
+		out << ", \"bytes\": " << outliers[i].bytes << ", \"seconds\": " << outliers[i].nanoseconds / 1e9 << "}" << (i + 1 < outliers.size() ? ",\n" : "\n");
+	}
+	out << "  ]\n}\n";
+
+	if (!out) throw IOException("Cannot write metrics to " + filename);
+}
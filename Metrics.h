@@ -0,0 +1,171 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/// <summary>
+/// Per-stage counters and latency histograms of a run, written as a JSON report. Recording is off by default;
+/// while it is off a <see cref="Timer"/> costs a single relaxed atomic load and reads no clock. All counters are
+/// atomic, so workers record without taking a lock; only the list of slowest files is guarded by a mutex.
+/// </summary>
+class Metrics
+{
+
+public:
+	/// <summary>
+	/// The stages of a run.
+	/// </summary>
+	enum Stage {
+		/// <summary>Listing the files of a directory.</summary>
+		LIST,
+		/// <summary>Deriving keys from the password.</summary>
+		KDF,
+		/// <summary>Finding an unused name for an output file.</summary>
+		NAME,
+		/// <summary>Reading plaintext or ciphertext.</summary>
+		READ,
+		/// <summary>Encrypting or decrypting.</summary>
+		CIPHER,
+		/// <summary>Reading or writing headers and legacy containers.</summary>
+		SERIALIZE,
+		/// <summary>Sealing or verifying the segment index.</summary>
+		INDEX,
+		/// <summary>Compressing or decompressing segments.</summary>
+		COMPRESS,
+		/// <summary>Writing plaintext or ciphertext.</summary>
+		WRITE,
+		STAGE_COUNT
+	};
+
+	const static unsigned int BUCKET_COUNT = 32;
+	const static unsigned int OUTLIER_COUNT = 16;
+
+	/// <summary>
+	/// Records the time between its construction and destruction against a stage.
+	/// </summary>
+	class Timer
+	{
+
+	private:
+		const Stage stage;
+		uint64_t bytes;
+		const bool active;
+		std::chrono::steady_clock::time_point start;
+
+	public:
+		Timer(const Stage stage, const uint64_t bytes = 0)
+			:stage(stage), bytes(bytes), active(Metrics::isEnabled())
+		{
+			if (active) start = std::chrono::steady_clock::now();
+		}
+
+		~Timer()
+		{
+			if (active) Metrics::record(stage, bytes, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+		}
+
+		/// <summary>
+		/// Adds bytes that were only known once the stage ran.
+		/// </summary>
+		/// <param name="count">Number of bytes.</param>
+		void addBytes(const uint64_t count) { bytes += count; }
+
+		Timer(const Timer&) = delete;
+		Timer& operator=(const Timer&) = delete;
+	};
+
+	/// <summary>
+	/// Records the time spent on one file, for the list of slowest files.
+	/// </summary>
+	class FileTimer
+	{
+
+	private:
+		const std::string file;
+		const bool active;
+		std::chrono::steady_clock::time_point start;
+
+	public:
+		FileTimer(const std::string &file)
+			:file(Metrics::isEnabled() ? file : std::string()), active(Metrics::isEnabled())
+		{
+			if (active) start = std::chrono::steady_clock::now();
+		}
+
+		~FileTimer()
+		{
+			if (active) Metrics::recordFile(file, static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count()));
+		}
+
+		FileTimer(const FileTimer&) = delete;
+		FileTimer& operator=(const FileTimer&) = delete;
+	};
+
+	/// <summary>
+	/// Turns recording on or off.
+	/// </summary>
+	/// <param name="enabled">Whether to record.</param>
+	static void setEnabled(const bool enabled) { Metrics::enabled.store(enabled, std::memory_order_relaxed); }
+
+	/// <summary>
+	/// Determines whether recording is on.
+	/// </summary>
+	/// <returns>
+	///   <c>true</c> if recording; otherwise, <c>false</c>.
+	/// </returns>
+	static bool isEnabled() { return Metrics::enabled.load(std::memory_order_relaxed); }
+
+	/// <summary>
+	/// Records one call of a stage.
+	/// </summary>
+	/// <param name="stage">The stage.</param>
+	/// <param name="bytes">Number of bytes processed.</param>
+	/// <param name="nanoseconds">The latency.</param>
+	static void record(const Stage stage, const uint64_t bytes, const uint64_t nanoseconds);
+
+	/// <summary>
+	/// Records the total time spent on one file.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <param name="nanoseconds">The latency.</param>
+	static void recordFile(const std::string &file, const uint64_t nanoseconds);
+
+	/// <summary>
+	/// Clears all counters.
+	/// </summary>
+	static void reset();
+
+	/// <summary>
+	/// Writes the report. Throws an <see cref="IOException"/> if the file cannot be written.
+	/// </summary>
+	/// <param name="filename">File location</param>
+	/// <param name="wallSeconds">Wall-clock duration of the run.</param>
+	static void writeJson(const std::string &filename, const double wallSeconds);
+
+private:
+	struct StageCounters {
+		std::atomic<uint64_t> calls;
+		std::atomic<uint64_t> bytes;
+		std::atomic<uint64_t> nanoseconds;
+		std::atomic<uint64_t> maxNanoseconds;
+		// bucket i counts latencies below 2^i microseconds that did not fit bucket i - 1
+		std::atomic<uint64_t> buckets[BUCKET_COUNT];
+	};
+
+	struct FileRecord {
+		std::string file;
+		uint64_t bytes;
+		uint64_t nanoseconds;
+	};
+
+	static std::atomic<bool> enabled;
+	static StageCounters stages[STAGE_COUNT];
+	static std::atomic<uint64_t> fileCount;
+	static std::mutex outlierMutex;
+	static std::vector<FileRecord> outliers;
+
+};
@@ -0,0 +1,94 @@
+#include "PackArchive.h"
+#include "GeneralSecurityException.h"
+#include "Endian.h"
+#include <cstring>
+
+
+static const size_t MEMBER_FIXED_LENGTH = 8 + 8 + 4;
+
+std::vector<byte> PackArchive::encodeDirectory(const std::vector<Member> &members)
+{
+	size_t length = 8;
+	for (const Member &member : members) length += MEMBER_FIXED_LENGTH + member.name.size();
+
+	std::vector<byte> directory(length);
+	byte *out = directory.data();
+	endian::storeLE64(out, members.size());
+	out += 8;
+	for (const Member &member : members)
+	{
+		endian::storeLE64(out, member.offset);
+		endian::storeLE64(out + 8, member.length);
+		endian::storeLE32(out + 16, static_cast<uint32_t>(member.name.size()));
+		std::memcpy(out + MEMBER_FIXED_LENGTH, member.name.data(), member.name.size());
+		out += MEMBER_FIXED_LENGTH + member.name.size();
+	}
+
+	return directory;
+}
+
+std::vector<PackArchive::Member> PackArchive::decodeDirectory(const byte directory[], const size_t length, const uint64_t dataLength)
+{
+	if (length < 8) throw GeneralSecurityException("Archive directory is truncated");
+	const uint64_t count = endian::loadLE64(directory);
+	// every member takes at least its fixed fields, so the count is bounded before anything is allocated
+	if (count > (length - 8) / MEMBER_FIXED_LENGTH) throw GeneralSecurityException("Archive directory is malformed");
+
+	std::vector<Member> members(static_cast<size_t>(count));
+	size_t position = 8;
+	uint64_t expectedOffset = 0;
+	for (Member &member : members)
+	{
+		if (length - position < MEMBER_FIXED_LENGTH) throw GeneralSecurityException("Archive directory is truncated");
+		member.offset = endian::loadLE64(directory + position);
+		member.length = endian::loadLE64(directory + position + 8);
+		const uint32_t nameLength = endian::loadLE32(directory + position + 16);
+		position += MEMBER_FIXED_LENGTH;
+
+		if (nameLength == 0 || nameLength > PackArchive::MAX_NAME_LENGTH || length - position < nameLength) {
+			throw GeneralSecurityException("Archive directory has an invalid member name");
+		}
+		member.name.assign(reinterpret_cast<const char*>(directory + position), nameLength);
+		position += nameLength;
+
+		if (member.offset != expectedOffset || member.length > dataLength - member.offset) {
+			throw GeneralSecurityException("Archive member " + member.name + " is out of place");
+		}
+		expectedOffset += member.length;
+	}
+
+	if (position != length || expectedOffset != dataLength) throw GeneralSecurityException("Archive directory does not match the archive");
+	return members;
+}
+
+std::string PackArchive::memberName(const std::experimental::filesystem::v1::path &file)
+{
+	std::string name;
+	for (const auto &part : file.relative_path())
+	{
+		const std::string text = part.string();
+		if (text.empty() || text == "." || text == "..") continue;
+		if (!name.empty()) name += '/';
+		name += text;
+	}
+	return name;
+}
+
+bool PackArchive::isSafeName(const std::string &name)
+{
+	if (name.empty() || name[0] == '/') return false;
+#ifdef _WIN32
+	// separators and drive letters the archive format does not use
+	if (name.find('\\') != std::string::npos || name.find(':') != std::string::npos) return false;
+#endif
+
+	size_t start = 0;
+	for (;;)
+	{
+		const size_t end = name.find('/', start);
+		const std::string part = name.substr(start, end == std::string::npos ? std::string::npos : end - start);
+		if (part.empty() || part == "." || part == "..") return false;
+		if (end == std::string::npos) return true;
+		start = end + 1;
+	}
+}
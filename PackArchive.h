@@ -0,0 +1,71 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <experimental/filesystem>
+
+typedef unsigned char byte;
+
+/// <summary>
+/// The layout of a packed archive, many files encrypted as the plaintext of a single streamed file flagged with
+/// <see cref="EncryptedFileHeader::FLAG_PACKED"/>. The plaintext is the contents of the members back to back,
+/// followed by the directory describing them and a trailer locating the directory:
+///
+///   member data | directory | directory length (8)
+///
+///   directory: member count (8), then per member: offset (8) | length (8) | name length (4) | name (UTF-8, '/' separated)
+///
+/// The directory is encrypted and authenticated like any other part of the plaintext, and as it sits at the end,
+/// listing the archive or extracting one member only decrypts the segments covering it, see <see cref="FileEncrypter::decryptRange"/>.
+/// </summary>
+class PackArchive
+{
+
+public:
+	const static unsigned int SEGMENT_SIZE = 1 << 16; //bytes, small so extracting a small member reads little more than the member
+	const static unsigned int TRAILER_LENGTH = 8; //bytes
+	const static unsigned int MAX_NAME_LENGTH = 4096; //bytes
+
+	/// <summary>
+	/// A file in the archive.
+	/// </summary>
+	struct Member {
+		std::string name;
+		/// <summary>Plaintext offset of the contents.</summary>
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	/// <summary>
+	/// Encodes the directory. Members must be stored back to back in the given order, starting at offset 0.
+	/// </summary>
+	/// <param name="members">The members.</param>
+	/// <returns>The directory</returns>
+	static std::vector<byte> encodeDirectory(const std::vector<Member> &members);
+
+	/// <summary>
+	/// Decodes a directory. Throws a <see cref="GeneralSecurityException"/> if it is malformed, or if the members
+	/// are not stored back to back and exactly fill <paramref name="dataLength"/> bytes.
+	/// </summary>
+	/// <param name="directory">The directory.</param>
+	/// <param name="length">Length of the directory.</param>
+	/// <param name="dataLength">Length of the member data before the directory.</param>
+	/// <returns>The members</returns>
+	static std::vector<Member> decodeDirectory(const byte directory[], const size_t length, const uint64_t dataLength);
+
+	/// <summary>
+	/// Gets the name a file is stored under: its relative path with '/' separators, without root, "." or ".." parts.
+	/// </summary>
+	/// <param name="file">The file.</param>
+	/// <returns>The name</returns>
+	static std::string memberName(const std::experimental::filesystem::v1::path &file);
+
+	/// <summary>
+	/// Checks that a member name stays inside the directory it is extracted to.
+	/// </summary>
+	/// <param name="name">The name.</param>
+	/// <returns><c>true</c> if the name is relative and has no empty, "." or ".." parts</returns>
+	static bool isSafeName(const std::string &name);
+
+};
@@ -0,0 +1,93 @@
+#include "Pipeline.h"
+#include "BoundedQueue.h"
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+
+
+void Pipeline::run(const uint64_t count, const size_t inputCapacity, const size_t outputCapacity, const Stage &read, const Stage &process, const Stage &write)
+{
+	// nothing to overlap, so no threads are started
+	if (count < 2) {
+		Buffer buffer = { 0, 0, std::vector<byte>(inputCapacity), std::vector<byte>(outputCapacity) };
+		for (; buffer.sequence < count; ++buffer.sequence)
+		{
+			read(buffer);
+			process(buffer);
+			write(buffer);
+		}
+		return;
+	}
+
+	std::vector<Buffer> buffers(Pipeline::DEPTH);
+	for (Buffer &buffer : buffers)
+	{
+		buffer.input.resize(inputCapacity);
+		buffer.output.resize(outputCapacity);
+	}
+
+	// buffers move by index: free -> reader -> filled -> caller -> processed -> writer -> free
+	BoundedQueue<size_t> free(Pipeline::DEPTH);
+	BoundedQueue<size_t> filled(Pipeline::DEPTH);
+	BoundedQueue<size_t> processed(Pipeline::DEPTH);
+	for (size_t i = 0; i < buffers.size(); ++i) free.push(i);
+
+	std::atomic<bool> failed(false);
+	std::exception_ptr error;
+	std::mutex errorMutex;
+	auto fail = [&](std::exception_ptr e) {
+		{
+			std::lock_guard<std::mutex> lock(errorMutex);
+			if (!error) error = e;
+		}
+		failed = true;
+		free.close();
+		filled.close();
+		processed.close();
+	};
+
+	std::thread reader([&]() {
+		try
+		{
+			size_t b;
+			for (uint64_t n = 0; n < count && !failed && free.pop(b); ++n)
+			{
+				buffers[b].sequence = n;
+				read(buffers[b]);
+				if (!filled.push(b)) return;
+			}
+			filled.close();
+		}
+		catch (...) { fail(std::current_exception()); }
+	});
+
+	std::thread writer([&]() {
+		try
+		{
+			size_t b;
+			while (processed.pop(b) && !failed)
+			{
+				write(buffers[b]);
+				if (!free.push(b)) return;
+			}
+		}
+		catch (...) { fail(std::current_exception()); }
+	});
+
+	try
+	{
+		size_t b;
+		while (filled.pop(b) && !failed)
+		{
+			process(buffers[b]);
+			if (!processed.push(b)) break;
+		}
+		processed.close();
+	}
+	catch (...) { fail(std::current_exception()); }
+
+	reader.join();
+	writer.join();
+	if (error) std::rethrow_exception(error);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+typedef unsigned char byte;
+
+/// <summary>
+/// Runs the segments of a stream through three stages: a reader thread, the calling thread, and a writer thread.
+/// The stages hand a fixed set of reusable buffers to each other through bounded queues, so while segment N is
+/// processed, segment N + 1 is already being read and segment N - 1 written. Throughput then approaches that of the
+/// slowest stage instead of the sum of all three. Each stage sees the segments in order.
+/// </summary>
+class Pipeline
+{
+
+public:
+	const static unsigned int DEPTH = 4; // buffers in flight
+
+	/// <summary>
+	/// A buffer travelling through the stages.
+	/// </summary>
+	struct Buffer {
+		/// <summary>The segment number.</summary>
+		uint64_t sequence;
+		/// <summary>Number of valid bytes in <see cref="input"/>, set by the reader.</summary>
+		size_t length;
+		std::vector<byte> input;
+		std::vector<byte> output;
+	};
+
+	typedef std::function<void(Buffer&)> Stage;
+
+	/// <summary>
+	/// Runs <paramref name="count"/> segments through the stages and returns once the last one was written. If a stage
+	/// throws, the other stages stop at the next buffer and the first exception is rethrown to the caller.
+	/// A single segment runs through all stages on the calling thread.
+	/// </summary>
+	/// <param name="count">Number of segments.</param>
+	/// <param name="inputCapacity">Size of every input buffer.</param>
+	/// <param name="outputCapacity">Size of every output buffer.</param>
+	/// <param name="read">Fills <see cref="Buffer::input"/> and sets <see cref="Buffer::length"/>, on the reader thread.</param>
+	/// <param name="process">Turns the input into the output, on the calling thread.</param>
+	/// <param name="write">Consumes the output, on the writer thread.</param>
+	static void run(const uint64_t count, const size_t inputCapacity, const size_t outputCapacity, const Stage &read, const Stage &process, const Stage &write);
+
+};
@@ -0,0 +1,61 @@
+#include "RandomSource.h"
+#include "osrng.h"
+#include "drbg.h"
+#include "sha.h"
+#include "secblock.h"
+#include <memory>
+#include <cstring>
+#include <algorithm>
+
+
+namespace
+{
+	/// <summary>
+	/// The generator of one thread.
+	/// </summary>
+	struct ThreadGenerator {
+		std::unique_ptr<CryptoPP::Hash_DRBG<CryptoPP::SHA256, 256 / 8, 440 / 8>> drbg;
+		CryptoPP::SecByteBlock batch;
+		size_t position;
+		uint64_t sinceReseed;
+
+		ThreadGenerator()
+			:batch(RandomSource::BATCH_SIZE), position(RandomSource::BATCH_SIZE), sinceReseed(0)
+		{
+			CryptoPP::SecByteBlock seed(RandomSource::ENTROPY_LENGTH + RandomSource::NONCE_LENGTH);
+			CryptoPP::OS_GenerateRandomBlock(false, seed, seed.size());
+			drbg.reset(new CryptoPP::Hash_DRBG<CryptoPP::SHA256, 256 / 8, 440 / 8>(seed, RandomSource::ENTROPY_LENGTH,
+				seed + RandomSource::ENTROPY_LENGTH, RandomSource::NONCE_LENGTH));
+		}
+
+		void refill()
+		{
+			if (sinceReseed >= RandomSource::RESEED_INTERVAL) {
+				CryptoPP::SecByteBlock entropy(RandomSource::ENTROPY_LENGTH);
+				CryptoPP::OS_GenerateRandomBlock(false, entropy, entropy.size());
+				drbg->IncorporateEntropy(entropy, entropy.size());
+				sinceReseed = 0;
+			}
+			drbg->GenerateBlock(batch, batch.size());
+			sinceReseed += batch.size();
+			position = 0;
+		}
+	};
+}
+
+void RandomSource::generate(byte output[], const size_t length)
+{
+	static thread_local ThreadGenerator generator;
+
+	size_t done = 0;
+	while (done < length)
+	{
+		if (generator.position == generator.batch.size()) generator.refill();
+		const size_t chunk = std::min(length - done, generator.batch.size() - generator.position);
+		std::memcpy(output + done, generator.batch + generator.position, chunk);
+		// handed out bytes are not kept around
+		std::memset(generator.batch + generator.position, 0, chunk);
+		generator.position += chunk;
+		done += chunk;
+	}
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+typedef unsigned char byte;
+
+/// <summary>
+/// Random bytes for salts and nonce prefixes. Every thread owns an SP800-90A Hash_DRBG with SHA-256, seeded from
+/// the operating system the first time the thread asks for randomness and reseeded from it after every
+/// <see cref="RESEED_INTERVAL"/> bytes, so the OS entropy source is not hit once per file and threads never
+/// share a lock. Bytes are generated <see cref="BATCH_SIZE"/> at a time and handed out from a wiped per-thread buffer.
+/// </summary>
+class RandomSource
+{
+
+public:
+	const static unsigned int ENTROPY_LENGTH = 32; //bytes
+	const static unsigned int NONCE_LENGTH = 16; //bytes
+	const static unsigned int BATCH_SIZE = 4096; //bytes
+	const static uint64_t RESEED_INTERVAL = 1 << 20; //bytes
+
+	/// <summary>
+	/// Fills a buffer with random bytes.
+	/// </summary>
+	/// <param name="output">The buffer.</param>
+	/// <param name="length">Its length.</param>
+	static void generate(byte output[], const size_t length);
+
+};
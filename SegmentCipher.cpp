@@ -0,0 +1,78 @@
+#include "SegmentCipher.h"
+#include "GeneralSecurityException.h"
+#include "Metrics.h"
+#include "misc.h"
+#include <cstring>
+
+
+SegmentCipher::SegmentCipher(const CryptoPP::SecByteBlock &key, const byte suite, const byte noncePrefix[], const std::vector<byte> &headerAad, const uint64_t workload)
+	:aead(CipherSuite::create(suite, key, workload)), headerAad(headerAad)
+{
+	std::memcpy(this->noncePrefix, noncePrefix, SegmentCipher::NONCE_PREFIX_LENGTH);
+}
+
+SegmentCipher::~SegmentCipher()
+{
+	CryptoPP::SecureWipeBuffer(noncePrefix, sizeof(noncePrefix));
+}
+
+void SegmentCipher::blockNonce(const uint64_t counter, const byte flag, byte nonce[]) const
+{
+	if (counter >= SegmentCipher::MAX_SEGMENTS) {
+		throw GeneralSecurityException("Segment counter exhausted");
+	}
+
+	// prefix || big-endian counter || block kind
+	std::memcpy(nonce, noncePrefix, SegmentCipher::NONCE_PREFIX_LENGTH);
+	nonce[7] = static_cast<byte>(counter >> 24);
+	nonce[8] = static_cast<byte>(counter >> 16);
+	nonce[9] = static_cast<byte>(counter >> 8);
+	nonce[10] = static_cast<byte>(counter);
+	nonce[11] = flag;
+}
+
+void SegmentCipher::seal(const byte nonce[], const byte aad[], const size_t aadLength, const byte plaintext[], const size_t length, byte output[])
+{
+	aead->seal(nonce, aad, aadLength, plaintext, length, output);
+}
+
+bool SegmentCipher::open(const byte nonce[], const byte aad[], const size_t aadLength, const byte sealed[], const size_t sealedLength, byte output[])
+{
+	if (sealedLength < SegmentCipher::TAG_LENGTH) return false;
+
+	return aead->open(nonce, aad, aadLength, sealed, sealedLength - SegmentCipher::TAG_LENGTH, output);
+}
+
+void SegmentCipher::sealSegment(const uint64_t counter, const bool last, const byte plaintext[], const size_t length, byte output[])
+{
+	byte nonce[SegmentCipher::NONCE_LENGTH];
+	blockNonce(counter, last ? SegmentCipher::LAST_SEGMENT : SegmentCipher::SEGMENT, nonce);
+	Metrics::Timer timer(Metrics::CIPHER, length);
+	seal(nonce, headerAad.data(), headerAad.size(), plaintext, length, output);
+}
+
+bool SegmentCipher::openSegment(const uint64_t counter, const bool last, const byte sealed[], const size_t sealedLength, byte output[])
+{
+	byte nonce[SegmentCipher::NONCE_LENGTH];
+	blockNonce(counter, last ? SegmentCipher::LAST_SEGMENT : SegmentCipher::SEGMENT, nonce);
+	Metrics::Timer timer(Metrics::CIPHER, sealedLength);
+	return open(nonce, headerAad.data(), headerAad.size(), sealed, sealedLength, output);
+}
+
+void SegmentCipher::sealIndexPage(const uint64_t page, const byte aad[], const size_t aadLength, const byte plaintext[], const size_t length, byte output[])
+{
+	byte nonce[SegmentCipher::NONCE_LENGTH];
+	blockNonce(page, SegmentCipher::INDEX_PAGE, nonce);
+	std::vector<byte> pageAad(headerAad);
+	pageAad.insert(pageAad.end(), aad, aad + aadLength);
+	seal(nonce, pageAad.data(), pageAad.size(), plaintext, length, output);
+}
+
+bool SegmentCipher::openIndexPage(const uint64_t page, const byte aad[], const size_t aadLength, const byte sealed[], const size_t sealedLength, byte output[])
+{
+	byte nonce[SegmentCipher::NONCE_LENGTH];
+	blockNonce(page, SegmentCipher::INDEX_PAGE, nonce);
+	std::vector<byte> pageAad(headerAad);
+	pageAad.insert(pageAad.end(), aad, aad + aadLength);
+	return open(nonce, pageAad.data(), pageAad.size(), sealed, sealedLength, output);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include "secblock.h"
+#include "CipherSuite.h"
+
+typedef unsigned char byte;
+
+/// <summary>
+/// Seals and opens the segments of a streamed file using the STREAM construction by Hoang, Reyhanitabar,
+/// Rogaway and Vizar. Every segment is encrypted with its own nonce and carries its own tag. The nonce is
+/// the per-file random prefix, followed by the big-endian segment counter and a flag marking the last segment,
+/// so segments cannot be reordered, dropped or appended without failing authentication. The pages of the
+/// segment index use the same prefix and counter with their own flag, so they never share a nonce with a segment.
+/// Every block is bound to the authenticated part of the file header. The AEAD is the one of the file's suite,
+/// see <see cref="CipherSuite"/>.
+/// </summary>
+class SegmentCipher
+{
+
+private:
+	std::unique_ptr<CipherSuite::Aead> aead;
+	byte noncePrefix[7];
+	std::vector<byte> headerAad;
+
+	/// <summary>
+	/// Builds the nonce of a block.
+	/// </summary>
+	/// <param name="counter">The block counter.</param>
+	/// <param name="flag">The block kind, see <see cref="SEGMENT"/>, <see cref="LAST_SEGMENT"/> and <see cref="INDEX_PAGE"/>.</param>
+	/// <param name="nonce">Output array of <see cref="NONCE_LENGTH"/> bytes.</param>
+	void blockNonce(const uint64_t counter, const byte flag, byte nonce[]) const;
+
+	/// <summary>
+	/// Encrypts a block with the given nonce. The output receives the ciphertext followed by the tag.
+	/// </summary>
+	void seal(const byte nonce[], const byte aad[], const size_t aadLength, const byte plaintext[], const size_t length, byte output[]);
+
+	/// <summary>
+	/// Decrypts and verifies a block with the given nonce.
+	/// </summary>
+	bool open(const byte nonce[], const byte aad[], const size_t aadLength, const byte sealed[], const size_t sealedLength, byte output[]);
+
+public:
+	const static unsigned int NONCE_PREFIX_LENGTH = 7; //bytes
+	const static unsigned int NONCE_LENGTH = 12; //bytes
+	const static unsigned int TAG_LENGTH = 16; //bytes
+	const static uint64_t MAX_SEGMENTS = 0xFFFFFFFFull;
+
+	// last nonce byte, keeps segments and index pages apart
+	const static byte SEGMENT = 0;
+	const static byte LAST_SEGMENT = 1;
+	const static byte INDEX_PAGE = 2;
+
+	/// <summary>
+	/// Number of segments a plaintext of the given length is split into. An empty plaintext still has one segment.
+	/// </summary>
+	/// <param name="plaintextLength">The plaintext length.</param>
+	/// <param name="segmentSize">The segment size.</param>
+	/// <returns>The number of segments</returns>
+	static uint64_t segmentCount(const uint64_t plaintextLength, const uint32_t segmentSize)
+	{
+		return plaintextLength == 0 ? 1 : (plaintextLength + segmentSize - 1) / segmentSize;
+	}
+
+	/// <summary>
+	/// Initializes a new instance of the <see cref="SegmentCipher"/> class.
+	/// </summary>
+	/// <param name="key">The key.</param>
+	/// <param name="suite">The cipher suite, see <see cref="EncryptedFileHeader::getSuite"/>.</param>
+	/// <param name="noncePrefix">The nonce prefix of <see cref="NONCE_PREFIX_LENGTH"/> bytes.</param>
+	/// <param name="headerAad">The authenticated header fields, authenticated with every segment and index page.</param>
+	/// <param name="workload">Plaintext bytes the instance is expected to process, see <see cref="CipherSuite::useLargeTables"/>.</param>
+	SegmentCipher(const CryptoPP::SecByteBlock &key, const byte suite, const byte noncePrefix[], const std::vector<byte> &headerAad, const uint64_t workload = 0);
+
+	/// <summary>
+	/// Finalizes an instance of the <see cref="SegmentCipher"/> class.
+	/// </summary>
+	~SegmentCipher();
+
+	/// <summary>
+	/// Encrypts one segment. The output receives the ciphertext followed by the tag, i.e.
+	/// <paramref name="length"/> + <see cref="TAG_LENGTH"/> bytes.
+	/// </summary>
+	/// <param name="counter">The nonce counter, the segment index unless the segment index records another one.</param>
+	/// <param name="last">Whether the segment is the last one of the stream.</param>
+	/// <param name="plaintext">The plaintext.</param>
+	/// <param name="length">The plaintext length.</param>
+	/// <param name="output">The output buffer.</param>
+	void sealSegment(const uint64_t counter, const bool last, const byte plaintext[], const size_t length, byte output[]);
+
+	/// <summary>
+	/// Decrypts and verifies one segment.
+	/// </summary>
+	/// <param name="counter">The nonce counter it was sealed under.</param>
+	/// <param name="last">Whether the segment is the last one of the stream.</param>
+	/// <param name="sealed">The ciphertext followed by the tag.</param>
+	/// <param name="sealedLength">Length of the ciphertext plus the tag.</param>
+	/// <param name="output">The output buffer, at least <paramref name="sealedLength"/> - <see cref="TAG_LENGTH"/> bytes.</param>
+	/// <returns>
+	///   <c>true</c> if the segment is authentic; otherwise, <c>false</c>.
+	/// </returns>
+	bool openSegment(const uint64_t counter, const bool last, const byte sealed[], const size_t sealedLength, byte output[]);
+
+	/// <summary>
+	/// Encrypts one page of the segment index. Works like <see cref="sealSegment"/>, with additional authenticated data
+	/// appended to the header fields.
+	/// </summary>
+	/// <param name="page">The nonce counter of the page, see <see cref="SegmentIndex"/>.</param>
+	/// <param name="aad">The additional authenticated data.</param>
+	/// <param name="aadLength">Length of the additional authenticated data.</param>
+	/// <param name="plaintext">The plaintext.</param>
+	/// <param name="length">The plaintext length.</param>
+	/// <param name="output">The output buffer.</param>
+	void sealIndexPage(const uint64_t page, const byte aad[], const size_t aadLength, const byte plaintext[], const size_t length, byte output[]);
+
+	/// <summary>
+	/// Decrypts and verifies one page of the segment index.
+	/// </summary>
+	/// <param name="page">The nonce counter of the page.</param>
+	/// <param name="aad">The additional authenticated data.</param>
+	/// <param name="aadLength">Length of the additional authenticated data.</param>
+	/// <param name="sealed">The ciphertext followed by the tag.</param>
+	/// <param name="sealedLength">Length of the ciphertext plus the tag.</param>
+	/// <param name="output">The output buffer.</param>
+	/// <returns>
+	///   <c>true</c> if the page is authentic; otherwise, <c>false</c>.
+	/// </returns>
+	bool openIndexPage(const uint64_t page, const byte aad[], const size_t aadLength, const byte sealed[], const size_t sealedLength, byte output[]);
+
+};
@@ -0,0 +1,183 @@
+#include "SegmentIndex.h"
+#include "GeneralSecurityException.h"
+#include "Endian.h"
+#include "Metrics.h"
+#include <cstring>
+#include <algorithm>
+
+
+static const byte FOOTER_MAGIC[8] = { 'G', 'C', 'M', 'I', 'N', 'D', 'E', 'X' };
+static const size_t PAGE_AAD_LENGTH = SegmentIndex::FOOTER_LENGTH + 8;
+
+/// <summary>
+/// Encodes the footer.
+/// </summary>
+static void writeFooter(const SegmentIndex::Footer &footer, byte out[])
+{
+	std::memcpy(out, FOOTER_MAGIC, sizeof(FOOTER_MAGIC));
+	endian::storeLE64(out + 8, footer.indexOffset);
+	endian::storeLE64(out + 16, footer.segmentCount);
+	endian::storeLE32(out + 24, footer.entriesPerPage);
+	endian::storeLE32(out + 28, footer.counterBase);
+}
+
+/// <summary>
+/// Length of one encoded entry.
+/// </summary>
+static size_t entryLength(const SegmentIndex::Footer &footer)
+{
+	return footer.counterBase != 0 ? SegmentIndex::COUNTED_ENTRY_LENGTH : SegmentIndex::ENTRY_LENGTH;
+}
+
+/// <summary>
+/// The footer and the plaintext length, authenticated with every page.
+/// </summary>
+static void pageAad(const SegmentIndex::Footer &footer, const uint64_t plaintextLength, byte aad[])
+{
+	writeFooter(footer, aad);
+	endian::storeLE64(aad + SegmentIndex::FOOTER_LENGTH, plaintextLength);
+}
+
+std::vector<SegmentIndex::Entry> SegmentIndex::contiguous(const uint64_t firstOffset, const uint64_t plaintextLength, const uint32_t segmentSize)
+{
+	const uint64_t segmentCount = SegmentCipher::segmentCount(plaintextLength, segmentSize);
+	std::vector<Entry> entries(static_cast<size_t>(segmentCount));
+
+	uint64_t offset = firstOffset;
+	uint64_t remaining = plaintextLength;
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		Entry &entry = entries[i];
+		const uint32_t length = static_cast<uint32_t>(std::min<uint64_t>(remaining, segmentSize));
+		entry.offset = offset;
+		entry.plainLength = length;
+		entry.sealedLength = length + SegmentCipher::TAG_LENGTH;
+		entry.counter = static_cast<uint32_t>(i);
+		offset += entry.sealedLength;
+		remaining -= length;
+	}
+
+	return entries;
+}
+
+std::vector<byte> SegmentIndex::seal(SegmentCipher &cipher, const std::vector<Entry> &entries, const uint64_t indexOffset, const uint64_t plaintextLength, const uint32_t counterBase)
+{
+	const Footer footer = { indexOffset, entries.size(), SegmentIndex::ENTRIES_PER_PAGE, counterBase };
+	const size_t entryLength = ::entryLength(footer);
+	Metrics::Timer timer(Metrics::INDEX, entries.size() * entryLength);
+	byte aad[PAGE_AAD_LENGTH];
+	pageAad(footer, plaintextLength, aad);
+
+	std::vector<byte> sealed(static_cast<size_t>(SegmentIndex::sealedLength(footer)));
+	std::vector<byte> page(static_cast<size_t>(SegmentIndex::ENTRIES_PER_PAGE) * entryLength);
+	const uint64_t pages = SegmentIndex::pageCount(entries.size());
+
+	byte *out = sealed.data();
+	for (uint64_t p = 0; p < pages; ++p)
+	{
+		const size_t first = static_cast<size_t>(p * SegmentIndex::ENTRIES_PER_PAGE);
+		const size_t count = std::min<size_t>(entries.size() - first, SegmentIndex::ENTRIES_PER_PAGE);
+		for (size_t i = 0; i < count; ++i)
+		{
+			byte *entry = page.data() + i * entryLength;
+			endian::storeLE64(entry, entries[first + i].offset);
+			endian::storeLE32(entry + 8, entries[first + i].sealedLength);
+			endian::storeLE32(entry + 12, entries[first + i].plainLength);
+			if (counterBase != 0) endian::storeLE32(entry + 16, entries[first + i].counter);
+		}
+
+		const size_t length = count * entryLength;
+		cipher.sealIndexPage(counterBase + p, aad, sizeof(aad), page.data(), length, out);
+		out += length + SegmentCipher::TAG_LENGTH;
+	}
+
+	writeFooter(footer, out);
+	return sealed;
+}
+
+SegmentIndex::Footer SegmentIndex::readFooter(const byte footer[])
+{
+	if (std::memcmp(footer, FOOTER_MAGIC, sizeof(FOOTER_MAGIC)) != 0) {
+		throw GeneralSecurityException("Segment index footer not found");
+	}
+
+	Footer decoded;
+	decoded.indexOffset = endian::loadLE64(footer + 8);
+	decoded.segmentCount = endian::loadLE64(footer + 16);
+	decoded.entriesPerPage = endian::loadLE32(footer + 24);
+	decoded.counterBase = endian::loadLE32(footer + 28);
+
+	if (decoded.entriesPerPage == 0 || decoded.entriesPerPage > SegmentIndex::MAX_ENTRIES_PER_PAGE
+		|| decoded.segmentCount == 0 || decoded.segmentCount > SegmentCipher::MAX_SEGMENTS
+		|| SegmentIndex::nextCounter(decoded) > SegmentCipher::MAX_SEGMENTS + 1) {
+		throw GeneralSecurityException("Segment index footer is malformed");
+	}
+
+	return decoded;
+}
+
+uint64_t SegmentIndex::pageOffset(const Footer &footer, const uint64_t page)
+{
+	return footer.indexOffset + page * (static_cast<uint64_t>(footer.entriesPerPage) * entryLength(footer) + SegmentCipher::TAG_LENGTH);
+}
+
+size_t SegmentIndex::sealedPageLength(const Footer &footer, const uint64_t page)
+{
+	const uint64_t first = page * footer.entriesPerPage;
+	const uint64_t count = std::min<uint64_t>(footer.segmentCount - first, footer.entriesPerPage);
+	return static_cast<size_t>(count * entryLength(footer) + SegmentCipher::TAG_LENGTH);
+}
+
+std::vector<SegmentIndex::Entry> SegmentIndex::openPage(SegmentCipher &cipher, const Footer &footer, const uint64_t plaintextLength, const uint64_t page, const byte sealed[])
+{
+	byte aad[PAGE_AAD_LENGTH];
+	pageAad(footer, plaintextLength, aad);
+
+	const size_t sealedLength = SegmentIndex::sealedPageLength(footer, page);
+	Metrics::Timer timer(Metrics::INDEX, sealedLength);
+	std::vector<byte> plain(sealedLength - SegmentCipher::TAG_LENGTH);
+	if (!cipher.openIndexPage(footer.counterBase + page, aad, sizeof(aad), sealed, sealedLength, plain.data())) {
+		throw GeneralSecurityException("Segment index page " + std::to_string(page) + " failed authentication");
+	}
+
+	const size_t entryLength = ::entryLength(footer);
+	std::vector<Entry> entries(plain.size() / entryLength);
+	for (size_t i = 0; i < entries.size(); ++i)
+	{
+		const byte *entry = plain.data() + i * entryLength;
+		entries[i].offset = endian::loadLE64(entry);
+		entries[i].sealedLength = endian::loadLE32(entry + 8);
+		entries[i].plainLength = endian::loadLE32(entry + 12);
+		entries[i].counter = footer.counterBase != 0 ? endian::loadLE32(entry + 16)
+			: static_cast<uint32_t>(page * footer.entriesPerPage + i);
+		if (footer.counterBase != 0 && entries[i].counter >= footer.counterBase) {
+			throw GeneralSecurityException("Segment index page " + std::to_string(page) + " is malformed");
+		}
+	}
+
+	return entries;
+}
+
+std::vector<SegmentIndex::Entry> SegmentIndex::open(SegmentCipher &cipher, const byte sealed[], const size_t sealedLength, const uint64_t indexOffset, const uint64_t plaintextLength)
+{
+	if (sealedLength < SegmentIndex::FOOTER_LENGTH) {
+		throw GeneralSecurityException("Segment index is truncated");
+	}
+
+	const Footer footer = SegmentIndex::readFooter(sealed + sealedLength - SegmentIndex::FOOTER_LENGTH);
+	if (footer.indexOffset != indexOffset || SegmentIndex::sealedLength(footer) != sealedLength) {
+		throw GeneralSecurityException("Segment index does not match its location");
+	}
+
+	std::vector<Entry> entries;
+	entries.reserve(static_cast<size_t>(footer.segmentCount));
+	const uint64_t pages = SegmentIndex::pageCount(footer.segmentCount, footer.entriesPerPage);
+	for (uint64_t p = 0; p < pages; ++p)
+	{
+		const std::vector<Entry> page = SegmentIndex::openPage(cipher, footer, plaintextLength, p,
+			sealed + (SegmentIndex::pageOffset(footer, p) - footer.indexOffset));
+		entries.insert(entries.end(), page.begin(), page.end());
+	}
+
+	return entries;
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "SegmentCipher.h"
+
+/// <summary>
+/// The segment index at the end of a streamed file. It records where every segment is stored, so a range of
+/// the plaintext can be decrypted without touching the segments around it. The entries are encrypted in pages of
+/// <see cref="ENTRIES_PER_PAGE"/>, each with its own tag, so a lookup only reads and verifies one page.
+/// The index is followed by a fixed-size footer that locates it:
+///
+///   magic (8) | index offset (8) | segment count (8) | entries per page (4) | counter base (4)
+///
+/// The footer is bound to every page as additional authenticated data, together with the plaintext length.
+///
+/// A file written in one go seals segment i and index page p under nonce counters i and p, and has a counter base
+/// of 0. Once segments were rewritten in place, every rewrite must use a counter never used before, so the index
+/// records the counter of each segment (<see cref="COUNTED_ENTRY_LENGTH"/> byte entries), the pages are sealed under
+/// counter base + p, and all counters used so far lie below counter base + page count.
+/// </summary>
+class SegmentIndex
+{
+
+public:
+	const static unsigned int ENTRY_LENGTH = 16; //bytes
+	const static unsigned int COUNTED_ENTRY_LENGTH = 20; //bytes
+	const static unsigned int ENTRIES_PER_PAGE = 4096;
+	const static unsigned int MAX_ENTRIES_PER_PAGE = 1 << 20;
+	const static unsigned int FOOTER_LENGTH = 32; //bytes
+
+	/// <summary>
+	/// Location of one segment, and the nonce counter it was sealed under. Entries compare equal when they
+	/// locate the same bytes, whatever their counter.
+	/// </summary>
+	struct Entry {
+		uint64_t offset;
+		uint32_t sealedLength;
+		uint32_t plainLength;
+		uint32_t counter;
+
+		bool operator==(const Entry &other) const
+		{
+			return offset == other.offset && sealedLength == other.sealedLength && plainLength == other.plainLength;
+		}
+		bool operator!=(const Entry &other) const { return !(*this == other); }
+	};
+
+	/// <summary>
+	/// The decoded footer.
+	/// </summary>
+	struct Footer {
+		uint64_t indexOffset;
+		uint64_t segmentCount;
+		uint32_t entriesPerPage;
+		/// <summary>Nonce counter of the first index page, 0 if every counter is the segment or page number.</summary>
+		uint32_t counterBase;
+	};
+
+	/// <summary>
+	/// Number of index pages.
+	/// </summary>
+	/// <param name="segmentCount">Number of segments.</param>
+	/// <param name="entriesPerPage">Number of entries per page.</param>
+	/// <returns>The number of pages</returns>
+	static uint64_t pageCount(const uint64_t segmentCount, const uint32_t entriesPerPage = ENTRIES_PER_PAGE)
+	{
+		return (segmentCount + entriesPerPage - 1) / entriesPerPage;
+	}
+
+	/// <summary>
+	/// Length of the encrypted index plus the footer.
+	/// </summary>
+	/// <param name="segmentCount">Number of segments.</param>
+	/// <param name="entriesPerPage">Number of entries per page.</param>
+	/// <param name="counted">Whether the entries record their nonce counter.</param>
+	/// <returns>The length in bytes</returns>
+	static uint64_t sealedLength(const uint64_t segmentCount, const uint32_t entriesPerPage = ENTRIES_PER_PAGE, const bool counted = false)
+	{
+		return segmentCount * (counted ? COUNTED_ENTRY_LENGTH : ENTRY_LENGTH) + pageCount(segmentCount, entriesPerPage) * SegmentCipher::TAG_LENGTH + FOOTER_LENGTH;
+	}
+
+	/// <summary>
+	/// Length of the encrypted index described by a footer, plus the footer.
+	/// </summary>
+	/// <param name="footer">The footer.</param>
+	/// <returns>The length in bytes</returns>
+	static uint64_t sealedLength(const Footer &footer)
+	{
+		return sealedLength(footer.segmentCount, footer.entriesPerPage, footer.counterBase != 0);
+	}
+
+	/// <summary>
+	/// The first nonce counter not used by the segments and pages of an index yet.
+	/// </summary>
+	/// <param name="footer">The footer.</param>
+	/// <returns>The counter</returns>
+	static uint64_t nextCounter(const Footer &footer)
+	{
+		return footer.counterBase != 0 ? footer.counterBase + pageCount(footer.segmentCount, footer.entriesPerPage) : footer.segmentCount;
+	}
+
+	/// <summary>
+	/// Builds the entries of segments stored back to back, each one sealed with a tag.
+	/// </summary>
+	/// <param name="firstOffset">File offset of the first segment.</param>
+	/// <param name="plaintextLength">The plaintext length.</param>
+	/// <param name="segmentSize">The segment size.</param>
+	/// <returns>The entries</returns>
+	static std::vector<Entry> contiguous(const uint64_t firstOffset, const uint64_t plaintextLength, const uint32_t segmentSize);
+
+	/// <summary>
+	/// Encrypts the index and appends the footer.
+	/// </summary>
+	/// <param name="cipher">The cipher of the file.</param>
+	/// <param name="entries">One entry per segment.</param>
+	/// <param name="indexOffset">File offset the index will be written at.</param>
+	/// <param name="plaintextLength">The plaintext length.</param>
+	/// <param name="counterBase">Nonce counter of the first page, above every segment counter. 0 if every segment
+	/// counter is the segment number.</param>
+	/// <returns><see cref="sealedLength"/> bytes</returns>
+	static std::vector<byte> seal(SegmentCipher &cipher, const std::vector<Entry> &entries, const uint64_t indexOffset, const uint64_t plaintextLength, const uint32_t counterBase = 0);
+
+	/// <summary>
+	/// Decodes a footer. Throws a <see cref="GeneralSecurityException"/> if it is malformed.
+	/// </summary>
+	/// <param name="footer"><see cref="FOOTER_LENGTH"/> bytes.</param>
+	/// <returns>The footer</returns>
+	static Footer readFooter(const byte footer[]);
+
+	/// <summary>
+	/// File offset of an index page.
+	/// </summary>
+	/// <param name="footer">The footer.</param>
+	/// <param name="page">The page number.</param>
+	/// <returns>The offset</returns>
+	static uint64_t pageOffset(const Footer &footer, const uint64_t page);
+
+	/// <summary>
+	/// Length of an encrypted index page, including its tag.
+	/// </summary>
+	/// <param name="footer">The footer.</param>
+	/// <param name="page">The page number.</param>
+	/// <returns>The length in bytes</returns>
+	static size_t sealedPageLength(const Footer &footer, const uint64_t page);
+
+	/// <summary>
+	/// Decrypts and verifies an index page. Throws a <see cref="GeneralSecurityException"/> if it is not authentic.
+	/// </summary>
+	/// <param name="cipher">The cipher of the file.</param>
+	/// <param name="footer">The footer.</param>
+	/// <param name="plaintextLength">The plaintext length from the header.</param>
+	/// <param name="page">The page number.</param>
+	/// <param name="sealed"><see cref="sealedPageLength"/> bytes.</param>
+	/// <returns>The entries of the page</returns>
+	static std::vector<Entry> openPage(SegmentCipher &cipher, const Footer &footer, const uint64_t plaintextLength, const uint64_t page, const byte sealed[]);
+
+	/// <summary>
+	/// Decrypts and verifies a whole index. Throws a <see cref="GeneralSecurityException"/> if it is not authentic,
+	/// or not located at <paramref name="indexOffset"/>. The footer is decoded from the end of <paramref name="sealed"/>.
+	/// </summary>
+	/// <param name="cipher">The cipher of the file.</param>
+	/// <param name="sealed">The encrypted index followed by the footer.</param>
+	/// <param name="sealedLength">Length of the encrypted index plus the footer.</param>
+	/// <param name="indexOffset">File offset the index was read from.</param>
+	/// <param name="plaintextLength">The plaintext length from the header.</param>
+	/// <returns>One entry per segment</returns>
+	static std::vector<Entry> open(SegmentCipher &cipher, const byte sealed[], const size_t sealedLength, const uint64_t indexOffset, const uint64_t plaintextLength);
+
+};
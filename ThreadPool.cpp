@@ -0,0 +1,103 @@
+#include "ThreadPool.h"
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <algorithm>
+
+
+ThreadPool::ThreadPool(unsigned int threadCount)
+	:stopping(false)
+{
+	if (threadCount == 0) threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	workers.reserve(threadCount);
+	for (unsigned int i = 0; i < threadCount; ++i)
+	{
+		workers.emplace_back(&ThreadPool::workerLoop, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	taskAvailable.notify_all();
+
+	for (auto &worker : workers) worker.join();
+}
+
+void ThreadPool::submit(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		tasks.push_back(std::move(task));
+	}
+	taskAvailable.notify_one();
+}
+
+void ThreadPool::workerLoop()
+{
+	for (;;)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			taskAvailable.wait(lock, [this] { return stopping || !tasks.empty(); });
+			if (tasks.empty()) return;
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
+
+void ThreadPool::parallelFor(const size_t count, const std::function<void(size_t)> &body)
+{
+	if (count == 0) return;
+
+	// shared with the helper tasks, which may only get to run after the caller returned
+	struct State {
+		std::atomic<size_t> next{ 0 };
+		std::atomic<bool> failed{ false };
+		size_t finished = 0;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable allFinished;
+		const std::function<void(size_t)> *body;
+		size_t count;
+	};
+	auto state = std::make_shared<State>();
+	state->body = &body;
+	state->count = count;
+
+	auto run = [state]() {
+		for (;;)
+		{
+			const size_t index = state->next++;
+			if (index >= state->count) return;
+
+			std::exception_ptr error;
+			if (!state->failed) {
+				try { (*state->body)(index); }
+				catch (...) { error = std::current_exception(); }
+			}
+
+			std::lock_guard<std::mutex> lock(state->mutex);
+			if (error && !state->error) {
+				state->error = error;
+				state->failed = true;
+			}
+			if (++state->finished == state->count) state->allFinished.notify_all();
+		}
+	};
+
+	const size_t helpers = std::min<size_t>(workers.size(), count - 1);
+	for (size_t i = 0; i < helpers; ++i) submit(run);
+	run();
+
+	std::unique_lock<std::mutex> lock(state->mutex);
+	state->allFinished.wait(lock, [&state] { return state->finished == state->count; });
+	if (state->error) std::rethrow_exception(state->error);
+}
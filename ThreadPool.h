@@ -0,0 +1,65 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+/// <summary>
+/// A fixed-size pool of worker threads.
+/// </summary>
+class ThreadPool
+{
+
+private:
+	std::vector<std::thread> workers;
+	std::deque<std::function<void()>> tasks;
+	std::mutex mutex;
+	std::condition_variable taskAvailable;
+	bool stopping;
+
+	/// <summary>
+	/// Runs tasks until the pool is stopped.
+	/// </summary>
+	void workerLoop();
+
+public:
+
+	/// <summary>
+	/// Initializes a new instance of the <see cref="ThreadPool"/> class.
+	/// </summary>
+	/// <param name="threadCount">Number of worker threads. 0 means one per hardware thread.</param>
+	explicit ThreadPool(unsigned int threadCount);
+
+	/// <summary>
+	/// Finalizes an instance of the <see cref="ThreadPool"/> class. Queued tasks are finished first.
+	/// </summary>
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	/// <summary>
+	/// Queues a task.
+	/// </summary>
+	/// <param name="task">The task.</param>
+	void submit(std::function<void()> task);
+
+	/// <summary>
+	/// Calls <paramref name="body"/> for every index in [0, count) and blocks until all calls returned.
+	/// The calling thread takes part in the work, so parallelFor can safely be nested inside a task of the same pool.
+	/// If a call throws, no further indices are started and the first exception is rethrown to the caller.
+	/// </summary>
+	/// <param name="count">Number of indices.</param>
+	/// <param name="body">The body.</param>
+	void parallelFor(const size_t count, const std::function<void(size_t)> &body);
+
+	/// <summary>
+	/// Gets the number of worker threads.
+	/// </summary>
+	/// <returns></returns>
+	unsigned int size() const { return static_cast<unsigned int>(workers.size()); }
+
+};
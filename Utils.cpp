@@ -1,5 +1,23 @@
 #include "Utils.h"
+#include "IOException.h"
+#include "Metrics.h"
 #include <fstream>
+#include <algorithm>
+#include <new>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <cerrno>
+#include <cstring>
+#endif
 
 // Logger
 static std::shared_ptr<spdlog::logger> LOG = spdlog::stdout_color_mt("FileUtils");
@@ -16,6 +34,7 @@ std::vector<unsigned char> fileUtils::ReadAllBytes(char const * filename)
 	{
 		ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
 		std::ifstream::pos_type pos = ifs.tellg();
+		Metrics::Timer timer(Metrics::READ, static_cast<uint64_t>(pos));
 		std::vector<unsigned char>  result(pos);
 		ifs.seekg(0, std::ios::beg);
 		ifs.read(reinterpret_cast<char*>(&result[0]), pos);
@@ -30,15 +49,16 @@ std::vector<unsigned char> fileUtils::ReadAllBytes(char const * filename)
 }
 
 
-void fileUtils::WriteAllBytes(char const * filename, std::vector<unsigned char> data)
+void fileUtils::WriteAllBytes(char const * filename, const std::vector<unsigned char> &data)
 {
 
+	Metrics::Timer timer(Metrics::WRITE, data.size());
 	std::ofstream ofs(filename, std::ios::binary);
 
 	try
 	{
 		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
-		ofs.write(reinterpret_cast<char*>(data.data()), data.size());
+		ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
 		ofs.close();
 
 	}
@@ -51,6 +71,7 @@ void fileUtils::WriteAllBytes(char const * filename, std::vector<unsigned char>
 
 std::vector<filesystem::path> fileUtils::ListFilesInDirRecursively(const char filename[])
 {
+	Metrics::Timer timer(Metrics::LIST);
 	std::vector<filesystem::path> files;
 
 	filesystem::path filePath = filename;
@@ -71,6 +92,7 @@ std::vector<filesystem::path> fileUtils::ListFilesInDirRecursively(const char fi
 
 std::vector<filesystem::path> fileUtils::ListFilesInDir(const char filename[])
 {
+	Metrics::Timer timer(Metrics::LIST);
 	std::vector<filesystem::path> files;
 
 	filesystem::path filePath = filename;
@@ -89,3 +111,411 @@ std::vector<filesystem::path> fileUtils::ListFilesInDir(const char filename[])
 }
 
 
+
+fileUtils::AlignedBuffer::AlignedBuffer(const size_t size)
+	:address(nullptr), length(size)
+{
+#ifdef _WIN32
+	address = static_cast<unsigned char*>(_aligned_malloc(size, ALIGNMENT));
+#else
+	void *allocated = nullptr;
+	if (::posix_memalign(&allocated, ALIGNMENT, size) == 0) address = static_cast<unsigned char*>(allocated);
+#endif
+	if (!address) throw std::bad_alloc();
+}
+
+fileUtils::AlignedBuffer::~AlignedBuffer()
+{
+#ifdef _WIN32
+	_aligned_free(address);
+#else
+	::free(address);
+#endif
+}
+
+fileUtils::AlignedBufferPool::Lease::Lease(AlignedBufferPool &pool)
+	:pool(pool)
+{
+	{
+		std::lock_guard<std::mutex> lock(pool.mutex);
+		if (!pool.buffers.empty()) {
+			buffer = std::move(pool.buffers.back());
+			pool.buffers.pop_back();
+		}
+	}
+	if (!buffer) buffer.reset(new AlignedBuffer(pool.bufferSize));
+}
+
+fileUtils::AlignedBufferPool::Lease::~Lease()
+{
+	std::lock_guard<std::mutex> lock(pool.mutex);
+	pool.buffers.push_back(std::move(buffer));
+}
+
+
+#ifdef _WIN32
+
+fileUtils::RandomAccessFile::RandomAccessFile(const std::string & filename, const Mode mode, const bool direct)
+	:filename(filename), direct(direct)
+{
+	handle = CreateFileA(filename.c_str(), mode == READ ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+		mode == WRITE ? CREATE_ALWAYS : OPEN_EXISTING, direct ? FILE_FLAG_NO_BUFFERING | FILE_FLAG_WRITE_THROUGH : FILE_ATTRIBUTE_NORMAL, nullptr);
+	// e.g. a network share that does not take unbuffered handles
+	if (handle == INVALID_HANDLE_VALUE && direct && GetLastError() == ERROR_INVALID_PARAMETER) {
+		handle = CreateFileA(filename.c_str(), mode == READ ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+			mode == WRITE ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		this->direct = false;
+	}
+	if (handle == INVALID_HANDLE_VALUE) {
+		throw IOException("Could not open " + filename);
+	}
+}
+
+fileUtils::RandomAccessFile::~RandomAccessFile()
+{
+	CloseHandle(handle);
+}
+
+void fileUtils::RandomAccessFile::readAt(const uint64_t offset, unsigned char * buffer, const size_t length) const
+{
+	Metrics::Timer timer(Metrics::READ, length);
+	size_t done = 0;
+	while (done < length)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = static_cast<DWORD>(offset + done);
+		overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+		DWORD chunk = static_cast<DWORD>(std::min<size_t>(length - done, 1u << 30));
+		DWORD read = 0;
+		if (!ReadFile(handle, buffer + done, chunk, &read, &overlapped) || read == 0) {
+			throw IOException("Could not read " + filename + " at offset " + std::to_string(offset + done));
+		}
+		done += read;
+	}
+}
+
+size_t fileUtils::RandomAccessFile::readAvailableAt(const uint64_t offset, unsigned char * buffer, const size_t length) const
+{
+	Metrics::Timer timer(Metrics::READ, length);
+	size_t done = 0;
+	while (done < length)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = static_cast<DWORD>(offset + done);
+		overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+		DWORD chunk = static_cast<DWORD>(std::min<size_t>(length - done, 1u << 30));
+		DWORD read = 0;
+		if (!ReadFile(handle, buffer + done, chunk, &read, &overlapped)) {
+			if (GetLastError() == ERROR_HANDLE_EOF) break;
+			throw IOException("Could not read " + filename + " at offset " + std::to_string(offset + done));
+		}
+		done += read;
+		// unbuffered reads continue at aligned offsets only, a short one is the end of the file
+		if (read < chunk) break;
+	}
+	return done;
+}
+
+void fileUtils::RandomAccessFile::writeAt(const uint64_t offset, const unsigned char * buffer, const size_t length)
+{
+	Metrics::Timer timer(Metrics::WRITE, length);
+	size_t done = 0;
+	while (done < length)
+	{
+		OVERLAPPED overlapped = {};
+		overlapped.Offset = static_cast<DWORD>(offset + done);
+		overlapped.OffsetHigh = static_cast<DWORD>((offset + done) >> 32);
+		DWORD chunk = static_cast<DWORD>(std::min<size_t>(length - done, 1u << 30));
+		DWORD written = 0;
+		if (!WriteFile(handle, buffer + done, chunk, &written, &overlapped)) {
+			throw IOException("Could not write " + filename + " at offset " + std::to_string(offset + done));
+		}
+		done += written;
+	}
+}
+
+uint64_t fileUtils::RandomAccessFile::size() const
+{
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(handle, &size)) {
+		throw IOException("Could not get size of " + filename);
+	}
+	return static_cast<uint64_t>(size.QuadPart);
+}
+
+void fileUtils::RandomAccessFile::resize(const uint64_t size)
+{
+	LARGE_INTEGER position;
+	position.QuadPart = static_cast<LONGLONG>(size);
+	if (!SetFilePointerEx(handle, position, nullptr, FILE_BEGIN) || !SetEndOfFile(handle)) {
+		throw IOException("Could not resize " + filename);
+	}
+}
+
+void fileUtils::RandomAccessFile::allocate(const uint64_t size)
+{
+	// setting the end of file allocates the clusters up to it
+	resize(size);
+}
+
+void fileUtils::RandomAccessFile::sync()
+{
+	if (!FlushFileBuffers(handle)) {
+		throw IOException("Could not sync " + filename);
+	}
+}
+
+fileUtils::MappedFile::MappedFile(const std::string & filename)
+	:filename(filename), address(nullptr), length(0), file(INVALID_HANDLE_VALUE), mapping(nullptr)
+{
+	file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		throw IOException("Could not open " + filename);
+	}
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		release();
+		throw IOException("Could not get size of " + filename);
+	}
+	length = static_cast<uint64_t>(size.QuadPart);
+	// empty files cannot be mapped
+	if (length == 0) return;
+
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	address = mapping ? static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+	if (address == nullptr) {
+		release();
+		throw IOException("Could not map " + filename);
+	}
+}
+
+fileUtils::MappedFile::MappedFile(const std::string & filename, const uint64_t size)
+	:filename(filename), address(nullptr), length(size), file(INVALID_HANDLE_VALUE), mapping(nullptr)
+{
+	file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		throw IOException("Could not open " + filename);
+	}
+	if (length == 0) return;
+
+	// mapping a file larger than its size extends it
+	mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(length >> 32), static_cast<DWORD>(length), nullptr);
+	address = mapping ? static_cast<unsigned char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0)) : nullptr;
+	if (address == nullptr) {
+		release();
+		throw IOException("Could not map " + filename);
+	}
+}
+
+void fileUtils::MappedFile::release()
+{
+	if (address) UnmapViewOfFile(address);
+	if (mapping) CloseHandle(mapping);
+	if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+	address = nullptr;
+	mapping = nullptr;
+	file = INVALID_HANDLE_VALUE;
+}
+
+void fileUtils::MappedFile::flush()
+{
+	if (address && !FlushViewOfFile(address, 0)) {
+		throw IOException("Could not flush " + filename);
+	}
+}
+
+fileUtils::MappedFile::~MappedFile()
+{
+	release();
+}
+
+#else
+
+fileUtils::RandomAccessFile::RandomAccessFile(const std::string & filename, const Mode mode, const bool direct)
+	:filename(filename), direct(direct)
+{
+	int flags = mode == READ ? O_RDONLY : mode == UPDATE ? O_RDWR : O_RDWR | O_CREAT | O_TRUNC;
+#ifdef O_DIRECT
+	fd = ::open(filename.c_str(), direct ? flags | O_DIRECT : flags, 0644);
+	// e.g. tmpfs, which has no page cache to bypass
+	if (fd < 0 && direct && errno == EINVAL) {
+		fd = ::open(filename.c_str(), flags, 0644);
+		this->direct = false;
+	}
+#else
+	fd = ::open(filename.c_str(), flags, 0644);
+#ifdef F_NOCACHE
+	if (fd >= 0 && direct && ::fcntl(fd, F_NOCACHE, 1) != 0) this->direct = false;
+#else
+	this->direct = false;
+#endif
+#endif
+	if (fd < 0) {
+		throw IOException("Could not open " + filename + " : " + std::strerror(errno));
+	}
+}
+
+fileUtils::RandomAccessFile::~RandomAccessFile()
+{
+	::close(fd);
+}
+
+void fileUtils::RandomAccessFile::readAt(const uint64_t offset, unsigned char * buffer, const size_t length) const
+{
+	Metrics::Timer timer(Metrics::READ, length);
+	size_t done = 0;
+	while (done < length)
+	{
+		const ssize_t read = ::pread(fd, buffer + done, length - done, static_cast<off_t>(offset + done));
+		if (read < 0 && errno == EINTR) continue;
+		if (read <= 0) {
+			throw IOException("Could not read " + filename + " at offset " + std::to_string(offset + done));
+		}
+		done += static_cast<size_t>(read);
+	}
+}
+
+size_t fileUtils::RandomAccessFile::readAvailableAt(const uint64_t offset, unsigned char * buffer, const size_t length) const
+{
+	Metrics::Timer timer(Metrics::READ, length);
+	size_t done = 0;
+	while (done < length)
+	{
+		const ssize_t read = ::pread(fd, buffer + done, length - done, static_cast<off_t>(offset + done));
+		if (read < 0 && errno == EINTR) continue;
+		if (read < 0) {
+			throw IOException("Could not read " + filename + " at offset " + std::to_string(offset + done) + " : " + std::strerror(errno));
+		}
+		const size_t requested = length - done;
+		done += static_cast<size_t>(read);
+		// direct reads continue at aligned offsets only, a short one is the end of the file
+		if (read == 0 || (direct && static_cast<size_t>(read) < requested)) break;
+	}
+	return done;
+}
+
+void fileUtils::RandomAccessFile::writeAt(const uint64_t offset, const unsigned char * buffer, const size_t length)
+{
+	Metrics::Timer timer(Metrics::WRITE, length);
+	size_t done = 0;
+	while (done < length)
+	{
+		const ssize_t written = ::pwrite(fd, buffer + done, length - done, static_cast<off_t>(offset + done));
+		if (written < 0 && errno == EINTR) continue;
+		if (written < 0) {
+			throw IOException("Could not write " + filename + " at offset " + std::to_string(offset + done) + " : " + std::strerror(errno));
+		}
+		done += static_cast<size_t>(written);
+	}
+}
+
+uint64_t fileUtils::RandomAccessFile::size() const
+{
+	struct stat info;
+	if (::fstat(fd, &info) != 0) {
+		throw IOException("Could not get size of " + filename);
+	}
+	return static_cast<uint64_t>(info.st_size);
+}
+
+void fileUtils::RandomAccessFile::resize(const uint64_t size)
+{
+	if (::ftruncate(fd, static_cast<off_t>(size)) != 0) {
+		throw IOException("Could not resize " + filename + " : " + std::strerror(errno));
+	}
+}
+
+void fileUtils::RandomAccessFile::allocate(const uint64_t size)
+{
+	if (size == 0) return;
+	int error = ::posix_fallocate(fd, 0, static_cast<off_t>(size));
+	// file systems without fallocate support still get a file of the right size
+	if (error == EINVAL || error == EOPNOTSUPP) error = ::ftruncate(fd, static_cast<off_t>(size)) == 0 ? 0 : errno;
+	if (error != 0) {
+		throw IOException("Could not allocate " + filename + " : " + std::strerror(error));
+	}
+}
+
+void fileUtils::RandomAccessFile::sync()
+{
+	if (::fsync(fd) != 0) {
+		throw IOException("Could not sync " + filename + " : " + std::strerror(errno));
+	}
+}
+
+fileUtils::MappedFile::MappedFile(const std::string & filename)
+	:filename(filename), address(nullptr), length(0), fd(-1)
+{
+	fd = ::open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw IOException("Could not open " + filename + " : " + std::strerror(errno));
+	}
+
+	struct stat info;
+	if (::fstat(fd, &info) != 0) {
+		release();
+		throw IOException("Could not get size of " + filename);
+	}
+	length = static_cast<uint64_t>(info.st_size);
+	// empty files cannot be mapped
+	if (length == 0) return;
+
+	void *mapped = ::mmap(nullptr, static_cast<size_t>(length), PROT_READ, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+		release();
+		throw IOException("Could not map " + filename + " : " + std::strerror(errno));
+	}
+	address = static_cast<unsigned char*>(mapped);
+	::madvise(address, static_cast<size_t>(length), MADV_SEQUENTIAL);
+}
+
+fileUtils::MappedFile::MappedFile(const std::string & filename, const uint64_t size)
+	:filename(filename), address(nullptr), length(size), fd(-1)
+{
+	fd = ::open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		throw IOException("Could not open " + filename + " : " + std::strerror(errno));
+	}
+	if (length == 0) return;
+
+	// allocate the blocks now, a full disk would otherwise raise SIGBUS on the first write to the mapping
+	int error = ::posix_fallocate(fd, 0, static_cast<off_t>(length));
+	// file systems without fallocate support still get a file of the right size
+	if (error == EINVAL || error == EOPNOTSUPP) error = ::ftruncate(fd, static_cast<off_t>(length)) == 0 ? 0 : errno;
+	if (error != 0) {
+		release();
+		throw IOException("Could not allocate " + filename + " : " + std::strerror(error));
+	}
+
+	void *mapped = ::mmap(nullptr, static_cast<size_t>(length), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+		release();
+		throw IOException("Could not map " + filename + " : " + std::strerror(errno));
+	}
+	address = static_cast<unsigned char*>(mapped);
+	::madvise(address, static_cast<size_t>(length), MADV_SEQUENTIAL);
+}
+
+void fileUtils::MappedFile::release()
+{
+	if (address) ::munmap(address, static_cast<size_t>(length));
+	if (fd >= 0) ::close(fd);
+	address = nullptr;
+	fd = -1;
+}
+
+void fileUtils::MappedFile::flush()
+{
+	// like closing a stream, this does not wait for the disk
+	if (address && ::msync(address, static_cast<size_t>(length), MS_ASYNC) != 0) {
+		throw IOException("Could not flush " + filename + " : " + std::strerror(errno));
+	}
+}
+
+fileUtils::MappedFile::~MappedFile()
+{
+	release();
+}
+
+#endif
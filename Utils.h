@@ -1,5 +1,9 @@
 #pragma once
 #include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <cstdint>
 #include <experimental/filesystem>
 #include "spdlog/spdlog.h"
 
@@ -8,6 +12,20 @@ namespace fileUtils {
 
 	namespace filesystem = std::experimental::filesystem::v1;
 
+	/// <summary>
+	/// How file contents are moved between the disk and the cipher.
+	/// </summary>
+	enum class IoBackend {
+		/// <summary>std::ifstream/std::ofstream and positional reads and writes into buffers.</summary>
+		STREAM,
+		/// <summary>Read-only input mappings and preallocated output mappings the cipher works on directly.</summary>
+		MMAP,
+		/// <summary>Asynchronous positional reads and writes with many requests in flight across files, see <see cref="AsyncIo"/>.</summary>
+		ASYNC,
+		/// <summary>Unbuffered reads and writes of aligned blocks that bypass the page cache, into preallocated outputs.</summary>
+		DIRECT
+	};
+
 	/// <summary>
 	/// Read data from file and return it as a vector. If an 
 	/// I/O error occurs, the function returns a empty vector.
@@ -22,7 +40,7 @@ namespace fileUtils {
 	/// <param name="filename">File location</param>
 	/// <param name="data">Data to write</param>
 	/// <returns></returns>
-	void WriteAllBytes(char const* filename, std::vector<unsigned char> data);
+	void WriteAllBytes(char const* filename, const std::vector<unsigned char> &data);
 
 	/// <summary>
 	/// List all files in directory and all subdirectories
@@ -38,5 +56,259 @@ namespace fileUtils {
 	/// <returns>A vector of paths</returns>
 	std::vector<filesystem::path> ListFilesInDir(const char filename[]);
 
-}
+	/// <summary>
+	/// A file that is read and written at explicit offsets. Reads and writes do not move a shared
+	/// file position, so one instance can be used by several threads at once. Errors throw an <see cref="IOException"/>.
+	/// </summary>
+	class RandomAccessFile
+	{
+
+	private:
+		std::string filename;
+#ifdef _WIN32
+		void *handle;
+#else
+		int fd;
+#endif
+
+		bool direct;
+
+	public:
+		enum Mode { READ, WRITE, UPDATE };
+
+		/// <summary>
+		/// Opens a file. <see cref="WRITE"/> creates the file, or truncates it if it exists. <see cref="UPDATE"/> opens
+		/// an existing file for reading and writing. A direct file bypasses the page cache (O_DIRECT, F_NOCACHE or
+		/// FILE_FLAG_NO_BUFFERING); its offsets, lengths and buffers must then be multiples of
+		/// <see cref="AlignedBuffer::ALIGNMENT"/>. File systems that do not support it get a buffered file, see <see cref="isDirect"/>.
+		/// </summary>
+		/// <param name="filename">File location</param>
+		/// <param name="mode">The mode.</param>
+		/// <param name="direct">Whether to bypass the page cache.</param>
+		RandomAccessFile(const std::string &filename, const Mode mode, const bool direct = false);
+
+		/// <summary>
+		/// Closes the file.
+		/// </summary>
+		~RandomAccessFile();
+
+		RandomAccessFile(const RandomAccessFile&) = delete;
+		RandomAccessFile& operator=(const RandomAccessFile&) = delete;
+
+		/// <summary>
+		/// Reads exactly <paramref name="length"/> bytes at <paramref name="offset"/>.
+		/// </summary>
+		/// <param name="offset">The offset.</param>
+		/// <param name="buffer">The buffer.</param>
+		/// <param name="length">The length.</param>
+		void readAt(const uint64_t offset, unsigned char *buffer, const size_t length) const;
+
+		/// <summary>
+		/// Reads up to <paramref name="length"/> bytes at <paramref name="offset"/>, fewer only at the end of the file.
+		/// </summary>
+		/// <param name="offset">The offset.</param>
+		/// <param name="buffer">The buffer.</param>
+		/// <param name="length">The length.</param>
+		/// <returns>The number of bytes read</returns>
+		size_t readAvailableAt(const uint64_t offset, unsigned char *buffer, const size_t length) const;
+
+		/// <summary>
+		/// Writes <paramref name="length"/> bytes at <paramref name="offset"/>.
+		/// </summary>
+		/// <param name="offset">The offset.</param>
+		/// <param name="buffer">The buffer.</param>
+		/// <param name="length">The length.</param>
+		void writeAt(const uint64_t offset, const unsigned char *buffer, const size_t length);
+
+		/// <summary>
+		/// Gets the file size.
+		/// </summary>
+		/// <returns>The size in bytes</returns>
+		uint64_t size() const;
+
+		/// <summary>
+		/// Extends or truncates the file.
+		/// </summary>
+		/// <param name="size">The new size in bytes.</param>
+		void resize(const uint64_t size);
+
+		/// <summary>
+		/// Allocates the blocks of the first <paramref name="size"/> bytes up front, so a large file is laid out in
+		/// one piece and running out of disk space is reported before anything is written. File systems without
+		/// preallocation only get the file extended.
+		/// </summary>
+		/// <param name="size">The size in bytes.</param>
+		void allocate(const uint64_t size);
+
+		/// <summary>
+		/// Waits until everything written to the file has reached the disk (fsync or FlushFileBuffers).
+		/// </summary>
+		void sync();
+
+		/// <summary>
+		/// Determines whether the file bypasses the page cache.
+		/// </summary>
+		/// <returns></returns>
+		bool isDirect() const { return direct; }
+
+		/// <summary>
+		/// Gets the file location.
+		/// </summary>
+		/// <returns></returns>
+		const std::string & getFilename() const { return filename; }
+
+#ifndef _WIN32
+		/// <summary>
+		/// Gets the file descriptor, for submitting requests to the kernel directly.
+		/// </summary>
+		/// <returns></returns>
+		int descriptor() const { return fd; }
+#endif
+
+	};
+
+	/// <summary>
+	/// A heap buffer aligned for direct I/O.
+	/// </summary>
+	class AlignedBuffer
+	{
+
+	private:
+		unsigned char *address;
+		size_t length;
+
+	public:
+		const static size_t ALIGNMENT = 4096; //bytes, the page size and a multiple of every common sector size
+
+		/// <summary>
+		/// Allocates a buffer. Throws std::bad_alloc on failure.
+		/// </summary>
+		/// <param name="size">The size, a multiple of <see cref="ALIGNMENT"/>.</param>
+		explicit AlignedBuffer(const size_t size);
 
+		/// <summary>
+		/// Frees the buffer.
+		/// </summary>
+		~AlignedBuffer();
+
+		AlignedBuffer(const AlignedBuffer&) = delete;
+		AlignedBuffer& operator=(const AlignedBuffer&) = delete;
+
+		unsigned char * data() { return address; }
+		size_t size() const { return length; }
+
+	};
+
+	/// <summary>
+	/// Reusable <see cref="AlignedBuffer"/>s of one size, so files processed one after another do not allocate and
+	/// fault in fresh buffers. Safe to share between threads.
+	/// </summary>
+	class AlignedBufferPool
+	{
+
+	private:
+		const size_t bufferSize;
+		std::vector<std::unique_ptr<AlignedBuffer>> buffers;
+		std::mutex mutex;
+
+	public:
+
+		/// <summary>
+		/// A buffer taken from the pool, returned to it on destruction.
+		/// </summary>
+		class Lease
+		{
+		private:
+			AlignedBufferPool &pool;
+			std::unique_ptr<AlignedBuffer> buffer;
+
+		public:
+			explicit Lease(AlignedBufferPool &pool);
+			~Lease();
+			Lease(const Lease&) = delete;
+			Lease& operator=(const Lease&) = delete;
+
+			unsigned char * data() { return buffer->data(); }
+			size_t size() const { return buffer->size(); }
+		};
+
+		/// <summary>
+		/// Initializes a new instance of the <see cref="AlignedBufferPool"/> class. Buffers are allocated on demand.
+		/// </summary>
+		/// <param name="bufferSize">Size of every buffer, a multiple of <see cref="AlignedBuffer::ALIGNMENT"/>.</param>
+		explicit AlignedBufferPool(const size_t bufferSize) :bufferSize(bufferSize) {}
+
+	};
+
+	/// <summary>
+	/// A file mapped into memory. Mappings are advised for sequential access.
+	/// </summary>
+	class MappedFile
+	{
+
+	private:
+		std::string filename;
+		unsigned char *address;
+		uint64_t length;
+#ifdef _WIN32
+		void *file;
+		void *mapping;
+#else
+		int fd;
+#endif
+
+		/// <summary>
+		/// Unmaps and closes the file.
+		/// </summary>
+		void release();
+
+	public:
+
+		/// <summary>
+		/// Maps an existing file read-only.
+		/// </summary>
+		/// <param name="filename">File location</param>
+		explicit MappedFile(const std::string &filename);
+
+		/// <summary>
+		/// Creates a file of <paramref name="size"/> bytes, or truncates it if it exists, and maps it read-write.
+		/// The space is allocated up front where the file system supports it, so running out of disk space
+		/// is reported here instead of as a fault while writing to the mapping.
+		/// </summary>
+		/// <param name="filename">File location</param>
+		/// <param name="size">The file size.</param>
+		MappedFile(const std::string &filename, const uint64_t size);
+
+		/// <summary>
+		/// Unmaps and closes the file.
+		/// </summary>
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		/// <summary>
+		/// Gets the mapped bytes.
+		/// </summary>
+		/// <returns></returns>
+		const unsigned char * data() const { return address; }
+		/// <summary>
+		/// Gets the mapped bytes.
+		/// </summary>
+		/// <returns></returns>
+		unsigned char * data() { return address; }
+		/// <summary>
+		/// Gets the size of the mapping.
+		/// </summary>
+		/// <returns></returns>
+		uint64_t size() const { return length; }
+
+		/// <summary>
+		/// Schedules the write-back of modified pages to the file, without waiting for it, so mapped outputs are as
+		/// durable as streamed ones.
+		/// </summary>
+		void flush();
+
+	};
+
+}
@@ -0,0 +1,327 @@
+#include "tclap\CmdLine.h"
+#include "spdlog\spdlog.h"
+#include "../FileEncrypter.h"
+#include "../BufferCipher.h"
+#include "../SegmentCipher.h"
+#include "../CipherSuite.h"
+#include "../Utils.h"
+#include "../GeneralSecurityException.h"
+#include "../IOException.h"
+
+#include <chrono>
+#include <random>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <functional>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+/// <summary>
+/// Micro benchmarks of the cipher, key derivation and I/O helpers, and end-to-end runs of
+/// <see cref="FileEncrypter::encryptFiles"/> and <see cref="FileEncrypter::decryptFiles"/> over a generated corpus.
+/// Every result is one JSON object, so runs of two releases can be compared by name.
+/// </summary>
+class Benchmark
+{
+
+private:
+	struct Result {
+		std::string name;
+		uint64_t size;
+		uint64_t iterations;
+		double seconds;
+	};
+
+	std::vector<Result> results;
+	double minSeconds;
+
+	/// <summary>
+	/// Runs <paramref name="body"/> until at least <see cref="minSeconds"/> have passed, at least once.
+	/// </summary>
+	void measure(const std::string &name, const uint64_t size, const std::function<void()> &body)
+	{
+		uint64_t iterations = 0;
+		const auto start = std::chrono::steady_clock::now();
+		double seconds = 0;
+		do
+		{
+			body();
+			++iterations;
+			seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		} while (seconds < minSeconds);
+
+		results.push_back({ name, size, iterations, seconds });
+		std::cerr << name << " " << size << " : " << std::fixed << std::setprecision(1)
+			<< (size * iterations / seconds / (1 << 20)) << " MiB/s" << std::endl;
+	}
+
+	/// <summary>
+	/// Fills a buffer with bytes from a seeded generator, so every run sees the same data.
+	/// </summary>
+	static void fill(std::mt19937_64 &generator, byte data[], const size_t length)
+	{
+		for (size_t i = 0; i < length; i += 8)
+		{
+			const uint64_t value = generator();
+			std::memcpy(data + i, &value, std::min<size_t>(8, length - i));
+		}
+	}
+
+	/// <summary>
+	/// Writes a file of <paramref name="size"/> generated bytes.
+	/// </summary>
+	static void writeFile(std::mt19937_64 &generator, const filesystem::path &file, const uint64_t size)
+	{
+		std::vector<byte> chunk(1 << 20);
+		std::ofstream ofs(file.string(), std::ios::binary);
+		ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+		for (uint64_t written = 0; written < size; written += chunk.size())
+		{
+			const size_t length = static_cast<size_t>(std::min<uint64_t>(chunk.size(), size - written));
+			fill(generator, chunk.data(), length);
+			ofs.write(reinterpret_cast<const char*>(chunk.data()), length);
+		}
+	}
+
+public:
+	Benchmark(const double minSeconds) :minSeconds(minSeconds) {}
+
+	/// <summary>
+	/// Buffer sizes from 64 B up to <paramref name="maxSize"/>, growing by a factor of four.
+	/// </summary>
+	static std::vector<size_t> sizes(const size_t minSize, const size_t maxSize)
+	{
+		std::vector<size_t> result;
+		for (size_t size = minSize; size <= maxSize; size *= 4) result.push_back(size);
+		return result;
+	}
+
+	void cipher(const size_t maxSize)
+	{
+		std::mt19937_64 generator(1);
+		CryptoPP::SecByteBlock key(32);
+		fill(generator, key, key.size());
+
+		BufferCipher bufferCipher(key);
+		FileEncrypter encrypter;
+		for (const size_t size : sizes(64, maxSize))
+		{
+			std::vector<byte> plaintext(size);
+			fill(generator, plaintext.data(), size);
+			std::vector<byte> sealed(BufferCipher::sealedLength(size));
+
+			measure("gcm_seal", size, [&]() { bufferCipher.seal(plaintext.data(), size, sealed.data(), sealed.size()); });
+			measure("gcm_open", size, [&]() { bufferCipher.open(sealed.data(), sealed.size(), plaintext.data(), plaintext.size()); });
+
+			// legacy files: whole-file GCM with a 32 byte iv
+			byte iv[FileEncrypter::IV_LENGTH];
+			fill(generator, iv, sizeof(iv));
+			std::vector<byte> legacy(size + FileEncrypter::GCM_TAG_LENGTH);
+			CryptoPP::GCM<CryptoPP::AES>::Encryption encryptor;
+			encryptor.SetKey(key, key.size());
+			encryptor.EncryptAndAuthenticate(legacy.data(), legacy.data() + size, FileEncrypter::GCM_TAG_LENGTH, iv, sizeof(iv),
+				nullptr, 0, plaintext.data(), size);
+			measure("legacy_decipher", size, [&]() { encrypter.decipherData(key, iv, legacy.data(), legacy.size(), plaintext.data()); });
+		}
+
+		// one segment of a streamed file, under every suite
+		byte noncePrefix[SegmentCipher::NONCE_PREFIX_LENGTH] = {};
+		std::vector<byte> segment(FileEncrypter::SEGMENT_SIZE);
+		std::vector<byte> sealedSegment(FileEncrypter::SEGMENT_SIZE + SegmentCipher::TAG_LENGTH);
+		fill(generator, segment.data(), segment.size());
+		for (const byte suite : { EncryptedFileHeader::SUITE_AES_256_GCM, EncryptedFileHeader::SUITE_CHACHA20_POLY1305 })
+		{
+			// AES-GCM keeps the unsuffixed names, so results stay comparable with earlier runs
+			const std::string suffix = suite == EncryptedFileHeader::SUITE_AES_256_GCM ? "" : std::string("_") + CipherSuite::name(suite);
+			SegmentCipher segmentCipher(key, suite, noncePrefix, std::vector<byte>(EncryptedFileHeader::AUTHENTICATED_LENGTH));
+			measure("segment_seal" + suffix, segment.size(), [&]() { segmentCipher.sealSegment(0, false, segment.data(), segment.size(), sealedSegment.data()); });
+			measure("segment_open" + suffix, segment.size(), [&]() { segmentCipher.openSegment(0, false, sealedSegment.data(), sealedSegment.size(), segment.data()); });
+		}
+
+		// a small file: every file has its own data key, so its engine is set up for every file
+		const size_t smallFile = 512;
+		measure("small_file_seal", smallFile, [&]() {
+			SegmentCipher fileCipher(key, EncryptedFileHeader::SUITE_AES_256_GCM, noncePrefix, std::vector<byte>(EncryptedFileHeader::AUTHENTICATED_LENGTH), smallFile);
+			fileCipher.sealSegment(0, true, segment.data(), smallFile, sealedSegment.data());
+		});
+	}
+
+	void kdf()
+	{
+		FileEncrypter encrypter;
+		const std::string password = "benchmark password";
+		// getAesKeyAlt takes the salt as a C string
+		char salt[FileEncrypter::SALT_LENGTH + 1] = "0123456789abcdef";
+
+		measure("kdf_pbkdf2", FileEncrypter::KDF_ITERATION_COUNT, [&]() { encrypter.getAesKey(password, salt, FileEncrypter::KDF_ITERATION_COUNT); });
+		measure("kdf_hkdf", 1, [&]() { encrypter.getAesKeyAlt(password, salt); });
+	}
+
+	void io(const filesystem::path &directory, const size_t maxSize)
+	{
+		std::mt19937_64 generator(2);
+		const filesystem::path file = directory / "io.bin";
+		for (const size_t size : sizes(4096, maxSize))
+		{
+			std::vector<byte> data(size);
+			fill(generator, data.data(), size);
+
+			measure("write_all_bytes", size, [&]() { fileUtils::WriteAllBytes(file.string().c_str(), data); });
+			measure("read_all_bytes", size, [&]() { fileUtils::ReadAllBytes(file.string().c_str()); });
+		}
+		filesystem::remove(file);
+	}
+
+	/// <summary>
+	/// Encrypts and decrypts a corpus of generated files, see <see cref="corpus"/>.
+	/// </summary>
+	void endToEnd(const std::string &name, const std::vector<filesystem::path> &files, const unsigned int threads, const fileUtils::IoBackend backend)
+	{
+		uint64_t size = 0;
+		for (const auto &file : files) size += filesystem::file_size(file);
+
+		FileEncrypter encrypter;
+		encrypter.setThreadCount(threads);
+		encrypter.setIoBackend(backend);
+
+		std::vector<filesystem::path> encrypted;
+		measure(name + "_encrypt", size, [&]() {
+			for (const auto &file : encrypted) filesystem::remove(file);
+			encrypted.clear();
+			encrypter.encryptFiles(files, "benchmark password");
+			for (const auto &file : files) encrypted.push_back(filesystem::path(file.string() + ".enc"));
+		});
+
+		// decrypting recreates the originals, so they are moved out of the way once
+		for (const auto &file : files) filesystem::rename(file, filesystem::path(file.string() + ".orig"));
+		measure(name + "_decrypt", size, [&]() {
+			for (const auto &file : files) filesystem::remove(file);
+			encrypter.decryptFiles(encrypted, "benchmark password");
+		});
+		for (const auto &file : files) filesystem::rename(filesystem::path(file.string() + ".orig"), file);
+		for (const auto &file : encrypted) filesystem::remove(file);
+	}
+
+	/// <summary>
+	/// Generates a reproducible corpus: <paramref name="count"/> files with sizes drawn log-uniformly from
+	/// [<paramref name="minSize"/>, <paramref name="maxSize"/>].
+	/// </summary>
+	static std::vector<filesystem::path> corpus(const filesystem::path &directory, const uint64_t seed, const size_t count, const uint64_t minSize, const uint64_t maxSize)
+	{
+		std::mt19937_64 generator(seed);
+		std::uniform_real_distribution<double> exponent(std::log2(static_cast<double>(minSize)), std::log2(static_cast<double>(maxSize)));
+		filesystem::create_directories(directory);
+
+		std::vector<filesystem::path> files;
+		for (size_t i = 0; i < count; ++i)
+		{
+			const uint64_t size = minSize == maxSize ? minSize : static_cast<uint64_t>(std::exp2(exponent(generator)));
+			const filesystem::path file = directory / ("file" + std::to_string(i) + ".bin");
+			writeFile(generator, file, size);
+			files.push_back(file);
+		}
+		return files;
+	}
+
+	void writeJson(std::ostream &out, const unsigned int threads) const
+	{
+		out << "{\n  \"benchmark\": \"gcm-file-encrypter\",\n  \"threads\": " << threads
+			<< ",\n  \"minSeconds\": " << minSeconds << ",\n  \"results\": [\n";
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const Result &r = results[i];
+			out << "    {\"name\": \"" << r.name << "\", \"size\": " << r.size << ", \"iterations\": " << r.iterations
+				<< ", \"seconds\": " << std::setprecision(9) << r.seconds
+				<< ", \"bytesPerSecond\": " << std::setprecision(6) << (r.size * static_cast<double>(r.iterations) / r.seconds)
+				<< "}" << (i + 1 < results.size() ? ",\n" : "\n");
+		}
+		out << "  ]\n}\n";
+	}
+
+};
+
+
+int main(int argc, char* argv[])
+{
+	std::shared_ptr<spdlog::logger> LOG = spdlog::stdout_color_mt("GCM_ENC_BENCHMARK");
+
+	try
+	{
+		TCLAP::CmdLine cmd("GCM File Encrypter benchmarks", ' ', "0.1");
+		TCLAP::ValueArg<std::string> out("o", "out", "JSON output file, stdout if not specified", false, "", "file");
+		TCLAP::ValueArg<std::string> dir("", "dir", "working directory for generated files, the system temp directory if not specified", false, "", "directory");
+		TCLAP::ValueArg<std::string> suites("", "suites", "comma separated list of cipher, kdf, io and e2e", false, "cipher,kdf,io,e2e", "list");
+		TCLAP::ValueArg<unsigned int> maxSize("", "max-size", "largest buffer, in MiB", false, 1024, "unsigned int");
+		TCLAP::ValueArg<unsigned int> hugeSize("", "huge-size", "size of each huge corpus file, in MiB", false, 512, "unsigned int");
+		TCLAP::ValueArg<unsigned int> jobs("j", "jobs", "number of worker threads for the end-to-end runs", false, 1, "unsigned int");
+		TCLAP::ValueArg<double> minTime("", "min-time", "minimum time per measurement, in seconds", false, 0.5, "seconds");
+
+		cmd.add(out);
+		cmd.add(dir);
+		cmd.add(suites);
+		cmd.add(maxSize);
+		cmd.add(hugeSize);
+		cmd.add(jobs);
+		cmd.add(minTime);
+		cmd.parse(argc, argv);
+
+		// the per-file logging of the encrypter would dominate the small-file runs
+		spdlog::set_level(spdlog::level::warn);
+
+		const std::string selected = "," + suites.getValue() + ",";
+		const size_t maxBuffer = static_cast<size_t>(maxSize.getValue()) << 20;
+		const filesystem::path directory = (dir.isSet() ? filesystem::path(dir.getValue()) : filesystem::temp_directory_path()) / "gcm-benchmark";
+		filesystem::create_directories(directory);
+
+		Benchmark benchmark(minTime.getValue());
+		if (selected.find(",cipher,") != std::string::npos) benchmark.cipher(maxBuffer);
+		if (selected.find(",kdf,") != std::string::npos) benchmark.kdf();
+		if (selected.find(",io,") != std::string::npos) benchmark.io(directory, maxBuffer);
+		if (selected.find(",e2e,") != std::string::npos) {
+			const uint64_t huge = static_cast<uint64_t>(hugeSize.getValue()) << 20;
+			const std::vector<filesystem::path> small = Benchmark::corpus(directory / "small", 3, 2000, 1 << 10, 64 << 10);
+			const std::vector<filesystem::path> large = Benchmark::corpus(directory / "huge", 4, 3, huge, huge);
+			const std::vector<filesystem::path> mixed = Benchmark::corpus(directory / "mixed", 5, 200, 1, 64 << 20);
+
+			const fileUtils::IoBackend backends[] = { fileUtils::IoBackend::STREAM, fileUtils::IoBackend::MMAP, fileUtils::IoBackend::DIRECT };
+			for (const fileUtils::IoBackend backend : backends)
+			{
+				const std::string suffix = backend == fileUtils::IoBackend::MMAP ? "_mmap" : backend == fileUtils::IoBackend::DIRECT ? "_direct" : "_stream";
+				benchmark.endToEnd("e2e_small" + suffix, small, jobs.getValue(), backend);
+				benchmark.endToEnd("e2e_huge" + suffix, large, jobs.getValue(), backend);
+				benchmark.endToEnd("e2e_mixed" + suffix, mixed, jobs.getValue(), backend);
+			}
+		}
+		filesystem::remove_all(directory);
+
+		if (out.isSet()) {
+			std::ofstream ofs(out.getValue());
+			benchmark.writeJson(ofs, jobs.getValue());
+		}
+		else benchmark.writeJson(std::cout, jobs.getValue());
+	}
+	catch (const TCLAP::ArgException &e)
+	{
+		LOG->critical(e.what());
+		return 1;
+	}
+	catch (const GeneralSecurityException &e)
+	{
+		LOG->critical(e.what());
+		return 1;
+	}
+	catch (const IOException &e)
+	{
+		LOG->critical(e.what());
+		return 1;
+	}
+	catch (const filesystem::filesystem_error &e)
+	{
+		LOG->critical(e.what());
+		return 1;
+	}
+
+	return 0;
+}